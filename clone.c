@@ -77,6 +77,12 @@
 extern void print_user_desc(struct tcb *, long);
 #endif /* I386 || X86_64 || X32 */
 
+unsigned long
+get_clone_flags(struct tcb *tcp)
+{
+	return tcp->u_arg[ARG_FLAGS];
+}
+
 SYS_FUNC(clone)
 {
 	if (exiting(tcp)) {
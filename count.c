@@ -34,38 +34,243 @@
  */
 
 #include "defs.h"
+#include "json.h"
+#include "structured_fmt_json.h"
+
+/*
+ * Histogram of syscall times in microseconds, of buckets growing
+ * in powers of two, each split into LAT_SUB_COUNT equal parts:
+ * times below LAT_SUB_COUNT are counted exactly, greater times
+ * with a relative error below 1 / LAT_SUB_COUNT.
+ */
+#define LAT_SUB_BITS	5
+#define LAT_SUB_COUNT	(1U << LAT_SUB_BITS)
+/* Times of 2^LAT_MAX_BITS usecs (about 12 days) and more share a bucket */
+#define LAT_MAX_BITS	40
+#define LAT_BUCKETS	((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
 
 /* Per-syscall stats structure */
 struct call_counts {
 	/* time may be total latency or system time */
 	struct timeval time;
 	int calls, errors;
+	/* the longest time, and all of them in a histogram */
+	struct timeval max;
+	unsigned int *hist;
 };
 
-static struct call_counts *countv[SUPPORTED_PERSONALITIES];
+static struct call_counts *all_countv[SUPPORTED_PERSONALITIES];
+/* -R: the counts since the previous report, and its time */
+static struct call_counts *report_countv[SUPPORTED_PERSONALITIES];
+static struct timeval report_tv;
+/* The interval of the report being printed */
+static const struct timeval *report_interval;
+/* The counts being printed, of all processes or of one of them */
+static struct call_counts **countv = all_countv;
 #define counts (countv[current_personality])
 
+/* Counts of a process (-g) or a thread (-gg) */
+struct proc_counts {
+	struct proc_counts *next;
+	int pid;
+	/* Its traced threads, the process has exited when there are none */
+	unsigned int refcount;
+	/* Time of all its syscalls, to find the greatest ones */
+	struct timeval time;
+	struct call_counts *countv[SUPPORTED_PERSONALITIES];
+};
+
+static struct proc_counts *proc_counts;
+/* Exited processes that are kept, unless the list grows too long */
+static unsigned int proc_counts_exited;
+/* The processes that are not kept */
+static struct proc_counts exited_counts;
+#define EXITED_COUNTS_MAX 64
+
+/* Until a syscall is counted, it is this placeholder */
+static const struct timeval shortest_none = { 1000000, 0 };
 static struct timeval shortest = { 1000000, 0 };
 
+static unsigned int
+lat_bucket(unsigned long long usec)
+{
+	unsigned int shift = 0;
+
+	while ((usec >> shift) >= 2 * LAT_SUB_COUNT)
+		shift++;
+	if (shift >= LAT_MAX_BITS - LAT_SUB_BITS)
+		return LAT_BUCKETS - 1;
+
+	return shift * LAT_SUB_COUNT + (usec >> shift);
+}
+
+/* The greatest time counted in the bucket */
+static unsigned long long
+lat_bucket_max(unsigned int bucket)
+{
+	unsigned int shift = bucket < LAT_SUB_COUNT ?
+			     0 : bucket / LAT_SUB_COUNT - 1;
+
+	return (((unsigned long long) bucket - shift * LAT_SUB_COUNT + 1)
+		<< shift) - 1;
+}
+
+static void
+lat_count(struct call_counts *cc, const struct timeval *tv)
+{
+	if (!cc->hist)
+		cc->hist = xcalloc(LAT_BUCKETS, sizeof(*cc->hist));
+	cc->hist[lat_bucket(tv->tv_sec * 1000000ULL + tv->tv_usec)]++;
+
+	if (tv_cmp(tv, &cc->max) > 0)
+		cc->max = *tv;
+}
+
+static void
+count_call(struct call_counts **cv, struct tcb *tcp, const struct timeval *tv)
+{
+	struct call_counts *cc;
+
+	if (!cv[current_personality])
+		cv[current_personality] = xcalloc(nsyscalls, sizeof(*cc));
+	cc = &cv[current_personality][tcp->scno];
+
+	cc->calls++;
+	if (tcp->u_error)
+		cc->errors++;
+	tv_add(&cc->time, &cc->time, tv);
+	lat_count(cc, tv);
+}
+
+static struct proc_counts *
+proc_counts_get(struct tcb *tcp)
+{
+	struct proc_counts *pc;
+	unsigned int threads;
+	int pid = tcp->pid;
+
+	if (tcp->proc_counts)
+		return tcp->proc_counts;
+
+	if (count_procs < 2)
+		read_proc_status(tcp->pid, &pid, &threads);
+
+	/* The pid of an exited process may be reused */
+	for (pc = proc_counts; pc; pc = pc->next)
+		if (pc->pid == pid && pc->refcount)
+			break;
+
+	if (!pc) {
+		pc = xcalloc(1, sizeof(*pc));
+		pc->pid = pid;
+		pc->next = proc_counts;
+		proc_counts = pc;
+	}
+
+	pc->refcount++;
+	tcp->proc_counts = pc;
+
+	return pc;
+}
+
+static void
+call_counts_add(struct call_counts **to, struct call_counts **from)
+{
+	unsigned int i, j, pers;
+
+	for (pers = 0; pers < SUPPORTED_PERSONALITIES; pers++) {
+		if (!from[pers])
+			continue;
+		if (!to[pers])
+			to[pers] = xcalloc(nsyscalls, sizeof(**to));
+
+		for (i = 0; i < nsyscalls; i++) {
+			struct call_counts *t = &to[pers][i];
+			struct call_counts *f = &from[pers][i];
+
+			if (!f->calls)
+				continue;
+			t->calls += f->calls;
+			t->errors += f->errors;
+			tv_add(&t->time, &t->time, &f->time);
+			if (tv_cmp(&f->max, &t->max) > 0)
+				t->max = f->max;
+			if (!t->hist)
+				t->hist = xcalloc(LAT_BUCKETS, sizeof(*t->hist));
+			for (j = 0; j < LAT_BUCKETS; j++)
+				t->hist[j] += f->hist[j];
+		}
+	}
+}
+
+static void
+call_counts_free(struct call_counts **cv)
+{
+	unsigned int i, pers;
+
+	for (pers = 0; pers < SUPPORTED_PERSONALITIES; pers++) {
+		for (i = 0; cv[pers] && i < nsyscalls; i++)
+			free(cv[pers][i].hist);
+		free(cv[pers]);
+		cv[pers] = NULL;
+	}
+}
+
+/*
+ * Folds the exited process with the least time into exited_counts,
+ * so that the counts of the greatest ones are kept.
+ */
+static void
+proc_counts_fold(void)
+{
+	struct proc_counts **p, **min = NULL;
+	struct proc_counts *pc;
+
+	for (p = &proc_counts; *p; p = &(*p)->next)
+		if (!(*p)->refcount &&
+		    (!min || tv_cmp(&(*p)->time, &(*min)->time) < 0))
+			min = p;
+
+	pc = *min;
+	*min = pc->next;
+	proc_counts_exited--;
+
+	call_counts_add(exited_counts.countv, pc->countv);
+	tv_add(&exited_counts.time, &exited_counts.time, &pc->time);
+	/* The number of processes folded */
+	exited_counts.pid++;
+
+	call_counts_free(pc->countv);
+	free(pc);
+}
+
+void
+count_release(struct tcb *tcp)
+{
+	struct proc_counts *pc = tcp->proc_counts;
+
+	if (!pc)
+		return;
+	tcp->proc_counts = NULL;
+
+	if (--pc->refcount)
+		return;
+
+	if (++proc_counts_exited >
+	    (count_procs_top ? count_procs_top : EXITED_COUNTS_MAX))
+		proc_counts_fold();
+}
+
 void
 count_syscall(struct tcb *tcp, const struct timeval *syscall_exiting_tv)
 {
 	struct timeval wtv;
 	struct timeval *tv = &wtv;
-	struct call_counts *cc;
 	unsigned long scno = tcp->scno;
 
 	if (!SCNO_IN_RANGE(scno))
 		return;
 
-	if (!counts)
-		counts = xcalloc(nsyscalls, sizeof(*counts));
-	cc = &counts[scno];
-
-	cc->calls++;
-	if (tcp->u_error)
-		cc->errors++;
-
 	/* tv = wall clock time spent while in syscall */
 	tv_sub(tv, syscall_exiting_tv, &tcp->etime);
 
@@ -75,13 +280,15 @@ count_syscall(struct tcb *tcp, const struct timeval *syscall_exiting_tv)
 
 		if (one_tick.tv_sec == -1) {
 			/* Initialize it.  */
-			struct itimerval it;
+			struct itimerval it, report_timer;
 
 			memset(&it, 0, sizeof it);
 			it.it_interval.tv_usec = 1;
-			setitimer(ITIMER_REAL, &it, NULL);
+			setitimer(ITIMER_REAL, &it, &report_timer);
 			getitimer(ITIMER_REAL, &it);
 			one_tick = it.it_interval;
+			/* Restore the timer of -R */
+			setitimer(ITIMER_REAL, &report_timer, NULL);
 //FIXME: this hack doesn't work (tested on linux-3.6.11): one_tick = 0.000000
 //tprintf(" one_tick.tv_usec:%u\n", (unsigned)one_tick.tv_usec);
 		}
@@ -99,7 +306,26 @@ count_syscall(struct tcb *tcp, const struct timeval *syscall_exiting_tv)
 	}
 	if (tv_cmp(tv, &shortest) < 0)
 		shortest = *tv;
-	tv_add(&cc->time, &cc->time, count_wallclock ? &wtv : tv);
+	if (count_wallclock)
+		tv = &wtv;
+	count_call(all_countv, tcp, tv);
+	if (count_reports)
+		count_call(report_countv, tcp, tv);
+
+	if (count_procs) {
+		struct proc_counts *pc = proc_counts_get(tcp);
+
+		count_call(pc->countv, tcp, tv);
+		tv_add(&pc->time, &pc->time, tv);
+	}
+
+#ifdef USE_LIBUNWIND
+	/* -c -k: the off-CPU profile is of the time blocked in syscalls */
+	if (stack_trace_enabled && cflag == CFLAG_ONLY_STATS)
+		unwind_count_syscall(tcp,
+				     count_procs ? proc_counts_get(tcp)->pid : 0,
+				     &wtv);
+#endif
 }
 
 static int
@@ -128,6 +354,8 @@ count_cmp(void *a, void *b)
 
 static int (*sortfun)();
 static struct timeval overhead = { -1, -1 };
+/* The overhead subtracted in the summary being printed */
+static struct timeval summary_overhead;
 
 void
 set_sortby(const char *sortby)
@@ -151,44 +379,211 @@ void set_overhead(int n)
 	overhead.tv_usec = n % 1000000;
 }
 
+/* Percentiles of syscall times printed with -H and in JSON */
+static const unsigned int percentiles[] = { 50, 90, 99 };
+
+/* Subtracts the overhead, like the average time is adjusted */
+static unsigned long long
+lat_adjust(unsigned long long usec)
+{
+	unsigned long long o = summary_overhead.tv_sec * 1000000ULL
+			       + summary_overhead.tv_usec;
+
+	return usec > o ? usec - o : 0;
+}
+
+static unsigned long long
+lat_percentile(const unsigned int *hist, unsigned int calls,
+	       unsigned int percentile, const struct timeval *max)
+{
+	unsigned long long rank = ((unsigned long long) calls * percentile
+				   + 99) / 100;
+	unsigned long long max_usec = max->tv_sec * 1000000ULL + max->tv_usec;
+	unsigned long long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LAT_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return lat_adjust(MIN(lat_bucket_max(i), max_usec));
+}
+
 static void
-call_summary_pers(FILE *outf)
+lat_print(FILE *outf, const unsigned int *hist, unsigned int calls,
+	  const struct timeval *max)
 {
 	unsigned int i;
-	int     call_cum, error_cum;
-	struct timeval tv_cum, dtv;
+
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++)
+		fprintf(outf, " %9llu",
+			lat_percentile(hist, calls, percentiles[i], max));
+	fprintf(outf, " %9llu",
+		lat_adjust(max->tv_sec * 1000000ULL + max->tv_usec));
+}
+
+static void
+lat_write_json(JsonWriter *w, const unsigned int *hist, unsigned int calls,
+	       const struct timeval *max)
+{
+	char key[sizeof("p") + sizeof(int) * 3];
+	unsigned int i;
+
+	json_write_begin_object(w, "latency");
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+		sprintf(key, "p%u", percentiles[i]);
+		json_write_integer(w, key,
+			lat_percentile(hist, calls, percentiles[i], max),
+			JSON_INT_UNSIGNED);
+	}
+	json_write_integer(w, "max",
+		lat_adjust(max->tv_sec * 1000000ULL + max->tv_usec),
+		JSON_INT_UNSIGNED);
+	json_write_end_object(w);
+}
+
+/* The summary as a JSON object, with -j json */
+static void
+call_summary_json(FILE *outf, const struct proc_counts *pc,
+		  const int *sorted_count, const struct call_counts *total)
+{
+	JsonWriter w;
+	double float_tv_cum = tv_float(&total->time);
+	unsigned int i;
+
+	json_writer_init(&w, "\t");
+	json_write_begin_object(&w, NULL);
+	if (pc == &exited_counts)
+		json_write_integer(&w, "exited", pc->pid, JSON_INT_UNSIGNED);
+	else if (pc)
+		json_write_integer(&w, count_procs > 1 ? "tid" : "pid",
+			pc->pid, JSON_INT_SIGNED);
+	if (report_interval) {
+		json_write_number(&w, "start", tv_float(&report_interval[0]));
+		json_write_number(&w, "end", tv_float(&report_interval[1]));
+	}
+	json_write_integer(&w, "wordsize", current_wordsize * 8,
+		JSON_INT_UNSIGNED);
+
+	json_write_begin_array(&w, "syscalls");
+	for (i = 0; counts && i < nsyscalls; i++) {
+		int idx = sorted_count[i];
+		struct call_counts *cc = &counts[idx];
+		struct timeval dtv;
+		double percent;
+
+		if (cc->calls == 0)
+			continue;
+		tv_div(&dtv, &cc->time, cc->calls);
+		percent = 100.0 * tv_float(&cc->time);
+		if (percent != 0.0)
+			percent /= float_tv_cum;
+
+		json_write_begin_object(&w, NULL);
+		json_write_string(&w, "name", sysent[idx].sys_name);
+		json_write_number(&w, "percent", percent);
+		json_write_number(&w, "seconds", tv_float(&cc->time));
+		json_write_integer(&w, "usecs_per_call",
+			1000000ULL * dtv.tv_sec + dtv.tv_usec,
+			JSON_INT_UNSIGNED);
+		json_write_integer(&w, "calls", cc->calls, JSON_INT_UNSIGNED);
+		json_write_integer(&w, "errors", cc->errors,
+			JSON_INT_UNSIGNED);
+		lat_write_json(&w, cc->hist, cc->calls, &cc->max);
+		json_write_end_object(&w);
+	}
+	json_write_end_array(&w);
+
+	json_write_begin_object(&w, "total");
+	json_write_number(&w, "seconds", float_tv_cum);
+	json_write_integer(&w, "calls", total->calls, JSON_INT_UNSIGNED);
+	json_write_integer(&w, "errors", total->errors, JSON_INT_UNSIGNED);
+	lat_write_json(&w, total->hist, total->calls, &total->max);
+	json_write_end_object(&w);
+
+	json_write_end_object(&w);
+	fprintf(outf, "%s\n", json_writer_finish(&w));
+	json_writer_free(&w);
+}
+
+static void
+call_summary_pers(FILE *outf, const struct proc_counts *pc)
+{
+	unsigned int i, j;
+	struct call_counts total;
+	struct timeval dtv;
 	double  float_tv_cum;
 	double  percent;
 	const char *dashes = "----------------";
 	char    error_str[sizeof(int)*3];
 	int    *sorted_count;
+	bool json = s_printer_cur == &s_printer_json;
 
-	fprintf(outf, "%6.6s %11.11s %11.11s %9.9s %9.9s %s\n",
-		"% time", "seconds", "usecs/call",
-		"calls", "errors", "syscall");
-	fprintf(outf, "%6.6s %11.11s %11.11s %9.9s %9.9s %s\n",
-		dashes, dashes, dashes, dashes, dashes, dashes);
+	memset(&total, 0, sizeof(total));
+	if (json || count_percentiles)
+		total.hist = xcalloc(LAT_BUCKETS, sizeof(*total.hist));
 
 	sorted_count = xcalloc(sizeof(int), nsyscalls);
-	call_cum = error_cum = tv_cum.tv_sec = tv_cum.tv_usec = 0;
-	if (overhead.tv_sec == -1) {
-		tv_mul(&overhead, &shortest, 8);
-		tv_div(&overhead, &overhead, 10);
+	summary_overhead = overhead;
+	if (summary_overhead.tv_sec == -1) {
+		/*
+		 * The shortest time may still decrease until the summary
+		 * of the whole trace, so -R reports do not fix the overhead.
+		 */
+		if (tv_cmp(&shortest, &shortest_none) < 0) {
+			tv_mul(&summary_overhead, &shortest, 8);
+			tv_div(&summary_overhead, &summary_overhead, 10);
+		} else {
+			memset(&summary_overhead, 0, sizeof(summary_overhead));
+		}
+		if (!report_interval)
+			overhead = summary_overhead;
 	}
 	for (i = 0; i < nsyscalls; i++) {
 		sorted_count[i] = i;
 		if (counts == NULL || counts[i].calls == 0)
 			continue;
-		tv_mul(&dtv, &overhead, counts[i].calls);
+		tv_mul(&dtv, &summary_overhead, counts[i].calls);
 		tv_sub(&counts[i].time, &counts[i].time, &dtv);
-		call_cum += counts[i].calls;
-		error_cum += counts[i].errors;
-		tv_add(&tv_cum, &tv_cum, &counts[i].time);
+		total.calls += counts[i].calls;
+		total.errors += counts[i].errors;
+		tv_add(&total.time, &total.time, &counts[i].time);
+		if (tv_cmp(&counts[i].max, &total.max) > 0)
+			total.max = counts[i].max;
+		for (j = 0; total.hist && j < LAT_BUCKETS; j++)
+			total.hist[j] += counts[i].hist[j];
+	}
+	float_tv_cum = tv_float(&total.time);
+	if (counts && sortfun)
+		qsort((void *) sorted_count, nsyscalls, sizeof(int), sortfun);
+
+	if (json) {
+		call_summary_json(outf, pc, sorted_count, &total);
+		free(sorted_count);
+		free(total.hist);
+		return;
 	}
-	float_tv_cum = tv_float(&tv_cum);
+
+	fprintf(outf, "%6.6s %11.11s %11.11s", "% time", "seconds",
+		"usecs/call");
+	if (count_percentiles) {
+		for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+			char name[sizeof("p") + sizeof(int) * 3];
+
+			sprintf(name, "p%u", percentiles[i]);
+			fprintf(outf, " %9.9s", name);
+		}
+		fprintf(outf, " %9.9s", "max");
+	}
+	fprintf(outf, " %9.9s %9.9s %s\n", "calls", "errors", "syscall");
+	fprintf(outf, "%6.6s %11.11s %11.11s", dashes, dashes, dashes);
+	for (i = 0; count_percentiles && i <= ARRAY_SIZE(percentiles); i++)
+		fprintf(outf, " %9.9s", dashes);
+	fprintf(outf, " %9.9s %9.9s %s\n", dashes, dashes, dashes);
+
 	if (counts) {
-		if (sortfun)
-			qsort((void *) sorted_count, nsyscalls, sizeof(int), sortfun);
 		for (i = 0; i < nsyscalls; i++) {
 			double float_syscall_time;
 			int idx = sorted_count[i];
@@ -204,43 +599,167 @@ call_summary_pers(FILE *outf)
 			if (percent != 0.0)
 				   percent /= float_tv_cum;
 			/* else: float_tv_cum can be 0.0 too and we get 0/0 = NAN */
-			fprintf(outf, "%6.2f %11.6f %11lu %9u %9.9s %s\n",
+			fprintf(outf, "%6.2f %11.6f %11lu",
 				percent, float_syscall_time,
-				(long) (1000000 * dtv.tv_sec + dtv.tv_usec),
+				(long) (1000000 * dtv.tv_sec + dtv.tv_usec));
+			if (count_percentiles)
+				lat_print(outf, cc->hist, cc->calls, &cc->max);
+			fprintf(outf, " %9u %9.9s %s\n",
 				cc->calls,
 				error_str, sysent[idx].sys_name);
 		}
 	}
 	free(sorted_count);
 
-	fprintf(outf, "%6.6s %11.11s %11.11s %9.9s %9.9s %s\n",
-		dashes, dashes, dashes, dashes, dashes, dashes);
+	fprintf(outf, "%6.6s %11.11s %11.11s", dashes, dashes, dashes);
+	for (i = 0; count_percentiles && i <= ARRAY_SIZE(percentiles); i++)
+		fprintf(outf, " %9.9s", dashes);
+	fprintf(outf, " %9.9s %9.9s %s\n", dashes, dashes, dashes);
 	error_str[0] = '\0';
-	if (error_cum)
-		sprintf(error_str, "%u", error_cum);
-	fprintf(outf, "%6.6s %11.6f %11.11s %9u %9.9s %s\n",
-		"100.00", float_tv_cum, "",
-		call_cum, error_str, "total");
+	if (total.errors)
+		sprintf(error_str, "%u", total.errors);
+	fprintf(outf, "%6.6s %11.6f %11.11s", "100.00", float_tv_cum, "");
+	if (count_percentiles)
+		lat_print(outf, total.hist, total.calls, &total.max);
+	fprintf(outf, " %9u %9.9s %s\n", total.calls, error_str, "total");
+	free(total.hist);
 }
 
-void
-call_summary(FILE *outf)
+/* Prints the counts of CV, of the process PC or of all if it is NULL */
+static void
+call_summary_countv(FILE *outf, struct call_counts **cv,
+		    const struct proc_counts *pc)
 {
 	unsigned int i, old_pers = current_personality;
+	bool json = s_printer_cur == &s_printer_json;
+	const char *what = count_procs > 1 ? "thread" : "process";
+	char who[sizeof("%s from HH:MM:SS to HH:MM:SS") +
+		 sizeof("all processes")];
+
+	if (report_interval) {
+		char start[sizeof("HH:MM:SS")];
+		char end[sizeof("HH:MM:SS")];
+		time_t t;
 
+		t = report_interval[0].tv_sec;
+		strftime(start, sizeof(start), "%T", localtime(&t));
+		t = report_interval[1].tv_sec;
+		strftime(end, sizeof(end), "%T", localtime(&t));
+		sprintf(who, "%s from %s to %s",
+			count_procs > 1 ? "all threads" : "all processes",
+			start, end);
+	} else if (pc == &exited_counts)
+		sprintf(who, "%d other exited %s%s", pc->pid,
+			what, pc->pid > 1 ? (count_procs > 1 ? "s" : "es") : "");
+	else if (pc)
+		sprintf(who, "%s %d", what, pc->pid);
+	else
+		strcpy(who, count_procs > 1 ? "all threads" : "all processes");
+
+	countv = cv;
 	for (i = 0; i < SUPPORTED_PERSONALITIES; ++i) {
 		if (!countv[i])
 			continue;
 
 		if (current_personality != i)
 			set_personality(i);
-		if (i)
-			fprintf(outf,
-				"System call usage summary for %d bit mode:\n",
-				current_wordsize * 8);
-		call_summary_pers(outf);
+		/* JSON objects have "pid" and "wordsize" members instead */
+		if (!json && (count_procs || report_interval || i)) {
+			fputs("System call usage summary for ", outf);
+			if (count_procs || report_interval)
+				fprintf(outf, i ? "%s in " : "%s", who);
+			if (i)
+				fprintf(outf, "%d bit mode",
+					current_wordsize * 8);
+			fputs(":\n", outf);
+		}
+		call_summary_pers(outf, pc);
 	}
+	countv = all_countv;
 
 	if (old_pers != current_personality)
 		set_personality(old_pers);
 }
+
+static int
+proc_counts_cmp(const void *a, const void *b)
+{
+	const struct proc_counts *pa = *(const struct proc_counts **) a;
+	const struct proc_counts *pb = *(const struct proc_counts **) b;
+	int rc = -tv_cmp(&pa->time, &pb->time);
+
+	return rc ? rc : pa->pid - pb->pid;
+}
+
+void
+call_summary(FILE *outf)
+{
+	struct proc_counts **sorted = NULL;
+	struct proc_counts *pc;
+	unsigned int i, n = 0;
+
+#ifdef USE_LIBUNWIND
+	if (stack_trace_enabled && cflag == CFLAG_ONLY_STATS) {
+		unwind_print_folded(outf);
+		return;
+	}
+#endif
+
+	for (pc = proc_counts; pc; pc = pc->next)
+		n++;
+	if (n) {
+		sorted = xcalloc(n, sizeof(*sorted));
+		for (i = 0, pc = proc_counts; pc; pc = pc->next)
+			sorted[i++] = pc;
+		qsort(sorted, n, sizeof(*sorted), proc_counts_cmp);
+		if (count_procs_top && n > count_procs_top)
+			n = count_procs_top;
+	}
+
+	for (i = 0; i < n; i++)
+		call_summary_countv(outf, sorted[i]->countv, sorted[i]);
+	free(sorted);
+	if (exited_counts.pid)
+		call_summary_countv(outf, exited_counts.countv, &exited_counts);
+
+	call_summary_countv(outf, all_countv, NULL);
+}
+
+/* Starts counting for -R, and the timer of reports every INTERVAL seconds */
+void
+count_report_init(unsigned int interval)
+{
+	struct itimerval it;
+
+	gettimeofday(&report_tv, NULL);
+	if (!interval)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = it.it_interval.tv_sec = interval;
+	if (setitimer(ITIMER_REAL, &it, NULL) < 0)
+		perror_msg_and_die("setitimer");
+}
+
+/* Prints the counts since the previous report, and starts counting anew */
+void
+count_report(FILE *outf)
+{
+	struct timeval interval[2];
+
+	interval[0] = report_tv;
+	gettimeofday(&interval[1], NULL);
+	report_tv = interval[1];
+
+	/* An interval without syscalls is reported too */
+	if (!report_countv[current_personality])
+		report_countv[current_personality] =
+			xcalloc(nsyscalls, sizeof(struct call_counts));
+
+	report_interval = interval;
+	call_summary_countv(outf, report_countv, NULL);
+	report_interval = NULL;
+
+	call_counts_free(report_countv);
+	fflush(outf);
+}
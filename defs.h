@@ -222,12 +222,19 @@ typedef struct ioctlent {
 
 /* Trace Control Block */
 struct tcb {
+	/*
+	 * Fields used on every ptrace stop go first,
+	 * so that they share as few cache lines as possible.
+	 */
 	int flags;		/* See below for TCB_ values */
 	int pid;		/* If 0, this tcb is free */
+	struct tcb *next;	/* Next tcb in pid hash chain or in free list */
 	int qual_flg;		/* qual_flags[scno] or DEFAULT_QUAL_FLAGS + RAW */
 	int sys_res;		/* Syscall parser return value */
 	int u_error;		/* Error code */
+	int sys_func_rval;	/* Syscall entry parser's return value */
 	long scno;		/* System call number */
+	const struct_sysent *s_ent; /* sysent[scno] or dummy struct for bad scno */
 	long u_arg[MAX_ARGS];	/* System call arguments */
 #if HAVE_STRUCT_TCB_EXT_ARG
 	long long ext_arg[MAX_ARGS];
@@ -237,25 +244,27 @@ struct tcb {
 #if SUPPORTED_PERSONALITIES > 1
 	unsigned int currpers;	/* Personality at the time of scno update */
 #endif
-	int sys_func_rval;	/* Syscall entry parser's return value */
 	int curcol;		/* Output column for this process */
 	FILE *outf;		/* Output file for this process */
+	struct s_syscall *s_syscall; /* Structured output's list's head */
+	struct s_arena *s_arena;	/* Spare memory for the next s_syscall */
+	void *s_printer_data;	/* State of the formatter for the process */
 	const char *auxstr;	/* Auxiliary info from syscall (see RVAL_STR) */
+
+	/* Fields used only by some decoders or options. */
 	void *_priv_data;	/* Private data for syscall decoding functions */
 	void (*_free_priv_data)(void *); /* Callback for freeing priv_data */
-	const struct_sysent *s_ent; /* sysent[scno] or dummy struct for bad scno */
 	const struct_sysent *s_prev_ent; /* for "resuming interrupted SYSCALL" msg */
 	struct timeval stime;	/* System time usage as of last process wait */
 	struct timeval dtime;	/* Delta for system time usage */
 	struct timeval etime;	/* Syscall entry time */
-	struct s_syscall *s_syscall; /* Structured output's list's head */
+	struct fdtable *fdtable; /* Descriptor table cache for -y and -P */
+	struct proc_counts *proc_counts; /* Syscall counts of the process for -g */
 
 #ifdef USE_LIBUNWIND
 	struct UPT_info* libunwind_ui;
-	struct mmap_cache_t* mmap_cache;
-	unsigned int mmap_cache_size;
-	unsigned int mmap_cache_generation;
-	struct queue_t* queue;
+	struct mmap_cache *mmap_cache; /* Shared by the thread group */
+	struct unwind_queue *queue;
 #endif
 };
 
@@ -397,10 +406,16 @@ extern bool debug_flag;
 extern bool Tflag;
 extern bool iflag;
 extern bool count_wallclock;
+extern bool count_percentiles;
+extern unsigned int count_procs;
+extern unsigned int count_procs_top;
+extern bool count_reports;
 extern unsigned int qflag;
 extern unsigned int tflag;
 extern bool rflag;
+extern bool Qflag;
 extern bool print_pid_pfx;
+extern unsigned long long print_seq;
 extern unsigned int show_fd_path;
 extern enum s_syscall_show_arg show_arg_names;
 extern enum s_syscall_show_arg show_arg_comments;
@@ -410,9 +425,15 @@ extern const char **paths_selected;
 #define tracing_paths (paths_selected != NULL)
 extern unsigned xflag;
 extern unsigned followfork;
+/* are we prefiltering syscalls with seccomp-bpf? */
+extern bool seccomp_filtering;
 #ifdef USE_LIBUNWIND
-/* if this is true do the stack trace for every system call */
-extern bool stack_trace_enabled;
+/* 1: print the stack trace of every system call, 2: without symbols */
+extern unsigned int stack_trace_enabled;
+/* print every stack trace once, referenced by id (-K) */
+extern bool stack_trace_ids;
+/* walk the frame pointers instead of using libunwind (-U fp) */
+extern bool stack_trace_fp;
 #endif
 extern unsigned ptrace_setoptions;
 extern unsigned max_strlen;
@@ -453,9 +474,16 @@ extern void set_sortby(const char *);
 extern void set_overhead(int);
 extern void qualify(const char *);
 extern void print_pc(struct tcb *);
+extern bool get_frame_regs(struct tcb *, unsigned long *pc,
+			   unsigned long *sp, unsigned long *fp);
 extern int trace_syscall(struct tcb *);
+extern void replay_syscall_entering(struct tcb *, int qual_flg);
+extern void replay_syscall_exiting(struct tcb *, const struct timeval *);
 extern void count_syscall(struct tcb *, const struct timeval *);
 extern void call_summary(FILE *);
+extern void count_release(struct tcb *);
+extern void count_report_init(unsigned int interval);
+extern void count_report(FILE *);
 
 extern void clear_regs(void);
 extern void get_regs(pid_t pid);
@@ -488,6 +516,37 @@ extern int umoven_or_printaddr(struct tcb *, long, unsigned int, void *);
 #define umove_or_printaddr(pid, addr, objp)	\
 	umoven_or_printaddr((pid), (addr), sizeof(*(objp)), (void *) (objp))
 extern int umovestr(struct tcb *, long, unsigned int, char *);
+extern void umove_cache_invalidate(void);
+extern unsigned long umove_cache_hits;
+extern unsigned long umove_cache_misses;
+/*
+ * -j binary,raw records the tracee memory read while decoding,
+ * -L reads the recorded memory instead of the tracee one.
+ */
+extern bool record_raw;
+extern bool replay_raw;
+extern void record_mem(struct tcb *, long addr, unsigned int len,
+		       const void *laddr, int rc, bool str);
+extern int replay_mem(struct tcb *, long addr, unsigned int len,
+		      void *laddr, bool str);
+
+struct umove_array {
+	unsigned long start;
+	unsigned long end;
+	char *buf;
+	size_t size;
+	bool failed;
+};
+
+extern const void *umove_array_elem(struct tcb *, struct umove_array *,
+				    unsigned long addr, unsigned long end_addr,
+				    size_t elem_size);
+extern void umove_array_free(struct umove_array *);
+extern void umove_prefetch_iov(struct tcb *, unsigned long len,
+			       unsigned long addr, unsigned long data_size,
+			       unsigned long buf_limit);
+extern unsigned long umove_gather_reads;
+extern unsigned long umove_gather_bufs;
 extern int upeek(int pid, long, long *);
 
 extern bool
@@ -517,9 +576,27 @@ extern long getrval2(struct tcb *);
 extern const char *signame(const int);
 extern void pathtrace_select(const char *);
 extern int pathtrace_match(struct tcb *);
+
+extern void check_seccomp_filter(void);
+extern void init_seccomp_filter(void);
+
 extern int getfdpath(struct tcb *, int, char *, unsigned);
 extern enum sock_proto getfdproto(struct tcb *, int);
 
+extern bool fdtable_get_path(struct tcb *, int fd, char *buf,
+			     unsigned int bufsize, ssize_t *len);
+extern void fdtable_set_path(struct tcb *, int fd, const char *path,
+			     ssize_t len);
+extern bool fdtable_get_proto(struct tcb *, int fd, enum sock_proto *);
+extern void fdtable_set_proto(struct tcb *, int fd, enum sock_proto);
+extern bool fdtable_syscall(const struct_sysent *);
+extern void fdtable_update(struct tcb *);
+extern void fdtable_release(struct tcb *);
+extern unsigned long fdtable_hits;
+extern unsigned long fdtable_misses;
+
+extern unsigned long get_clone_flags(struct tcb *);
+
 extern const char *xlookup(const struct xlat *, const uint64_t);
 extern const char *xlat_search(const struct xlat *, const size_t, const uint64_t);
 
@@ -527,6 +604,7 @@ extern unsigned long get_pagesize(void);
 extern int string_to_uint(const char *str);
 extern int next_set_bit(const void *bit_array, unsigned cur_bit, unsigned size_bits);
 unsigned int popcount32(const uint32_t *a, unsigned int size);
+extern void read_proc_status(int pid, int *tgid, unsigned int *threads);
 
 #define QUOTE_0_TERMINATED			0x01
 #define QUOTE_OMIT_LEADING_TRAILING_QUOTES	0x02
@@ -623,6 +701,8 @@ extern void printfd(struct tcb *, int);
 extern void print_sockaddr(struct tcb *tcp, const void *, int);
 extern bool print_sockaddr_by_inode(const unsigned long, const enum sock_proto);
 extern bool print_sockaddr_by_inode_cached(const unsigned long);
+extern void invalidate_sockaddr_cache(struct tcb *);
+extern void print_sockaddr_cache_stats(void);
 extern void print_dirfd(struct tcb *, int);
 extern int decode_sockaddr(struct tcb *, long, int);
 #ifdef ALPHA
@@ -683,9 +763,17 @@ extern void tv_div(struct timeval *, const struct timeval *, int);
 extern void unwind_init(void);
 extern void unwind_tcb_init(struct tcb *tcp);
 extern void unwind_tcb_fin(struct tcb *tcp);
-extern void unwind_cache_invalidate(struct tcb* tcp);
+extern void unwind_cache_update(struct tcb* tcp);
 extern void unwind_print_stacktrace(struct tcb* tcp);
 extern void unwind_capture_stacktrace(struct tcb* tcp);
+extern void unwind_count_syscall(struct tcb *, int pid, const struct timeval *);
+extern void unwind_print_folded(FILE *);
+extern unsigned long unwind_cache_updates;
+extern unsigned long unwind_cache_rebuilds;
+extern unsigned long unwind_symbol_hits;
+extern unsigned long unwind_symbol_misses;
+extern unsigned long unwind_fp_walks;
+extern unsigned long unwind_fp_fallbacks;
 #endif
 
 static inline int
@@ -737,7 +825,7 @@ printxval_long(const struct xlat *x, const unsigned long val, const char *dflt)
  */
 extern char *outfname;
 extern struct tcb *printing_tcp;
-extern struct tcb *current_tcp;
+extern __thread struct tcb *current_tcp;
 extern unsigned int nprocs;
 extern void printleader(struct tcb *);
 extern void line_ended(void);
@@ -745,10 +833,28 @@ extern void tabto(void);
 extern void tprintf(const char *fmt, ...) ATTRIBUTE_FORMAT((printf, 1, 2));
 extern void vtprintf(const char *fmt, va_list args);
 extern void tprints(const char *str);
+extern void tflush(void);
+extern void twrite(struct tcb *, const char *buf, size_t len);
+
+/* Rendering of a trace recorded by the binary formatter (-L) */
+extern const struct timeval *loaded_tv;
+extern const unsigned long long *loaded_seq;
+extern struct tcb *load_tcb(int pid);
+extern void droptcb(struct tcb *);
+
+extern bool outbuf_async;
+extern void outbuf_init(void);
+extern void outbuf_write(FILE *, const char *buf, size_t len);
+extern int outbuf_vprintf(FILE *, const char *fmt, va_list args);
+extern void outbuf_put(FILE *, const char *buf, size_t len);
+extern int outbuf_puts(FILE *, const char *str);
+extern void outbuf_flush(void);
+extern void outbuf_sync(void);
+extern void outbuf_finish(void);
 
 #if SUPPORTED_PERSONALITIES > 1
 extern void set_personality(int personality);
-extern unsigned current_personality;
+extern __thread unsigned current_personality;
 #else
 # define set_personality(personality) ((void)0)
 # define current_personality 0
@@ -760,7 +866,7 @@ extern unsigned current_personality;
 # if SUPPORTED_PERSONALITIES == 2 && PERSONALITY0_WORDSIZE == PERSONALITY1_WORDSIZE
 #  define current_wordsize PERSONALITY0_WORDSIZE
 # else
-extern unsigned current_wordsize;
+extern __thread unsigned current_wordsize;
 # endif
 #endif
 
@@ -800,10 +906,10 @@ extern qualbits_t *qual_vec[SUPPORTED_PERSONALITIES];
 #define qual_flags (qual_vec[current_personality])
 
 #if SUPPORTED_PERSONALITIES > 1
-extern const struct_sysent *sysent;
-extern const char *const *errnoent;
-extern const char *const *signalent;
-extern const struct_ioctlent *ioctlent;
+extern __thread const struct_sysent *sysent;
+extern __thread const char *const *errnoent;
+extern __thread const char *const *signalent;
+extern __thread const struct_ioctlent *ioctlent;
 #else
 # define sysent     sysent0
 # define errnoent   errnoent0
@@ -811,10 +917,10 @@ extern const struct_ioctlent *ioctlent;
 # define ioctlent   ioctlent0
 #endif
 
-extern unsigned nsyscalls;
-extern unsigned nerrnos;
-extern unsigned nsignals;
-extern unsigned nioctlents;
+extern __thread unsigned nsyscalls;
+extern __thread unsigned nerrnos;
+extern __thread unsigned nsignals;
+extern __thread unsigned nioctlents;
 extern unsigned num_quals;
 
 #ifdef IN_MPERS_BOOTSTRAP
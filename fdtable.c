@@ -0,0 +1,440 @@
+/*
+ * Per-process descriptor table for -y, -yy and -P.
+ *
+ * Paths of descriptors and protocols of sockets are looked up in /proc
+ * once and then served from a table shared by all threads of a process.
+ * The table is kept valid by invalidating the descriptors every syscall
+ * that may change them has returned, so it may be used only as long as
+ * all such syscalls are seen by strace.  The table of a process is not
+ * used at all if another process or an untraced thread could change its
+ * descriptors.
+ *
+ * Note that the path of a descriptor is not updated when the file
+ * is renamed or removed after it has been looked up.
+ */
+
+#include "defs.h"
+
+#include <fcntl.h>
+#include <sched.h>
+
+#include "msghdr.h"
+#include "syscall.h"
+
+/* Descriptors above this are always looked up in /proc */
+#define FDTABLE_MAX_FD	(1 << 20)
+
+struct fdtable_entry {
+	/* The entry is valid if it matches the table's generation */
+	unsigned long generation;
+	char *path;
+	/* -1 if the descriptor is not open */
+	ssize_t path_len;
+	bool has_path;
+	bool has_proto;
+	enum sock_proto proto;
+};
+
+struct fdtable {
+	struct fdtable *next;
+	int tgid;
+	unsigned int refcount;
+	/* Descriptors may be changed without strace noticing */
+	bool untracked;
+	unsigned long generation;
+	struct fdtable_entry *fds;
+	unsigned int nfds;
+};
+
+static struct fdtable *fdtables;
+/* A descriptor table is shared between processes or unshared by a thread */
+static bool fdtables_untracked;
+
+unsigned long fdtable_hits;
+unsigned long fdtable_misses;
+
+static bool
+fdtable_enabled(void)
+{
+	return (show_fd_path || tracing_paths) && !fdtables_untracked;
+}
+
+static struct fdtable *
+fdtable_get(struct tcb *tcp)
+{
+	struct fdtable *t;
+	unsigned int threads;
+	int tgid;
+
+	if (!fdtable_enabled())
+		return NULL;
+
+	if (!tcp->fdtable) {
+		read_proc_status(tcp->pid, &tgid, &threads);
+
+		for (t = fdtables; t; t = t->next)
+			if (t->tgid == tgid)
+				break;
+
+		if (!t) {
+			t = xcalloc(1, sizeof(*t));
+			t->tgid = tgid;
+			t->generation = 1;
+			/* Untraced threads could change descriptors */
+			t->untracked = threads > 1 && !followfork;
+			t->next = fdtables;
+			fdtables = t;
+		}
+
+		t->refcount++;
+		tcp->fdtable = t;
+	}
+
+	return tcp->fdtable->untracked ? NULL : tcp->fdtable;
+}
+
+static struct fdtable_entry *
+fdtable_entry(struct tcb *tcp, int fd, bool create)
+{
+	struct fdtable *t = fdtable_get(tcp);
+	struct fdtable_entry *e;
+	unsigned int n;
+
+	if (!t || fd < 0 || fd >= FDTABLE_MAX_FD)
+		return NULL;
+
+	if ((unsigned int) fd >= t->nfds) {
+		if (!create)
+			return NULL;
+
+		n = MAX((unsigned int) fd + 1, t->nfds * 2);
+		t->fds = xreallocarray(t->fds, n, sizeof(*t->fds));
+		memset(t->fds + t->nfds, 0, (n - t->nfds) * sizeof(*t->fds));
+		t->nfds = n;
+	}
+
+	e = &t->fds[fd];
+	if (e->generation != t->generation) {
+		if (!create)
+			return NULL;
+
+		free(e->path);
+		memset(e, 0, sizeof(*e));
+		e->generation = t->generation;
+	}
+
+	return e;
+}
+
+/*
+ * Copy the cached path of FD to BUF the way readlink would do it.
+ * Returns false if the path has not been cached.
+ */
+bool
+fdtable_get_path(struct tcb *tcp, int fd, char *buf, unsigned int bufsize,
+		 ssize_t *len)
+{
+	struct fdtable_entry *e = fdtable_entry(tcp, fd, false);
+
+	if (!e || !e->has_path) {
+		fdtable_misses++;
+		return false;
+	}
+
+	fdtable_hits++;
+
+	*len = e->path_len;
+	if (*len >= 0) {
+		if ((size_t) *len > bufsize - 1)
+			*len = bufsize - 1;
+		memcpy(buf, e->path, *len);
+		buf[*len] = '\0';
+	}
+
+	return true;
+}
+
+void
+fdtable_set_path(struct tcb *tcp, int fd, const char *path, ssize_t len)
+{
+	struct fdtable_entry *e = fdtable_entry(tcp, fd, true);
+
+	if (!e)
+		return;
+
+	free(e->path);
+	e->path = len >= 0 ? xstrdup(path) : NULL;
+	e->path_len = len;
+	e->has_path = true;
+}
+
+bool
+fdtable_get_proto(struct tcb *tcp, int fd, enum sock_proto *proto)
+{
+	struct fdtable_entry *e = fdtable_entry(tcp, fd, false);
+
+	if (!e || !e->has_proto)
+		return false;
+
+	*proto = e->proto;
+
+	return true;
+}
+
+void
+fdtable_set_proto(struct tcb *tcp, int fd, enum sock_proto proto)
+{
+	struct fdtable_entry *e = fdtable_entry(tcp, fd, true);
+
+	if (!e)
+		return;
+
+	e->proto = proto;
+	e->has_proto = true;
+}
+
+static void
+fdtable_invalidate(struct tcb *tcp, long fd)
+{
+	struct fdtable_entry *e;
+
+	if (fd < 0 || fd >= FDTABLE_MAX_FD)
+		return;
+
+	e = fdtable_entry(tcp, fd, false);
+	if (e)
+		e->generation = 0;
+}
+
+/* Invalidate the descriptors known not to be open. */
+static void
+fdtable_invalidate_closed(struct tcb *tcp)
+{
+	struct fdtable *t = fdtable_get(tcp);
+	unsigned int i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i < t->nfds; i++) {
+		if (t->fds[i].generation == t->generation &&
+		    t->fds[i].has_path && t->fds[i].path_len < 0)
+			t->fds[i].generation = 0;
+	}
+}
+
+static void
+fdtable_flush(struct tcb *tcp)
+{
+	struct fdtable *t = fdtable_get(tcp);
+
+	if (t)
+		t->generation++;
+}
+
+static void
+fdtable_set_untracked(struct tcb *tcp)
+{
+	struct fdtable *t = fdtable_get(tcp);
+
+	if (t)
+		t->untracked = true;
+}
+
+/* Returns true if any of received messages carries control data. */
+static bool
+received_control_data(struct tcb *tcp)
+{
+	struct msghdr msg;
+	struct mmsghdr mmsg;
+	unsigned long addr = tcp->u_arg[1];
+	unsigned int i, fetched;
+
+	if (tcp->s_ent->sen == SEN_recvmsg)
+		return !fetch_struct_msghdr(tcp, addr, &msg) ||
+		       msg.msg_controllen;
+
+	for (i = 0; i < (unsigned long) tcp->u_rval; ++i, addr += fetched) {
+		fetched = fetch_struct_mmsghdr(tcp, addr, &mmsg);
+		if (!fetched || mmsg.msg_hdr.msg_controllen)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Returns true if the syscall may change the descriptor table
+ * that is in use, so it has to be seen by strace.
+ */
+bool
+fdtable_syscall(const struct_sysent *s)
+{
+	if (!fdtable_enabled())
+		return false;
+
+	switch (s->sen) {
+	case SEN_accept:
+	case SEN_accept4:
+	case SEN_bpf:
+	case SEN_clone:
+	case SEN_close:
+	case SEN_creat:
+	case SEN_dup:
+	case SEN_dup2:
+	case SEN_dup3:
+	case SEN_epoll_create:
+	case SEN_epoll_create1:
+	case SEN_eventfd:
+	case SEN_eventfd2:
+	case SEN_execve:
+	case SEN_execveat:
+	case SEN_fanotify_init:
+	case SEN_fcntl:
+	case SEN_fcntl64:
+	case SEN_inotify_init:
+	case SEN_inotify_init1:
+	case SEN_ioctl:
+	case SEN_memfd_create:
+	case SEN_mq_open:
+	case SEN_open:
+	case SEN_open_by_handle_at:
+	case SEN_openat:
+	case SEN_perf_event_open:
+	case SEN_pipe:
+	case SEN_pipe2:
+	case SEN_printargs:
+	case SEN_recvmmsg:
+	case SEN_recvmsg:
+	case SEN_seccomp:
+	case SEN_signalfd:
+	case SEN_signalfd4:
+	case SEN_socket:
+	case SEN_socketpair:
+	case SEN_timerfd_create:
+	case SEN_unshare:
+	case SEN_userfaultfd:
+		return true;
+	}
+
+	return false;
+}
+
+/* Update the descriptor table after the syscall of TCP has returned. */
+void
+fdtable_update(struct tcb *tcp)
+{
+	unsigned long flags;
+
+	if (!fdtable_syscall(tcp->s_ent))
+		return;
+
+	/* The descriptor is released even if close fails. */
+	if (tcp->s_ent->sen == SEN_close) {
+		fdtable_invalidate(tcp, tcp->u_arg[0]);
+		return;
+	}
+
+	if (syserror(tcp))
+		return;
+
+	switch (tcp->s_ent->sen) {
+	case SEN_fcntl:
+	case SEN_fcntl64:
+		if (tcp->u_arg[1] != F_DUPFD && tcp->u_arg[1] != F_DUPFD_CLOEXEC)
+			break;
+		/* fall through */
+	case SEN_accept:
+	case SEN_accept4:
+	case SEN_bpf:
+	case SEN_creat:
+	case SEN_dup:
+	case SEN_epoll_create:
+	case SEN_epoll_create1:
+	case SEN_eventfd:
+	case SEN_eventfd2:
+	case SEN_fanotify_init:
+	case SEN_inotify_init:
+	case SEN_inotify_init1:
+	case SEN_memfd_create:
+	case SEN_mq_open:
+	case SEN_open:
+	case SEN_open_by_handle_at:
+	case SEN_openat:
+	case SEN_perf_event_open:
+	case SEN_seccomp:
+	case SEN_signalfd:
+	case SEN_signalfd4:
+	case SEN_socket:
+	case SEN_timerfd_create:
+	case SEN_userfaultfd:
+		fdtable_invalidate(tcp, tcp->u_rval);
+		break;
+
+	case SEN_dup2:
+	case SEN_dup3:
+		fdtable_invalidate(tcp, tcp->u_arg[1]);
+		break;
+
+	case SEN_ioctl:
+		/*
+		 * Most ioctls return 0, some return a new descriptor,
+		 * and some store new descriptors in their argument.
+		 * Any of them can only be a descriptor that was not open.
+		 */
+		fdtable_invalidate_closed(tcp);
+		break;
+
+	case SEN_recvmsg:
+	case SEN_recvmmsg:
+		/* SCM_RIGHTS */
+		if (received_control_data(tcp))
+			fdtable_flush(tcp);
+		break;
+
+	case SEN_clone:
+		flags = get_clone_flags(tcp);
+		if ((flags & CLONE_FILES) &&
+		    (!(flags & CLONE_THREAD) || !followfork)) {
+			if (flags & CLONE_THREAD)
+				fdtable_set_untracked(tcp);
+			else
+				fdtables_untracked = true;
+		}
+		break;
+
+	case SEN_unshare:
+		if (tcp->u_arg[0] & CLONE_FILES)
+			fdtables_untracked = true;
+		break;
+
+	default:
+		/* execve, pipes, socket pairs, unknown syscalls */
+		fdtable_flush(tcp);
+		break;
+	}
+}
+
+void
+fdtable_release(struct tcb *tcp)
+{
+	struct fdtable *t = tcp->fdtable;
+	struct fdtable **p;
+	unsigned int i;
+
+	if (!t)
+		return;
+	tcp->fdtable = NULL;
+
+	if (--t->refcount)
+		return;
+
+	for (p = &fdtables; *p != t; p = &(*p)->next)
+		;
+	*p = t->next;
+
+	for (i = 0; i < t->nfds; i++)
+		free(t->fds[i].path);
+	free(t->fds);
+	free(t);
+}
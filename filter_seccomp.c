@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2016 The strace developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * seccomp-bpf prefiltering of traced syscalls (-n).
+ *
+ * The set of syscalls selected by -e trace= is compiled into a classic BPF
+ * program that is installed in the tracee right before the initial execve.
+ * Syscalls we are not interested in return SECCOMP_RET_ALLOW and do not
+ * cause any ptrace stop at all; everything else returns SECCOMP_RET_TRACE
+ * and produces PTRACE_EVENT_SECCOMP stop which is handled as a syscall
+ * entry stop.  The tracee is then resumed with PTRACE_SYSCALL to catch
+ * the syscall exit, and with PTRACE_CONT otherwise.
+ */
+
+#include "defs.h"
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+
+#include "syscall.h"
+
+#if defined HAVE_LINUX_SECCOMP_H && defined HAVE_LINUX_FILTER_H
+# include <linux/seccomp.h>
+# include <linux/filter.h>
+#endif
+
+#ifndef PR_SET_NO_NEW_PRIVS
+# define PR_SET_NO_NEW_PRIVS 38
+#endif
+#ifndef SECCOMP_MODE_FILTER
+# define SECCOMP_MODE_FILTER 2
+#endif
+#ifndef SECCOMP_RET_TRACE
+# define SECCOMP_RET_TRACE 0x7ff00000U
+#endif
+#ifndef SECCOMP_RET_ALLOW
+# define SECCOMP_RET_ALLOW 0x7fff0000U
+#endif
+#ifndef BPF_MAXINSNS
+# define BPF_MAXINSNS 4096
+#endif
+
+bool seccomp_filtering;
+
+#if defined X86_64 || defined X32 || defined I386
+
+# ifndef __X32_SYSCALL_BIT
+#  define __X32_SYSCALL_BIT	0x40000000
+# endif
+
+/*
+ * AUDIT_ARCH_* value and syscall number bias for every personality.
+ */
+struct audit_arch_t {
+	unsigned int arch;
+	unsigned int flag;
+};
+
+static const struct audit_arch_t audit_arch_vec[SUPPORTED_PERSONALITIES] = {
+# if defined X86_64
+	{ AUDIT_ARCH_X86_64, 0 },
+	{ AUDIT_ARCH_I386, 0 },
+	{ AUDIT_ARCH_X86_64, __X32_SYSCALL_BIT },
+# elif defined X32
+	{ AUDIT_ARCH_X86_64, __X32_SYSCALL_BIT },
+	{ AUDIT_ARCH_I386, 0 },
+# else
+	{ AUDIT_ARCH_I386, 0 },
+# endif
+};
+
+struct sock_filter_t {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+};
+
+struct sock_fprog_t {
+	unsigned short len;
+	struct sock_filter_t *filter;
+};
+
+/* Offsets in struct seccomp_data. */
+enum {
+	seccomp_data_nr_offset = 0,
+	seccomp_data_arch_offset = 4,
+};
+
+#define BPF_LD_W_ABS	(0x00 | 0x00 | 0x20)	/* BPF_LD | BPF_W | BPF_ABS */
+#define BPF_JMP_JA	(0x05 | 0x00)		/* BPF_JMP | BPF_JA */
+#define BPF_JMP_JEQ_K	(0x05 | 0x10 | 0x00)	/* BPF_JMP | BPF_JEQ | BPF_K */
+#define BPF_JMP_JGT_K	(0x05 | 0x20 | 0x00)	/* BPF_JMP | BPF_JGT | BPF_K */
+#define BPF_JMP_JGE_K	(0x05 | 0x30 | 0x00)	/* BPF_JMP | BPF_JGE | BPF_K */
+#define BPF_RET_K	(0x06 | 0x00)		/* BPF_RET | BPF_K */
+
+static struct sock_fprog_t bpf_prog;
+static unsigned int bpf_prog_size;
+
+static void
+bpf_emit(uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+	if (bpf_prog.len >= bpf_prog_size) {
+		bpf_prog_size = bpf_prog_size ? bpf_prog_size * 2 : 64;
+		bpf_prog.filter = xreallocarray(bpf_prog.filter, bpf_prog_size,
+						sizeof(*bpf_prog.filter));
+	}
+	bpf_prog.filter[bpf_prog.len].code = code;
+	bpf_prog.filter[bpf_prog.len].jt = jt;
+	bpf_prog.filter[bpf_prog.len].jf = jf;
+	bpf_prog.filter[bpf_prog.len].k = k;
+	bpf_prog.len++;
+}
+
+/*
+ * Returns true if the syscall with number scno of the current personality
+ * does not need to be seen by the tracer.  Anything get_scno() considers
+ * invalid is always printed, so it is never skipped.  execve has to stop
+ * because of hide_log_until_execve, socketcall and ipc have to stop
+ * because their subcalls are qualified separately, syscalls changing
+ * descriptors have to stop to keep the descriptor table up to date.
+ */
+static bool
+syscall_is_skippable(unsigned int scno)
+{
+	if (!SCNO_IS_VALID(scno) || (qual_flags[scno] & QUAL_TRACE) ||
+	    fdtable_syscall(&sysent[scno]))
+		return false;
+
+	switch (sysent[scno].sen) {
+		case SEN_execve:
+		case SEN_execveat:
+#ifdef SYS_socket_subcall
+		case SEN_socketcall:
+#endif
+#ifdef SYS_ipc_subcall
+		case SEN_ipc:
+#endif
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Emit filter code for the current personality:
+ *
+ *	ld [arch]
+ *	jeq #AUDIT_ARCH, next, skip
+ *	ld [nr]
+ *	; for every range of skippable syscalls:
+ *	jge #lo, next, next_range
+ *	jgt #hi, next_range, next
+ *	ret #SECCOMP_RET_ALLOW
+ *	...
+ *	ret #SECCOMP_RET_TRACE
+ * skip:
+ */
+static void
+bpf_emit_personality(unsigned int pers)
+{
+	const struct audit_arch_t *aa = &audit_arch_vec[pers];
+	unsigned int start = bpf_prog.len;
+	unsigned int skip_jump;
+	unsigned int x32_jump = 0;
+	unsigned int lo, hi;
+
+	bpf_emit(BPF_LD_W_ABS, 0, 0, seccomp_data_arch_offset);
+	bpf_emit(BPF_JMP_JEQ_K, 1, 0, aa->arch);
+	skip_jump = bpf_prog.len;
+	bpf_emit(BPF_JMP_JA, 0, 0, 0);
+	bpf_emit(BPF_LD_W_ABS, 0, 0, seccomp_data_nr_offset);
+
+# if defined X86_64 || defined X32
+	/*
+	 * x86_64 and x32 share the audit arch, x32 syscalls
+	 * are distinguished by __X32_SYSCALL_BIT.
+	 */
+	if (aa->arch == AUDIT_ARCH_X86_64) {
+		bpf_emit(BPF_JMP_JGE_K, aa->flag ? 1 : 0, aa->flag ? 0 : 1,
+			 __X32_SYSCALL_BIT);
+		x32_jump = bpf_prog.len;
+		bpf_emit(BPF_JMP_JA, 0, 0, 0);
+	}
+# endif
+
+	for (lo = 0; lo < nsyscalls; lo = hi) {
+		if (!syscall_is_skippable(lo)) {
+			hi = lo + 1;
+			continue;
+		}
+		for (hi = lo + 1; hi < nsyscalls && syscall_is_skippable(hi);
+		     hi++)
+			;
+		bpf_emit(BPF_JMP_JGE_K, 0, 2, lo + aa->flag);
+		bpf_emit(BPF_JMP_JGT_K, 1, 0, hi - 1 + aa->flag);
+		bpf_emit(BPF_RET_K, 0, 0, SECCOMP_RET_ALLOW);
+	}
+
+	bpf_emit(BPF_RET_K, 0, 0, SECCOMP_RET_TRACE);
+
+	/* Both jumps lead to the code of the next personality. */
+	bpf_prog.filter[skip_jump].k = bpf_prog.len - skip_jump - 1;
+	if (x32_jump)
+		bpf_prog.filter[x32_jump].k = bpf_prog.len - x32_jump - 1;
+
+	if (debug_flag)
+		error_msg("seccomp filter: personality %u: %u instructions",
+			  pers, bpf_prog.len - start);
+}
+
+static void
+init_seccomp_prog(void)
+{
+	unsigned int pers;
+
+	for (pers = 0; pers < SUPPORTED_PERSONALITIES; ++pers) {
+		set_personality(pers);
+		bpf_emit_personality(pers);
+	}
+	set_personality(DEFAULT_PERSONALITY);
+
+	/* Unknown architecture, let the tracer decide. */
+	bpf_emit(BPF_RET_K, 0, 0, SECCOMP_RET_TRACE);
+}
+
+static int
+install_seccomp_prog(const struct sock_fprog_t *prog)
+{
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+		return -1;
+	return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, prog);
+}
+
+/*
+ * Check in a test child that the kernel accepts seccomp filters.
+ * The test filter cannot return SECCOMP_RET_TRACE: without a tracer
+ * even exit_group would fail with ENOSYS.
+ */
+static bool
+seccomp_filter_works(void)
+{
+	static struct sock_filter_t allow_all[] = {
+		{ BPF_RET_K, 0, 0, SECCOMP_RET_ALLOW }
+	};
+	static const struct sock_fprog_t allow_all_prog = {
+		.len = ARRAY_SIZE(allow_all),
+		.filter = allow_all
+	};
+	int pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+		perror_msg_and_die("fork");
+
+	if (pid == 0)
+		_exit(install_seccomp_prog(&allow_all_prog) < 0);
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			perror_msg_and_die("%s: waitpid", __func__);
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void
+check_seccomp_filter(void)
+{
+	if (!seccomp_filtering)
+		return;
+
+	/*
+	 * Starting with Linux 4.8, PTRACE_EVENT_SECCOMP stop is reported
+	 * after syscall-enter-stop and before the syscall is executed,
+	 * so it can be used in place of syscall-enter-stop.
+	 */
+	if (os_release < KERNEL_VERSION(4,8,0)) {
+		error_msg("-n requires Linux 4.8 or newer, ignored");
+		seccomp_filtering = false;
+		return;
+	}
+
+	if (!seccomp_filter_works()) {
+		error_msg("seccomp filter is not available, -n ignored");
+		seccomp_filtering = false;
+		return;
+	}
+
+	init_seccomp_prog();
+
+	if (bpf_prog.len > BPF_MAXINSNS) {
+		error_msg("seccomp filter is too long (%u instructions), "
+			  "-n ignored", bpf_prog.len);
+		seccomp_filtering = false;
+		return;
+	}
+
+	if (debug_flag)
+		error_msg("seccomp filter: %u instructions", bpf_prog.len);
+}
+
+/* Called in the tracee right before execve. */
+void
+init_seccomp_filter(void)
+{
+	if (install_seccomp_prog(&bpf_prog) < 0)
+		perror_msg_and_die("seccomp filter");
+}
+
+#else /* !(X86_64 || X32 || I386) */
+
+void
+check_seccomp_filter(void)
+{
+	if (!seccomp_filtering)
+		return;
+	error_msg("-n is not supported on this architecture, ignored");
+	seccomp_filtering = false;
+}
+
+void
+init_seccomp_filter(void)
+{
+}
+
+#endif
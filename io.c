@@ -113,6 +113,23 @@ print_iovec(struct tcb *tcp, void *elem_buf, size_t elem_size, void *data)
 	return true;
 }
 
+/*
+ * Gather the buffers which are going to be decoded at once,
+ * BUF_LIMIT is the number of bytes of each buffer the decoder reads.
+ */
+static void
+prefetch_iov(struct tcb *tcp, unsigned long len, unsigned long addr,
+	     enum iov_decode decode_iov, unsigned long data_size,
+	     unsigned long buf_limit)
+{
+	if (decode_iov == IOV_DECODE_ADDR || !verbose(tcp) ||
+	    (exiting(tcp) && syserror(tcp)))
+		return;
+
+	umove_prefetch_iov(tcp, len, addr, data_size,
+			   decode_iov == IOV_DECODE_STR ? buf_limit : -1UL);
+}
+
 /*
  * data_size limits the cumulative size of printed data.
  * Example: recvmsg returing a short read.
@@ -125,6 +142,7 @@ tprint_iov_upto(struct tcb *tcp, unsigned long len, unsigned long addr,
 	struct print_iovec_config config =
 		{ .decode_iov = decode_iov, .data_size = data_size };
 
+	prefetch_iov(tcp, len, addr, decode_iov, data_size, max_strlen);
 	print_array(tcp, addr, len, iov, current_wordsize * 2,
 		    umoven_or_printaddr, print_iovec, &config);
 }
@@ -189,6 +207,7 @@ s_insert_iov_upto(const char *name, unsigned long addr, unsigned long len,
 	struct print_iovec_config config =
 		{ .decode_iov = decode_iov, .data_size = data_size };
 
+	prefetch_iov(current_tcp, len, addr, decode_iov, data_size, -1UL);
 	s_insert_array_type(name, addr, len, current_wordsize * 2,
 		S_TYPE_struct, fill_iovec, &config);
 }
@@ -204,11 +223,13 @@ void
 s_push_iov_upto(const char *name, unsigned long len, enum iov_decode decode_iov,
 	unsigned long data_size)
 {
-	struct print_iovec_config config =
-		{ .decode_iov = decode_iov, .data_size = data_size };
+	struct s_syscall *syscall = current_tcp->s_syscall;
+	unsigned long long addr;
 
-	s_push_array_type(name, len, current_wordsize * 2,
-		S_TYPE_struct, fill_iovec, &config);
+	s_syscall_pop_all(syscall);
+	s_syscall_cur_arg_advance(syscall, S_TYPE_addr, &addr);
+
+	s_insert_iov_upto(name, addr, len, decode_iov, data_size);
 }
 
 void
@@ -48,12 +48,7 @@ static char *json_strdup(const char *str)
 
 /* String buffer */
 
-typedef struct
-{
-	char *cur;
-	char *end;
-	char *start;
-} SB;
+typedef JsonBuffer SB;
 
 static void sb_init(SB *sb)
 {
@@ -349,6 +344,7 @@ static void emit_value              (SB *out, const JsonNode *node);
 static void emit_value_indented     (SB *out, const JsonNode *node, const char *space, int indent_level);
 static void emit_string             (SB *out, const char *str);
 static void emit_number             (SB *out, double num);
+static void emit_integer            (SB *out, uint64_t value, JsonIntFormat format);
 static void emit_array              (SB *out, const JsonNode *array);
 static void emit_array_indented     (SB *out, const JsonNode *array, const char *space, int indent_level);
 static void emit_object             (SB *out, const JsonNode *object);
@@ -552,6 +548,14 @@ JsonNode *json_mknumber(double n)
 	return node;
 }
 
+JsonNode *json_mkinteger(uint64_t n, JsonIntFormat format)
+{
+	JsonNode *node = mknode(JSON_INTEGER);
+	node->integer_.value = n;
+	node->integer_.format = format;
+	return node;
+}
+
 JsonNode *json_mkarray(void)
 {
 	return mknode(JSON_ARRAY);
@@ -1082,6 +1086,9 @@ static void emit_value(SB *out, const JsonNode *node)
 		case JSON_NUMBER:
 			emit_number(out, node->number_);
 			break;
+		case JSON_INTEGER:
+			emit_integer(out, node->integer_.value, node->integer_.format);
+			break;
 		case JSON_ARRAY:
 			emit_array(out, node);
 			break;
@@ -1109,6 +1116,9 @@ void emit_value_indented(SB *out, const JsonNode *node, const char *space, int i
 		case JSON_NUMBER:
 			emit_number(out, node->number_);
 			break;
+		case JSON_INTEGER:
+			emit_integer(out, node->integer_.value, node->integer_.format);
+			break;
 		case JSON_ARRAY:
 			emit_array_indented(out, node, space, indent_level);
 			break;
@@ -1334,9 +1344,62 @@ static void emit_number(SB *out, double num)
 		sb_puts(out, "null");
 }
 
+/*
+ * Integers are written exactly, without going through double
+ * and sprintf, two decimal digits at a time.
+ */
+static void emit_integer(SB *out, uint64_t value, JsonIntFormat format)
+{
+	static const char digits[] =
+		"00010203040506070809" "10111213141516171819"
+		"20212223242526272829" "30313233343536373839"
+		"40414243444546474849" "50515253545556575859"
+		"60616263646566676869" "70717273747576777879"
+		"80818283848586878889" "90919293949596979899";
+	char buf[sizeof("\"0x\"") + 20];
+	char *p = buf + sizeof(buf);
+	bool negative = false;
+
+	if (format == JSON_INT_HEX) {
+		*--p = '"';
+		do {
+			*--p = "0123456789abcdef"[value & 0xf];
+			value >>= 4;
+		} while (value);
+		*--p = 'x';
+		*--p = '0';
+		*--p = '"';
+		sb_put(out, p, buf + sizeof(buf) - p);
+		return;
+	}
+
+	if (format == JSON_INT_SIGNED && (int64_t) value < 0) {
+		negative = true;
+		value = -value;
+	}
+
+	while (value >= 100) {
+		unsigned int i = (value % 100) * 2;
+
+		value /= 100;
+		*--p = digits[i + 1];
+		*--p = digits[i];
+	}
+	if (value >= 10) {
+		*--p = digits[value * 2 + 1];
+		*--p = digits[value * 2];
+	} else {
+		*--p = '0' + value;
+	}
+	if (negative)
+		*--p = '-';
+
+	sb_put(out, p, buf + sizeof(buf) - p);
+}
+
 static bool tag_is_valid(unsigned int tag)
 {
-	return (/* tag >= JSON_NULL && */ tag <= JSON_OBJECT);
+	return (/* tag >= JSON_NULL && */ tag <= JSON_INTEGER);
 }
 
 static bool number_is_valid(const char *num, const char *end)
@@ -1480,3 +1543,139 @@ bool json_check(const JsonNode *node, char errmsg[256])
 
 	#undef problem
 }
+
+/*
+ * Streaming writer
+ */
+
+void json_writer_init(JsonWriter *w, const char *space)
+{
+	sb_init(&w->sb);
+	w->space = space;
+	w->nonempty = NULL;
+	w->depth = 0;
+	w->depth_max = 0;
+}
+
+/* Discard everything written so far. */
+void json_writer_reset(JsonWriter *w)
+{
+	w->sb.cur = w->sb.start;
+	w->depth = 0;
+}
+
+void json_writer_free(JsonWriter *w)
+{
+	sb_free(&w->sb);
+	free(w->nonempty);
+	w->nonempty = NULL;
+	w->depth = w->depth_max = 0;
+}
+
+/* Returns the text written so far, owned by the writer. */
+const char *json_writer_finish(JsonWriter *w)
+{
+	*w->sb.cur = 0;
+	return w->sb.start;
+}
+
+static void writer_indent(JsonWriter *w, unsigned int level)
+{
+	unsigned int i;
+
+	sb_putc(&w->sb, '\n');
+	for (i = 0; i < level; i++)
+		sb_puts(&w->sb, w->space);
+}
+
+/* Write the separator and the key preceding a value. */
+static void writer_value(JsonWriter *w, const char *key)
+{
+	if (w->depth > 0) {
+		if (w->nonempty[w->depth - 1])
+			sb_putc(&w->sb, ',');
+		w->nonempty[w->depth - 1] = true;
+		if (w->space != NULL)
+			writer_indent(w, w->depth);
+	}
+
+	if (key != NULL) {
+		emit_string(&w->sb, key);
+		sb_puts(&w->sb, w->space != NULL ? ": " : ":");
+	}
+}
+
+static void writer_begin(JsonWriter *w, const char *key, char c)
+{
+	writer_value(w, key);
+	sb_putc(&w->sb, c);
+
+	if (w->depth == w->depth_max) {
+		w->depth_max = w->depth_max ? w->depth_max * 2 : 16;
+		w->nonempty = (bool*) realloc(w->nonempty,
+			w->depth_max * sizeof(*w->nonempty));
+		if (w->nonempty == NULL)
+			out_of_memory();
+	}
+	w->nonempty[w->depth++] = false;
+}
+
+static void writer_end(JsonWriter *w, char c)
+{
+	assert(w->depth > 0);
+
+	if (w->nonempty[--w->depth] && w->space != NULL)
+		writer_indent(w, w->depth);
+	sb_putc(&w->sb, c);
+}
+
+void json_write_null(JsonWriter *w, const char *key)
+{
+	writer_value(w, key);
+	sb_puts(&w->sb, "null");
+}
+
+void json_write_bool(JsonWriter *w, const char *key, bool b)
+{
+	writer_value(w, key);
+	sb_puts(&w->sb, b ? "true" : "false");
+}
+
+void json_write_string(JsonWriter *w, const char *key, const char *s)
+{
+	writer_value(w, key);
+	emit_string(&w->sb, s);
+}
+
+void json_write_number(JsonWriter *w, const char *key, double n)
+{
+	writer_value(w, key);
+	emit_number(&w->sb, n);
+}
+
+void json_write_integer(JsonWriter *w, const char *key, uint64_t n,
+	JsonIntFormat format)
+{
+	writer_value(w, key);
+	emit_integer(&w->sb, n, format);
+}
+
+void json_write_begin_array(JsonWriter *w, const char *key)
+{
+	writer_begin(w, key, '[');
+}
+
+void json_write_end_array(JsonWriter *w)
+{
+	writer_end(w, ']');
+}
+
+void json_write_begin_object(JsonWriter *w, const char *key)
+{
+	writer_begin(w, key, '{');
+}
+
+void json_write_end_object(JsonWriter *w)
+{
+	writer_end(w, '}');
+}
@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
 	JSON_NULL,
@@ -34,8 +35,17 @@ typedef enum {
 	JSON_NUMBER,
 	JSON_ARRAY,
 	JSON_OBJECT,
+	JSON_INTEGER,
 } JsonTag;
 
+/* How a JSON_INTEGER is written */
+typedef enum {
+	JSON_INT_SIGNED,
+	JSON_INT_UNSIGNED,
+	/* As a string, since JSON has no hexadecimal numbers */
+	JSON_INT_HEX,
+} JsonIntFormat;
+
 typedef struct JsonNode JsonNode;
 
 struct JsonNode
@@ -59,6 +69,12 @@ struct JsonNode
 		/* JSON_NUMBER */
 		double number_;
 
+		/* JSON_INTEGER, never produced by the decoder */
+		struct {
+			uint64_t value;
+			JsonIntFormat format;
+		} integer_;
+
 		/* JSON_ARRAY */
 		/* JSON_OBJECT */
 		struct {
@@ -73,6 +89,29 @@ struct JsonNode
 
 /*** Encoding, decoding, and validation ***/
 
+/* Growing output buffer */
+typedef struct
+{
+	char *cur;
+	char *end;
+	char *start;
+} JsonBuffer;
+
+/*
+ * Streaming writer, producing the same text json_stringify would produce
+ * for the tree of the values written, without building the tree.
+ * A NULL key denotes an array element or the top level value.
+ */
+typedef struct
+{
+	JsonBuffer sb;
+	const char *space;
+	/* Whether a value has been written at each nesting level */
+	bool *nonempty;
+	unsigned int depth;
+	unsigned int depth_max;
+} JsonWriter;
+
 JsonNode   *json_decode         (const char *json);
 JsonNode   *json_decode_to      (const char *json, const char *end);
 char       *json_encode         (const JsonNode *node);
@@ -107,6 +146,8 @@ JsonNode *json_mkstring(const char *s);
 JsonNode *json_mkstring_own(char *s);
 JsonNode *json_mkstring_static(const char *s);
 JsonNode *json_mknumber(double n);
+/* Signed values are passed converted to uint64_t */
+JsonNode *json_mkinteger(uint64_t n, JsonIntFormat format);
 JsonNode *json_mkarray(void);
 JsonNode *json_mkobject(void);
 
@@ -127,4 +168,20 @@ void json_remove_from_parent(JsonNode *node);
  */
 bool json_check(const JsonNode *node, char errmsg[256]);
 
+void        json_writer_init    (JsonWriter *w, const char *space);
+void        json_writer_reset   (JsonWriter *w);
+void        json_writer_free    (JsonWriter *w);
+const char *json_writer_finish  (JsonWriter *w);
+
+void json_write_null        (JsonWriter *w, const char *key);
+void json_write_bool        (JsonWriter *w, const char *key, bool b);
+void json_write_string      (JsonWriter *w, const char *key, const char *s);
+void json_write_number      (JsonWriter *w, const char *key, double n);
+void json_write_integer     (JsonWriter *w, const char *key, uint64_t n,
+	JsonIntFormat format);
+void json_write_begin_array (JsonWriter *w, const char *key);
+void json_write_end_array   (JsonWriter *w);
+void json_write_begin_object(JsonWriter *w, const char *key);
+void json_write_end_object  (JsonWriter *w);
+
 #endif
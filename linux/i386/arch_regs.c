@@ -3,3 +3,5 @@ long *const i386_esp_ptr = &i386_regs.esp;
 
 #define ARCH_REGS_FOR_GETREGS i386_regs
 #define ARCH_PC_REG i386_regs.eip
+#define ARCH_SP_REG i386_regs.esp
+#define ARCH_FP_REG i386_regs.ebp
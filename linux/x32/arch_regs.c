@@ -1 +1,3 @@
 #include "x86_64/arch_regs.c"
+/* Frame records of x32 hold 64-bit words, -U fp walks native ones */
+#undef ARCH_FP_REG
@@ -0,0 +1,406 @@
+/* Asynchronous output.
+ *
+ * With -B, trace output is not written by the tracer thread.  Complete
+ * chunks of output are put into a single-producer single-consumer ring
+ * buffer, and a dedicated writer thread moves them to the output files.
+ *
+ * The writer does not wake up for every chunk: once woken up by the first
+ * chunk after a pause, it lets the output accumulate for up to
+ * OUTBUF_FLUSH_INTERVAL_MS milliseconds or until OUTBUF_WAKE_THRESHOLD
+ * bytes are pending, and then writes it all out and flushes the files.
+ * The tracer only has to take a lock to wake the writer up or when
+ * the ring is full.
+ *
+ * Each record in the ring consists of a header followed by the data,
+ * records are aligned to the header size.  A record with NULL file
+ * pads the ring up to its end.
+ */
+
+#include "defs.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+
+bool outbuf_async;
+
+#define OUTBUF_RING_SIZE	(1U << 20)
+/* Chunks longer than this are split into several records */
+#define OUTBUF_MAX_RECORD	(OUTBUF_RING_SIZE / 4)
+#define OUTBUF_WAKE_THRESHOLD	(OUTBUF_RING_SIZE / 8)
+#define OUTBUF_FLUSH_INTERVAL_MS	100
+#define OUTBUF_FLUSH_FILES	16
+
+struct outbuf_record {
+	FILE *fp;
+	size_t len;
+} ATTRIBUTE_ALIGNED(16);
+
+static char *ring;
+/* Advanced by the producer only */
+static size_t ring_head;
+/* Advanced by the writer only, after the data has been written */
+static size_t ring_tail;
+
+/* The writer waits for the ring to become non-empty */
+static bool writer_idle;
+/* The writer lets more output accumulate */
+static bool writer_batching;
+/* The tracer waits for the writer to make progress */
+static bool producer_waiting;
+static bool stopping;
+
+static pthread_t writer;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+/* Output of the tracer thread which is not in the ring yet */
+static FILE *staged_fp;
+static char *staged;
+static size_t staged_len;
+static size_t staged_size;
+
+static unsigned long records_put;
+static unsigned long bytes_put;
+static unsigned long producer_stalls;
+static unsigned long writer_wakeups;
+
+#define outbuf_load(var)	__atomic_load_n(&(var), __ATOMIC_SEQ_CST)
+#define outbuf_store(var, val)	__atomic_store_n(&(var), (val), __ATOMIC_SEQ_CST)
+
+static size_t
+outbuf_record_size(size_t len)
+{
+	return (sizeof(struct outbuf_record) + len +
+		sizeof(struct outbuf_record) - 1) &
+	       ~(sizeof(struct outbuf_record) - 1);
+}
+
+static size_t
+outbuf_pending(void)
+{
+	return outbuf_load(ring_head) - outbuf_load(ring_tail);
+}
+
+static void
+outbuf_broadcast(void)
+{
+	pthread_mutex_lock(&ring_lock);
+	pthread_cond_broadcast(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * A waiting thread sets its flag and then checks its wake up condition
+ * under ring_lock, the other side checks the flag after changing the ring,
+ * so no wake up is lost.
+ */
+static void
+outbuf_wake_writer(void)
+{
+	if (outbuf_load(writer_idle) ||
+	    (outbuf_load(writer_batching) &&
+	     outbuf_pending() >= OUTBUF_WAKE_THRESHOLD))
+		outbuf_broadcast();
+}
+
+/* Wait for the writer until COND is true. */
+#define outbuf_wait_writer(cond)					\
+	do {								\
+		pthread_mutex_lock(&ring_lock);				\
+		outbuf_store(producer_waiting, true);			\
+		pthread_cond_broadcast(&ring_cond);			\
+		while (!(cond))						\
+			pthread_cond_wait(&ring_cond, &ring_lock);	\
+		outbuf_store(producer_waiting, false);			\
+		pthread_mutex_unlock(&ring_lock);			\
+	} while (0)
+
+static void
+outbuf_put_record(FILE *fp, const char *buf, size_t len)
+{
+	size_t offs = ring_head & (OUTBUF_RING_SIZE - 1);
+	size_t size = outbuf_record_size(len);
+	size_t pad = 0;
+	struct outbuf_record *rec;
+
+	if (offs + size > OUTBUF_RING_SIZE)
+		pad = OUTBUF_RING_SIZE - offs;
+
+	if (OUTBUF_RING_SIZE - outbuf_pending() < pad + size) {
+		producer_stalls++;
+		outbuf_wait_writer(OUTBUF_RING_SIZE - outbuf_pending() >=
+				   pad + size);
+	}
+
+	if (pad) {
+		rec = (struct outbuf_record *) (ring + offs);
+		rec->fp = NULL;
+		rec->len = pad - sizeof(*rec);
+		offs = 0;
+	}
+
+	rec = (struct outbuf_record *) (ring + offs);
+	rec->fp = fp;
+	rec->len = len;
+	memcpy(rec + 1, buf, len);
+
+	outbuf_store(ring_head, ring_head + pad + size);
+	records_put++;
+	bytes_put += len;
+
+	outbuf_wake_writer();
+}
+
+/*
+ * Write LEN bytes of BUF to FP.  Without -B, the data is written
+ * right away.  This function must not be called by two threads
+ * at the same time.
+ */
+void
+outbuf_write(FILE *fp, const char *buf, size_t len)
+{
+	if (!ring) {
+		if (fwrite(buf, 1, len, fp) != len && fp != stderr)
+			perror_msg("%s", outfname);
+		return;
+	}
+
+	while (len > OUTBUF_MAX_RECORD) {
+		outbuf_put_record(fp, buf, OUTBUF_MAX_RECORD);
+		buf += OUTBUF_MAX_RECORD;
+		len -= OUTBUF_MAX_RECORD;
+	}
+	if (len)
+		outbuf_put_record(fp, buf, len);
+}
+
+static void
+outbuf_stage(FILE *fp, size_t len)
+{
+	if (staged_fp != fp) {
+		outbuf_flush();
+		staged_fp = fp;
+	}
+
+	if (staged_len + len >= staged_size) {
+		staged_size = staged_len + len + BUFSIZ;
+		staged = xreallocarray(staged, staged_size, 1);
+	}
+}
+
+int
+outbuf_vprintf(FILE *fp, const char *fmt, va_list args)
+{
+	va_list a1;
+	int n;
+
+	outbuf_stage(fp, 0);
+
+	va_copy(a1, args);
+	n = vsnprintf(staged + staged_len, staged_size - staged_len, fmt, a1);
+	va_end(a1);
+
+	if (n < 0)
+		return n;
+
+	if ((size_t) n >= staged_size - staged_len) {
+		outbuf_stage(fp, n);
+		vsnprintf(staged + staged_len, staged_size - staged_len,
+			  fmt, args);
+	}
+
+	staged_len += n;
+
+	return n;
+}
+
+/* Stages LEN bytes of BUF, which may contain NUL bytes. */
+void
+outbuf_put(FILE *fp, const char *buf, size_t len)
+{
+	outbuf_stage(fp, len);
+	memcpy(staged + staged_len, buf, len);
+	staged_len += len;
+}
+
+int
+outbuf_puts(FILE *fp, const char *str)
+{
+	size_t len = strlen(str);
+
+	outbuf_put(fp, str, len);
+
+	return len;
+}
+
+/* Hand the output printed by the tracer so far over to the writer. */
+void
+outbuf_flush(void)
+{
+	if (staged_len)
+		outbuf_write(staged_fp, staged, staged_len);
+	staged_len = 0;
+}
+
+static void
+outbuf_flush_files(FILE **files, unsigned *nfiles)
+{
+	unsigned i;
+
+	if (*nfiles > OUTBUF_FLUSH_FILES) {
+		fflush(NULL);
+	} else {
+		for (i = 0; i < *nfiles; i++)
+			fflush(files[i]);
+	}
+
+	*nfiles = 0;
+}
+
+static void
+outbuf_wait_for_output(void)
+{
+	struct timespec deadline;
+	int rc = 0;
+
+	pthread_mutex_lock(&ring_lock);
+
+	outbuf_store(writer_idle, true);
+	/* Everything is written out, let outbuf_sync know. */
+	pthread_cond_broadcast(&ring_cond);
+	while (!outbuf_pending() && !outbuf_load(stopping))
+		pthread_cond_wait(&ring_cond, &ring_lock);
+	outbuf_store(writer_idle, false);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += OUTBUF_FLUSH_INTERVAL_MS * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	outbuf_store(writer_batching, true);
+	while (rc != ETIMEDOUT && !outbuf_load(stopping) &&
+	       !outbuf_load(producer_waiting) &&
+	       outbuf_pending() < OUTBUF_WAKE_THRESHOLD)
+		rc = pthread_cond_timedwait(&ring_cond, &ring_lock, &deadline);
+	outbuf_store(writer_batching, false);
+
+	pthread_mutex_unlock(&ring_lock);
+}
+
+static void *
+outbuf_writer(void *arg)
+{
+	FILE *files[OUTBUF_FLUSH_FILES];
+	unsigned nfiles = 0;
+	size_t head;
+	size_t tail = ring_tail;
+	struct outbuf_record *rec;
+	unsigned i;
+
+	for (;;) {
+		head = outbuf_load(ring_head);
+
+		if (head == tail) {
+			outbuf_flush_files(files, &nfiles);
+			if (outbuf_load(stopping))
+				break;
+
+			writer_wakeups++;
+			outbuf_wait_for_output();
+			continue;
+		}
+
+		while (tail != head) {
+			rec = (struct outbuf_record *)
+			      (ring + (tail & (OUTBUF_RING_SIZE - 1)));
+
+			if (rec->fp) {
+				if (fwrite(rec + 1, 1, rec->len, rec->fp) !=
+				    rec->len && rec->fp != stderr)
+					perror_msg("%s", outfname);
+
+				for (i = 0; i < nfiles && i < OUTBUF_FLUSH_FILES;
+				     i++)
+					if (files[i] == rec->fp)
+						break;
+				if (i == nfiles) {
+					if (nfiles < OUTBUF_FLUSH_FILES)
+						files[nfiles] = rec->fp;
+					nfiles++;
+				}
+			}
+
+			tail += outbuf_record_size(rec->len);
+		}
+
+		outbuf_store(ring_tail, tail);
+		if (outbuf_load(producer_waiting))
+			outbuf_broadcast();
+	}
+
+	return NULL;
+}
+
+void
+outbuf_init(void)
+{
+	sigset_t all_set;
+	sigset_t saved_set;
+	int err;
+
+	if (!outbuf_async)
+		return;
+
+	ring = xmalloc(OUTBUF_RING_SIZE);
+
+	/* Signals are handled by the tracer thread only. */
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_SETMASK, &all_set, &saved_set);
+
+	err = pthread_create(&writer, NULL, outbuf_writer, NULL);
+	if (err) {
+		errno = err;
+		perror_msg_and_die("pthread_create");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved_set, NULL);
+}
+
+/* Wait until all the output so far is written out and flushed. */
+void
+outbuf_sync(void)
+{
+	if (!ring)
+		return;
+
+	outbuf_flush();
+	outbuf_wait_writer(!outbuf_pending() && outbuf_load(writer_idle));
+}
+
+void
+outbuf_finish(void)
+{
+	if (!ring)
+		return;
+
+	outbuf_flush();
+	outbuf_store(stopping, true);
+	outbuf_broadcast();
+	pthread_join(writer, NULL);
+	outbuf_async = false;
+
+	if (debug_flag)
+		error_msg("%lu output records, %lu bytes, "
+			  "%lu writer wakeups, %lu producer stalls",
+			  records_put, bytes_put, writer_wakeups,
+			  producer_stalls);
+
+	free(ring);
+	ring = NULL;
+	free(staged);
+	staged = NULL;
+	staged_size = 0;
+}
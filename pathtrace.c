@@ -104,6 +104,9 @@ getfdpath(struct tcb *tcp, int fd, char *buf, unsigned bufsize)
 	if (fd < 0)
 		return -1;
 
+	if (fdtable_get_path(tcp, fd, buf, bufsize, &n))
+		return n;
+
 	sprintf(linkpath, "/proc/%u/fd/%u", tcp->pid, fd);
 	n = readlink(linkpath, buf, bufsize - 1);
 	/*
@@ -112,6 +115,7 @@ getfdpath(struct tcb *tcp, int fd, char *buf, unsigned bufsize)
 	 */
 	if (n >= 0)
 		buf[n] = '\0';
+	fdtable_set_path(tcp, fd, buf, n);
 	return n;
 }
 
@@ -178,6 +178,13 @@ extern long ptrace(int, int, char *, long);
 #ifndef PTRACE_SECCOMP_GET_FILTER
 # define PTRACE_SECCOMP_GET_FILTER	0x420c
 #endif
+#ifndef PTRACE_GET_SYSCALL_INFO
+# define PTRACE_GET_SYSCALL_INFO	0x420e
+# define PTRACE_SYSCALL_INFO_NONE	0
+# define PTRACE_SYSCALL_INFO_ENTRY	1
+# define PTRACE_SYSCALL_INFO_EXIT	2
+# define PTRACE_SYSCALL_INFO_SECCOMP	3
+#endif
 
 #if !HAVE_DECL_PTRACE_PEEKUSER
 # define PTRACE_PEEKUSER PTRACE_PEEKUSR
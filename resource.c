@@ -39,7 +39,7 @@
 const char *
 sprint_rlim64(uint64_t lim)
 {
-	static char buf[sizeof(uint64_t)*3 + sizeof("*1024")];
+	static __thread char buf[sizeof(uint64_t)*3 + sizeof("*1024")];
 
 	if (lim == UINT64_MAX)
 		return "RLIM64_INFINITY";
@@ -73,7 +73,7 @@ print_rlimit64(struct s_arg *arg, unsigned long addr, void *fn_data)
 const char *
 sprint_rlim32(uint32_t lim)
 {
-	static char buf[sizeof(uint32_t)*3 + sizeof("*1024")];
+	static __thread char buf[sizeof(uint32_t)*3 + sizeof("*1024")];
 
 	if (lim == UINT32_MAX)
 		return "RLIM_INFINITY";
@@ -138,7 +138,7 @@ print_sa_handler(unsigned long handler)
 const char *
 signame(const int sig)
 {
-	static char buf[sizeof("SIGRT_%u") + sizeof(int)*3];
+	static __thread char buf[sizeof("SIGRT_%u") + sizeof(int)*3];
 
 	if (sig >= 0) {
 		const unsigned int s = sig;
@@ -29,6 +29,7 @@ s_insert_sigcontext(long addr)
 
 SYS_FUNC(sigreturn)
 {
+	get_regs(tcp->pid);
 	arch_sigreturn(tcp);
 
 	return RVAL_DECODED;
@@ -36,6 +36,7 @@
 #include <linux/unix_diag.h>
 #include <linux/netlink_diag.h>
 #include <linux/rtnetlink.h>
+#include "syscall.h"
 #include "xlat/netlink_protocols.h"
 
 #if !defined NETLINK_SOCK_DIAG && defined NETLINK_INET_DIAG
@@ -47,40 +48,200 @@
 # define UNIX_PATH_MAX sizeof(((struct sockaddr_un *) 0)->sun_path)
 #endif
 
-typedef struct {
+/*
+ * Details of sockets are kept in a hash table of CACHE_SIZE entries,
+ * the least recently used entry is evicted when the table is full.
+ */
+struct cache_entry {
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
 	unsigned long inode;
 	char *details;
-} cache_entry;
+};
 
-#define CACHE_SIZE 1024U
-static cache_entry cache[CACHE_SIZE];
+#define CACHE_SIZE 65536U
 #define CACHE_MASK (CACHE_SIZE - 1)
+static struct cache_entry *cache[CACHE_SIZE];
+/* The most recently used entry and the least recently used one */
+static struct cache_entry *lru_head;
+static struct cache_entry *lru_tail;
+static unsigned int cache_entries;
+
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+static unsigned long cache_dumps;
+
+/* The long-lived NETLINK_SOCK_DIAG socket */
+static int diag_fd = -1;
+static uint32_t diag_seq;
+
+static void
+lru_unlink(struct cache_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+}
 
-static int
-cache_and_print_inode_details(const unsigned long inode, char *const details)
+static void
+lru_push(struct cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+}
+
+static struct cache_entry **
+cache_slot(const unsigned long inode)
+{
+	struct cache_entry **p = &cache[(inode ^ (inode >> 16)) & CACHE_MASK];
+
+	while (*p && (*p)->inode != inode)
+		p = &(*p)->hash_next;
+
+	return p;
+}
+
+static void
+cache_remove(struct cache_entry **p)
 {
-	cache_entry *e = &cache[inode & CACHE_MASK];
+	struct cache_entry *e = *p;
+
+	*p = e->hash_next;
+	lru_unlink(e);
 	free(e->details);
+	free(e);
+	cache_entries--;
+}
+
+static const char *
+cache_lookup(const unsigned long inode)
+{
+	struct cache_entry *e = *cache_slot(inode);
+
+	if (!e)
+		return NULL;
+
+	if (e != lru_head) {
+		lru_unlink(e);
+		lru_push(e);
+	}
+
+	return e->details;
+}
+
+static void
+cache_inode_details(const unsigned long inode, char *const details)
+{
+	struct cache_entry **p = cache_slot(inode);
+	struct cache_entry *e = *p;
+
+	if (e) {
+		free(e->details);
+		e->details = details;
+		lru_unlink(e);
+		lru_push(e);
+		return;
+	}
+
+	if (cache_entries >= CACHE_SIZE) {
+		cache_remove(cache_slot(lru_tail->inode));
+		/* The chain may have changed */
+		p = cache_slot(inode);
+	}
+
+	e = xcalloc(1, sizeof(*e));
 	e->inode = inode;
 	e->details = details;
-
-	tprints(details);
-	return 1;
+	*p = e;
+	lru_push(e);
+	cache_entries++;
 }
 
 bool
 print_sockaddr_by_inode_cached(const unsigned long inode)
 {
-	const cache_entry *const e = &cache[inode & CACHE_MASK];
-	if (e && inode == e->inode) {
-		tprints(e->details);
+	const char *const details = cache_lookup(inode);
+
+	if (details) {
+		cache_hits++;
+		tprints(details);
 		return true;
 	}
 	return false;
 }
 
+/*
+ * Forget the details of the socket whose address may have been changed
+ * by the syscall of TCP that has just returned.
+ */
+void
+invalidate_sockaddr_cache(struct tcb *tcp)
+{
+	static const char socket_prefix[] = "socket:[";
+	char path[sizeof(socket_prefix) + sizeof(long) * 3 + 1];
+	struct cache_entry **p;
+	unsigned long inode;
+
+	switch (tcp->s_ent->sen) {
+	case SEN_bind:
+	case SEN_connect:
+	case SEN_listen:
+		break;
+	default:
+		return;
+	}
+
+	if (!cache_entries ||
+	    getfdpath(tcp, tcp->u_arg[0], path, sizeof(path)) < 0 ||
+	    strncmp(path, socket_prefix, sizeof(socket_prefix) - 1))
+		return;
+
+	inode = strtoul(path + sizeof(socket_prefix) - 1, NULL, 10);
+	p = cache_slot(inode);
+	if (*p)
+		cache_remove(p);
+}
+
+void
+print_sockaddr_cache_stats(void)
+{
+	error_msg("%lu socket cache hits, %lu misses, %lu dumps, "
+		  "%u sockets cached", cache_hits, cache_misses, cache_dumps,
+		  cache_entries);
+}
+
+static int
+get_diag_fd(void)
+{
+	if (diag_fd < 0)
+		diag_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+				 NETLINK_SOCK_DIAG);
+	return diag_fd;
+}
+
+/* The session is out of sync after a failure, start a new one. */
+static void
+reset_diag_fd(void)
+{
+	if (diag_fd >= 0) {
+		close(diag_fd);
+		diag_fd = -1;
+	}
+}
+
 static bool
-send_query(const int fd, void *req, size_t req_size)
+send_query(const int fd, struct nlmsghdr *req, size_t req_size)
 {
 	struct sockaddr_nl nladdr = {
 		.nl_family = AF_NETLINK
@@ -96,6 +257,9 @@ send_query(const int fd, void *req, size_t req_size)
 		.msg_iovlen = 1
 	};
 
+	req->nlmsg_seq = ++diag_seq;
+	cache_dumps++;
+
 	for (;;) {
 		if (sendmsg(fd, &msg, 0) < 0) {
 			if (errno == EINTR)
@@ -110,7 +274,7 @@ static bool
 inet_send_query(const int fd, const int family, const int proto)
 {
 	struct {
-		const struct nlmsghdr nlh;
+		struct nlmsghdr nlh;
 		const struct inet_diag_req_v2 idr;
 	} req = {
 		.nlh = {
@@ -124,21 +288,20 @@ inet_send_query(const int fd, const int family, const int proto)
 			.idiag_states = -1
 		}
 	};
-	return send_query(fd, &req, sizeof(req));
+	return send_query(fd, &req.nlh, sizeof(req));
 }
 
-static int
+static char *
 inet_parse_response(const char *const proto_name, const void *const data,
-		    const int data_len, const unsigned long inode)
+		    const int data_len, unsigned long *const inode)
 {
 	const struct inet_diag_msg *const diag_msg = data;
 	static const char zero_addr[sizeof(struct in6_addr)];
 	socklen_t addr_size, text_size;
 
 	if (data_len < (int) NLMSG_LENGTH(sizeof(*diag_msg)))
-		return -1;
-	if (diag_msg->idiag_inode != inode)
-		return 0;
+		return NULL;
+	*inode = diag_msg->idiag_inode;
 
 	switch(diag_msg->idiag_family) {
 		case AF_INET:
@@ -150,7 +313,7 @@ inet_parse_response(const char *const proto_name, const void *const data,
 			text_size = INET6_ADDRSTRLEN;
 			break;
 		default:
-			return -1;
+			return NULL;
 	}
 
 	char src_buf[text_size];
@@ -158,7 +321,7 @@ inet_parse_response(const char *const proto_name, const void *const data,
 
 	if (!inet_ntop(diag_msg->idiag_family, diag_msg->id.idiag_src,
 		       src_buf, text_size))
-		return -1;
+		return NULL;
 
 	if (diag_msg->id.idiag_dport ||
 	    memcmp(zero_addr, diag_msg->id.idiag_dst, addr_size)) {
@@ -166,30 +329,34 @@ inet_parse_response(const char *const proto_name, const void *const data,
 
 		if (!inet_ntop(diag_msg->idiag_family, diag_msg->id.idiag_dst,
 			       dst_buf, text_size))
-			return -1;
+			return NULL;
 
 		if (asprintf(&details, "%s:[%s:%u->%s:%u]", proto_name,
 			     src_buf, ntohs(diag_msg->id.idiag_sport),
 			     dst_buf, ntohs(diag_msg->id.idiag_dport)) < 0)
-			return false;
+			return NULL;
 	} else {
 		if (asprintf(&details, "%s:[%s:%u]", proto_name, src_buf,
 			     ntohs(diag_msg->id.idiag_sport)) < 0)
-			return false;
+			return NULL;
 	}
 
-	return cache_and_print_inode_details(inode, details);
+	return details;
 }
 
+/*
+ * Receive the whole dump, caching the details of every socket in it.
+ * Returns true if the socket with the given inode has been found.
+ */
 static bool
 receive_responses(const int fd, const unsigned long inode,
 		  const char *proto_name,
-		  int (* parser) (const char *, const void *,
-				  int, unsigned long))
+		  char * (* parser) (const char *, const void *,
+				     int, unsigned long *))
 {
 	static union {
 		struct nlmsghdr hdr;
-		long buf[8192 / sizeof(long)];
+		long buf[32768 / sizeof(long)];
 	} hdr_buf;
 
 	struct sockaddr_nl nladdr = {
@@ -199,7 +366,11 @@ receive_responses(const int fd, const unsigned long inode,
 		.iov_base = hdr_buf.buf,
 		.iov_len = sizeof(hdr_buf.buf)
 	};
-	int flags = 0;
+	/*
+	 * The details of the requested socket are cached last,
+	 * so they are not evicted by the rest of a large dump.
+	 */
+	char *found = NULL;
 
 	for (;;) {
 		struct msghdr msg = {
@@ -209,28 +380,48 @@ receive_responses(const int fd, const unsigned long inode,
 			.msg_iovlen = 1
 		};
 
-		ssize_t ret = recvmsg(fd, &msg, flags);
+		ssize_t ret = recvmsg(fd, &msg, 0);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
-			return false;
+			goto fail;
 		}
 
 		const struct nlmsghdr *h = &hdr_buf.hdr;
 		if (!NLMSG_OK(h, ret))
-			return false;
+			goto fail;
 		for (; NLMSG_OK(h, ret); h = NLMSG_NEXT(h, ret)) {
+			/* Leftovers of an earlier failed session */
+			if (h->nlmsg_seq != diag_seq)
+				continue;
+			if (h->nlmsg_type == NLMSG_DONE)
+				goto done;
 			if (h->nlmsg_type != SOCK_DIAG_BY_FAMILY)
-				return false;
-			const int rc = parser(proto_name, NLMSG_DATA(h),
-					      h->nlmsg_len, inode);
-			if (rc > 0)
-				return true;
-			if (rc < 0)
-				return false;
+				goto fail;
+
+			unsigned long msg_inode = 0;
+			char *const details = parser(proto_name, NLMSG_DATA(h),
+						     h->nlmsg_len, &msg_inode);
+			if (!details)
+				continue;
+			if (!msg_inode) {
+				free(details);
+			} else if (msg_inode == inode) {
+				free(found);
+				found = details;
+			} else {
+				cache_inode_details(msg_inode, details);
+			}
 		}
-		flags = MSG_DONTWAIT;
 	}
+
+fail:
+	reset_diag_fd();
+done:
+	if (!found)
+		return false;
+	cache_inode_details(inode, found);
+	return true;
 }
 
 static bool
@@ -242,10 +433,10 @@ inet_print(const int fd, const int family, const int protocol,
 }
 
 static bool
-unix_send_query(const int fd, const unsigned long inode)
+unix_send_query(const int fd)
 {
 	struct {
-		const struct nlmsghdr nlh;
+		struct nlmsghdr nlh;
 		const struct unix_diag_req udr;
 	} req = {
 		.nlh = {
@@ -255,17 +446,16 @@ unix_send_query(const int fd, const unsigned long inode)
 		},
 		.udr = {
 			.sdiag_family = AF_UNIX,
-			.udiag_ino = inode,
 			.udiag_states = -1,
 			.udiag_show = UDIAG_SHOW_NAME | UDIAG_SHOW_PEER
 		}
 	};
-	return send_query(fd, &req, sizeof(req));
+	return send_query(fd, &req.nlh, sizeof(req));
 }
 
-static int
+static char *
 unix_parse_response(const char *proto_name, const void *data,
-		    const int data_len, const unsigned long inode)
+		    const int data_len, unsigned long *const inode)
 {
 	const struct unix_diag_msg *diag_msg = data;
 	struct rtattr *attr;
@@ -275,11 +465,10 @@ unix_parse_response(const char *proto_name, const void *data,
 	char path[UNIX_PATH_MAX + 1];
 
 	if (rta_len < 0)
-		return -1;
-	if (diag_msg->udiag_ino != inode)
-		return 0;
+		return NULL;
 	if (diag_msg->udiag_family != AF_UNIX)
-		return -1;
+		return NULL;
+	*inode = diag_msg->udiag_ino;
 
 	for (attr = (struct rtattr *) (diag_msg + 1);
 	     RTA_OK(attr, rta_len);
@@ -306,7 +495,7 @@ unix_parse_response(const char *proto_name, const void *data,
 	 * "UNIX:[" SELF_INODE [ "->" PEER_INODE ][ "," SOCKET_FILE ] "]"
 	 */
 	if (!peer && !path_len)
-		return -1;
+		return NULL;
 
 	char peer_str[3 + sizeof(peer) * 3];
 	if (peer)
@@ -333,18 +522,18 @@ unix_parse_response(const char *proto_name, const void *data,
 	}
 
 	char *details;
-	if (asprintf(&details, "%s:[%lu%s%s]", proto_name, inode,
+	if (asprintf(&details, "%s:[%lu%s%s]", proto_name, *inode,
 		     peer_str, path_str) < 0)
-		return -1;
+		return NULL;
 
-	return cache_and_print_inode_details(inode, details);
+	return details;
 }
 
 static bool
-netlink_send_query(const int fd, const unsigned long inode)
+netlink_send_query(const int fd)
 {
 	struct {
-		const struct nlmsghdr nlh;
+		struct nlmsghdr nlh;
 		const struct netlink_diag_req ndr;
 	} req = {
 		.nlh = {
@@ -358,24 +547,22 @@ netlink_send_query(const int fd, const unsigned long inode)
 			.ndiag_show = NDIAG_SHOW_MEMINFO
 		}
 	};
-	return send_query(fd, &req, sizeof(req));
+	return send_query(fd, &req.nlh, sizeof(req));
 }
 
-static int
+static char *
 netlink_parse_response(const char *proto_name, const void *data,
-		    const int data_len, const unsigned long inode)
+		    const int data_len, unsigned long *const inode)
 {
 	const struct netlink_diag_msg *const diag_msg = data;
 	const char *netlink_proto;
 	char *details;
 
 	if (data_len < (int) NLMSG_LENGTH(sizeof(*diag_msg)))
-		return -1;
-	if (diag_msg->ndiag_ino != inode)
-		return 0;
-
+		return NULL;
 	if (diag_msg->ndiag_family != AF_NETLINK)
-		return -1;
+		return NULL;
+	*inode = diag_msg->ndiag_ino;
 
 	netlink_proto = xlookup(netlink_protocols,
 				diag_msg->ndiag_protocol);
@@ -389,20 +576,20 @@ netlink_parse_response(const char *proto_name, const void *data,
 			netlink_proto += netlink_prefix_len;
 		if (asprintf(&details, "%s:[%s:%u]", proto_name,
 			     netlink_proto, diag_msg->ndiag_portid) < 0)
-			return -1;
+			return NULL;
 	} else {
 		if (asprintf(&details, "%s:[%u]", proto_name,
 			     (unsigned) diag_msg->ndiag_protocol) < 0)
-			return -1;
+			return NULL;
 	}
 
-	return cache_and_print_inode_details(inode, details);
+	return details;
 }
 
 static bool
 unix_print(const int fd, const unsigned long inode)
 {
-	return unix_send_query(fd, inode)
+	return unix_send_query(fd)
 		&& receive_responses(fd, inode, "UNIX", unix_parse_response);
 }
 
@@ -433,7 +620,7 @@ udp_v6_print(const int fd, const unsigned long inode)
 static bool
 netlink_print(const int fd, const unsigned long inode)
 {
-	return netlink_send_query(fd, inode)
+	return netlink_send_query(fd)
 		&& receive_responses(fd, inode, "NETLINK",
 				     netlink_parse_response);
 }
@@ -463,7 +650,9 @@ get_proto_by_name(const char *const name)
 }
 
 /* Given an inode number of a socket, print out the details
- * of the ip address and port. */
+ * of the ip address and port.  All sockets of the protocol
+ * are dumped at once, so subsequent lookups are served
+ * from the cache. */
 
 bool
 print_sockaddr_by_inode(const unsigned long inode, const enum sock_proto proto)
@@ -472,16 +661,18 @@ print_sockaddr_by_inode(const unsigned long inode, const enum sock_proto proto)
 	    (proto != SOCK_PROTO_UNKNOWN && !protocols[proto].print))
 		return false;
 
-	const int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG);
+	int fd = get_diag_fd();
 	if (fd < 0)
 		return false;
 	bool r = false;
 
+	cache_misses++;
+
 	if (proto != SOCK_PROTO_UNKNOWN) {
 		r = protocols[proto].print(fd, inode);
 		if (!r) {
 			tprintf("%s:[%lu]", protocols[proto].name, inode);
-			r = true;
+			return true;
 		}
 	} else {
 		unsigned int i;
@@ -489,12 +680,18 @@ print_sockaddr_by_inode(const unsigned long inode, const enum sock_proto proto)
 		     i < ARRAY_SIZE(protocols); ++i) {
 			if (!protocols[i].print)
 				continue;
+			/* The socket is reopened after a failure */
+			fd = get_diag_fd();
+			if (fd < 0)
+				return false;
 			r = protocols[i].print(fd, inode);
 			if (r)
 				break;
 		}
+		if (!r)
+			return false;
 	}
 
-	close(fd);
-	return r;
+	tprints(cache_lookup(inode));
+	return true;
 }
@@ -0,0 +1,525 @@
+/*
+ * Merge the STRACE_LOG.PID files written by strace -ff -o STRACE_LOG
+ * into a single log printed to the standard output.
+ *
+ * Every file is read a record at a time, a line of the text output or
+ * an object of the JSON output, and the records of all files are merged
+ * using a binary heap, so the memory used does not depend on the size
+ * of the logs.  If there are more files than descriptors available,
+ * some of them are closed and reopened at the same offset when needed.
+ *
+ * Records are ordered by the numbers printed by strace -Q, which are
+ * unique over all the processes of a trace.  Logs written without -Q
+ * are ordered by the -t, -tt or -ttt timestamps starting the lines,
+ * or by the "timestamp" members of the JSON objects.  Records without
+ * a number or a timestamp, such as -e read/write dumps, follow the
+ * record preceding them.
+ *
+ * Copyright (c) 2016 The strace developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *progname;
+
+struct source {
+	char *name;
+	unsigned long pid;
+	FILE *fp;
+	/* Where to continue reading if FP has been closed */
+	off_t offset;
+	bool json;
+
+	/* The current record */
+	char *rec;
+	size_t rec_len;
+	size_t rec_size;
+
+	/*
+	 * Its key, SEQ if it has been printed by -Q, TS otherwise;
+	 * both are kept from the previous record if it has none.
+	 */
+	bool numbered;
+	unsigned long long seq;
+	double ts;
+};
+
+static struct source *sources;
+static size_t nsources;
+static struct source **heap;
+static size_t heap_len;
+/* All the logs have been written with -Q */
+static bool by_seq = true;
+
+static unsigned long open_files;
+static unsigned long max_open_files;
+/* Next source to be closed when there are too many open files */
+static size_t victim;
+
+static void
+die(const char *fmt, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static void
+perror_die(const char *name)
+{
+	die("%s: %s", name, strerror(errno));
+}
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+
+	if (!p)
+		die("out of memory");
+
+	return p;
+}
+
+static void
+show_usage(FILE *fp)
+{
+	fprintf(fp, "\
+Usage: %s STRACE_LOG\n\
+\n\
+Finds all STRACE_LOG.PID files, adds PID prefix to every line of the text\n\
+output, then merges them and prints the result to standard output.\n\
+\n\
+The logs are merged in the order of the numbers printed by strace -Q;\n\
+logs produced without -Q are ordered by the -t[t[t]] timestamps\n\
+(the \"timestamp\" members of JSON objects).\n",
+		progname);
+}
+
+static FILE *
+source_file(struct source *s)
+{
+	if (s->fp)
+		return s->fp;
+
+	for (;;) {
+		while (open_files >= max_open_files) {
+			struct source *v = &sources[victim];
+
+			victim = (victim + 1) % nsources;
+			if (v == s || !v->fp)
+				continue;
+			v->offset = ftello(v->fp);
+			fclose(v->fp);
+			v->fp = NULL;
+			open_files--;
+		}
+
+		s->fp = fopen(s->name, "r");
+		if (s->fp)
+			break;
+		/* The limit has been guessed wrong, make do with fewer */
+		if (errno != EMFILE || open_files < 2)
+			perror_die(s->name);
+		max_open_files = open_files - 1;
+	}
+	if (s->offset && fseeko(s->fp, s->offset, SEEK_SET))
+		perror_die(s->name);
+	open_files++;
+
+	return s->fp;
+}
+
+static void
+source_close(struct source *s)
+{
+	if (s->fp) {
+		fclose(s->fp);
+		s->fp = NULL;
+		open_files--;
+	}
+}
+
+/* Appends a line to the current record of S; false at the end of file. */
+static bool
+read_line(struct source *s)
+{
+	FILE *fp = source_file(s);
+	int c;
+
+	while ((c = getc(fp)) != EOF) {
+		if (s->rec_len + 2 > s->rec_size) {
+			s->rec_size = s->rec_size ? s->rec_size * 2 : 256;
+			s->rec = xrealloc(s->rec, s->rec_size);
+		}
+		s->rec[s->rec_len++] = c;
+		if (c == '\n')
+			break;
+	}
+	if (ferror(fp))
+		perror_die(s->name);
+	if (c == EOF && (!s->rec_len || s->rec[s->rec_len - 1] == '\n'))
+		return false;
+
+	/* The last line of a log may be left unterminated */
+	if (s->rec[s->rec_len - 1] != '\n')
+		s->rec[s->rec_len++] = '\n';
+	s->rec[s->rec_len] = '\0';
+
+	return true;
+}
+
+/*
+ * Reads the rest of a JSON object started on the current line,
+ * the nesting is tracked outside of strings.  An object truncated
+ * by the end of file is left as is.
+ */
+static void
+read_json(struct source *s)
+{
+	size_t i = 0;
+	int depth = 0;
+	bool in_str = false;
+	bool seen = false;
+
+	for (;;) {
+		for (; i < s->rec_len; i++) {
+			char c = s->rec[i];
+
+			if (in_str) {
+				if (c == '\\')
+					i++;
+				else if (c == '"')
+					in_str = false;
+			} else if (c == '"') {
+				in_str = true;
+			} else if (c == '{' || c == '[') {
+				depth++;
+				seen = true;
+			} else if (c == '}' || c == ']') {
+				depth--;
+			}
+		}
+		if ((seen && depth <= 0) || !read_line(s))
+			return;
+	}
+}
+
+/*
+ * Finds the member NAME of the JSON object in the record,
+ * returns its value or NULL.
+ */
+static const char *
+json_member(const char *p, const char *name)
+{
+	size_t len = strlen(name);
+	int depth = 0;
+
+	for (; *p; p++) {
+		if (*p == '"') {
+			if (depth == 1 && !strncmp(p + 1, name, len) &&
+			    p[len + 1] == '"') {
+				p += len + 2;
+				while (isspace((unsigned char) *p) || *p == ':')
+					p++;
+				return p;
+			}
+			for (p++; *p && *p != '"'; p++) {
+				if (*p == '\\' && p[1])
+					p++;
+			}
+			if (!*p)
+				return NULL;
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			depth--;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Parses a -t (HH:MM:SS), -tt (HH:MM:SS.UUUUUU) or -ttt (SECONDS.UUUUUU)
+ * timestamp of LEN characters at P.
+ */
+static bool
+parse_ts(const char *p, size_t len, double *ts)
+{
+	const char *end = p + len;
+	double t = 0;
+	char *q;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (p == end || !isdigit((unsigned char) *p))
+			return false;
+		t = t * 60 + strtoul(p, &q, 10);
+		p = q;
+		if (p == end || *p != ':')
+			break;
+		p++;
+	}
+	if (p < end && *p == '.' && p + 1 < end &&
+	    isdigit((unsigned char) p[1])) {
+		t += strtod(p, &q);
+		p = q;
+	}
+	if (p != end)
+		return false;
+
+	*ts = t;
+	return true;
+}
+
+/* Reads the next record of S, false at the end of file. */
+static bool
+source_next(struct source *s)
+{
+	const char *p;
+
+	do {
+		s->rec_len = 0;
+		if (!read_line(s)) {
+			source_close(s);
+			return false;
+		}
+	} while (s->rec[0] == '\n');
+
+	s->numbered = false;
+
+	if (s->json) {
+		read_json(s);
+		p = json_member(s->rec, "seq");
+		if (p && isdigit((unsigned char) *p)) {
+			s->numbered = true;
+			s->seq = strtoull(p, NULL, 10);
+		}
+		/* A string with -t or -tt, a number with -ttt */
+		p = json_member(s->rec, "timestamp");
+		if (p && *p == '"')
+			parse_ts(p + 1, strcspn(p + 1, "\""), &s->ts);
+		else if (p)
+			parse_ts(p, strspn(p, "0123456789."), &s->ts);
+		return true;
+	}
+
+	/* A number followed by a space is printed by -Q only */
+	for (p = s->rec; isdigit((unsigned char) *p); p++)
+		;
+	if (p != s->rec && *p == ' ') {
+		s->numbered = true;
+		s->seq = strtoull(s->rec, NULL, 10);
+	}
+
+	/* With -Q, the timestamp follows the number */
+	p = s->rec;
+	if (s->numbered)
+		p += strcspn(p, " ") + 1;
+	parse_ts(p, strcspn(p, " \t\n"), &s->ts);
+
+	return true;
+}
+
+static bool
+source_less(const struct source *a, const struct source *b)
+{
+	if (by_seq) {
+		if (a->seq != b->seq)
+			return a->seq < b->seq;
+	} else if (a->ts != b->ts) {
+		return a->ts < b->ts;
+	}
+
+	/* Keep the records of the same key in the order of the files */
+	return a < b;
+}
+
+static void
+heap_down(size_t i)
+{
+	for (;;) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		struct source *tmp;
+
+		if (l < heap_len && source_less(heap[l], heap[min]))
+			min = l;
+		if (r < heap_len && source_less(heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static int
+pid_cmp(const void *a, const void *b)
+{
+	const struct source *x = a;
+	const struct source *y = b;
+
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static void
+find_sources(const char *logfile)
+{
+	const char *slash = strrchr(logfile, '/');
+	char *dirname = slash ? strndup(logfile, slash - logfile + 1)
+			      : strdup(".");
+	const char *base = slash ? slash + 1 : logfile;
+	size_t base_len = strlen(base);
+	size_t size = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	if (!dirname)
+		die("out of memory");
+
+	dir = opendir(dirname);
+	if (!dir)
+		perror_die(dirname);
+
+	while ((de = readdir(dir))) {
+		const char *suffix = de->d_name + base_len + 1;
+		char *end;
+		unsigned long pid;
+		struct source *s;
+
+		if (strncmp(de->d_name, base, base_len) ||
+		    de->d_name[base_len] != '.' || !isdigit(*suffix))
+			continue;
+		pid = strtoul(suffix, &end, 10);
+		if (*end || !pid)
+			continue;
+
+		if (nsources == size) {
+			size = size ? size * 2 : 64;
+			sources = xrealloc(sources, size * sizeof(*sources));
+		}
+		s = &sources[nsources++];
+		memset(s, 0, sizeof(*s));
+		s->pid = pid;
+		s->name = xrealloc(NULL, strlen(logfile) + strlen(suffix) + 2);
+		sprintf(s->name, "%s.%s", logfile, suffix);
+	}
+
+	closedir(dir);
+	free(dirname);
+
+	qsort(sources, nsources, sizeof(*sources), pid_cmp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long open_max = sysconf(_SC_OPEN_MAX);
+	size_t i;
+
+	progname = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1
+					 : argv[0];
+
+	if (argc == 2 && !strcmp(argv[1], "--help")) {
+		show_usage(stdout);
+		return 0;
+	}
+	if (argc != 2) {
+		show_usage(stderr);
+		return 1;
+	}
+
+	/* Leave some descriptors to the standard streams and the like */
+	max_open_files = open_max > 32 ? open_max - 16 : 16;
+
+	find_sources(argv[1]);
+	heap = xrealloc(NULL, (nsources + 1) * sizeof(*heap));
+
+	for (i = 0; i < nsources; i++) {
+		struct source *s = &sources[i];
+
+		/* The JSON output starts every object on a new line */
+		if (read_line(s)) {
+			s->json = s->rec_len > 1 &&
+				  s->rec[s->rec_len - 2] == '{';
+			if (fseeko(s->fp, 0, SEEK_SET))
+				perror_die(s->name);
+		}
+		s->rec_len = 0;
+
+		if (!source_next(s))
+			continue;
+		if (!s->numbered)
+			by_seq = false;
+		heap[heap_len++] = s;
+	}
+
+	if (!heap_len)
+		die("%s: strace output not found", argv[1]);
+
+	for (i = heap_len; i-- > 0; )
+		heap_down(i);
+
+	while (heap_len) {
+		struct source *s = heap[0];
+
+		if (!s->json)
+			printf("%-5lu ", s->pid);
+		fwrite(s->rec, 1, s->rec_len, stdout);
+
+		if (!source_next(s))
+			heap[0] = heap[--heap_len];
+		heap_down(0);
+	}
+
+	if (fflush(stdout) || ferror(stdout))
+		die("write error");
+
+	return 0;
+}
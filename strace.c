@@ -40,12 +40,18 @@
 #include <grp.h>
 #include <dirent.h>
 #include <sys/utsname.h>
+#include <poll.h>
+#ifdef HAVE_SYS_SIGNALFD_H
+# include <sys/signalfd.h>
+#endif
 #ifdef HAVE_PRCTL
 # include <sys/prctl.h>
 #endif
 
 #include "ptrace.h"
 #include "printsiginfo.h"
+#include "structured_fmt_text.h"
+#include "structured_fmt_binary.h"
 
 /* In some libc, these aren't declared. Do it ourself: */
 extern char **environ;
@@ -53,8 +59,10 @@ extern int optind;
 extern char *optarg;
 
 #ifdef USE_LIBUNWIND
-/* if this is true do the stack trace for every system call */
-bool stack_trace_enabled = false;
+/* 1: print the stack trace of every system call, 2: without symbols */
+unsigned int stack_trace_enabled;
+bool stack_trace_ids;
+bool stack_trace_fp;
 #endif
 
 #if defined __NR_tkill
@@ -86,10 +94,21 @@ bool debug_flag = 0;
 bool Tflag = 0;
 bool iflag = 0;
 bool count_wallclock = 0;
+bool count_percentiles = 0;
+/* -g: count per process, -gg: per thread */
+unsigned int count_procs = 0;
+/* -G: print only the processes with the greatest syscall time */
+unsigned int count_procs_top = 0;
+/* -R: report counts since the previous report every N seconds, on SIGUSR1 */
+bool count_reports = 0;
+static unsigned int count_report_interval;
 unsigned int qflag = 0;
 unsigned int tflag = 0;
 bool rflag = 0;
+bool Qflag = 0;
 bool print_pid_pfx = 0;
+/* -Q: number of the last leader printed, counted over all processes */
+unsigned long long print_seq;
 
 /* -I n */
 enum {
@@ -151,15 +170,30 @@ static int acolumn = DEFAULT_ACOLUMN;
 static char *acolumn_spaces;
 
 char *outfname = NULL;
+/* -L: render this file recorded by -j binary instead of tracing */
+static char *loadfname;
+/* Time stamp of the record being rendered, used by printleader */
+const struct timeval *loaded_tv;
+/* Its number among the leaders of the trace, likewise */
+const unsigned long long *loaded_seq;
+/* Number of processes rendering a -ff trace */
+static unsigned int load_workers;
 /* If -ff, points to stderr. Else, it's our common output log */
 static FILE *shared_log;
 
 struct tcb *printing_tcp = NULL;
-struct tcb *current_tcp;
+__thread struct tcb *current_tcp;
 
 static struct tcb **tcbtab;
 unsigned int nprocs;
 static unsigned int tcbtabsize;
+/*
+ * pid -> tcb hash index, chained through tcb->next.
+ * It has tcbtabsize buckets, tcbtabsize is always a power of 2.
+ */
+static struct tcb **pidtab;
+/* Unused tcbs, chained through tcb->next. */
+static struct tcb *free_tcbs;
 static const char *progname;
 
 unsigned os_release; /* generated from uname()'s u.release */
@@ -167,12 +201,17 @@ unsigned os_release; /* generated from uname()'s u.release */
 static void detach(struct tcb *tcp);
 static void cleanup(void);
 static void interrupt(int sig);
+static void request_report(int sig);
+static void init_signal_fd(void);
 static sigset_t empty_set, blocked_set;
 
 #ifdef HAVE_SIG_ATOMIC_T
 static volatile sig_atomic_t interrupted;
+/* -R: SIGALRM or SIGUSR1 has been received */
+static volatile sig_atomic_t report_pending;
 #else
 static volatile int interrupted;
+static volatile int report_pending;
 #endif
 
 #ifndef HAVE_STRERROR
@@ -200,17 +239,25 @@ static void
 usage(void)
 {
 	printf("\
-usage: strace [-CdffhiqrtttTvVwxxy] [-I n] [-e expr]...\n\
-              [-a column] [-o file] [-s strsize] [-P path]...\n\
-              -p pid... / [-D] [-E var=val]... [-u username] PROG [ARGS]\n\
-   or: strace -c[dfw] [-I n] [-e expr]... [-O overhead] [-S sortby]\n\
+usage: strace [-BCdffhinqQrtttTvVwxxy] [-I n] [-e expr]...\n\
+              [-a column] [-o file] [-s strsize] [-P path]... [-W threads]\n\
               -p pid... / [-D] [-E var=val]... [-u username] PROG [ARGS]\n\
+   or: strace -c[dfgHw] [-G top] [-I n] [-e expr]... [-O overhead]\n\
+              [-R interval] [-S sortby] -p pid... / [-D] [-E var=val]...\n\
+              [-u username] PROG [ARGS]\n\
+   or: strace [-fhQrtttT] [-j formatter] [-a column] [-o file] -L file\n\
 \n\
 Output format:\n\
-  -j formatter   use a formatter other than traditional\n\
-     options:    text, json\n\
+  -B             buffer output and write it in a separate thread\n\
+  -j formatter[,option]...\n\
+                 use a formatter other than traditional\n\
+     formatters: text, json, binary\n\
+     options:    hex (json: print addresses as hexadecimal strings)\n\
+                 raw (binary: record syscalls undecoded, decode them by -L)\n\
+  -L file        print the trace recorded with -j binary in FILE, do not trace\n\
   -o file        send trace output to FILE instead of stderr\n\
   -q             suppress messages about attaching, detaching, etc.\n\
+  -Q             number records in the order of output, for strace-log-merge\n\
   -s strsize     limit length of print strings to STRSIZE chars (default %d)\n\
   -y             print paths associated with file descriptor arguments\n\
   -yy            print protocol specific information associated with socket file descriptors\n\
@@ -225,19 +272,27 @@ Traditional formatter's options:\n\
   -t             print absolute timestamp\n\
   -tt            print absolute timestamp with usecs\n\
   -T             print time spent in each syscall\n\
+  -W threads     format syscalls in THREADS threads in parallel with tracing\n\
+                 (-L -ff -o file: print the trace in THREADS processes)\n\
   -x             print non-ascii strings in hex\n\
   -xx            print all strings in hex\n\
 \n\
 Statistics:\n\
   -c             count time, calls, and errors for each syscall and report summary\n\
   -C             like -c but also print regular output\n\
+  -g             count for each process separately, -gg: for each thread\n\
+  -G top         print only TOP processes with the greatest syscall time\n\
+  -H             print percentiles and maximum of syscall times in the summary\n\
   -O overhead    set overhead for tracing syscalls to OVERHEAD usecs\n\
+  -R interval    report counts since the previous report every INTERVAL seconds\n\
+                 (0: only when SIGUSR1 is received), and on SIGUSR1\n\
   -S sortby      sort syscall counts by: time, calls, name, nothing (default %s)\n\
   -w             summarise syscall latency (default is system time)\n\
 \n\
 Filtering:\n\
   -e expr        a qualifying expression: option=[!]all or option=[!]val1[,val2]...\n\
      options:    trace, abbrev, verbose, raw, signal, read, write\n\
+  -n             do not stop on syscalls not selected by -e trace (requires -f)\n\
   -P path        trace accesses to path\n\
 \n\
 Tracing:\n\
@@ -266,6 +321,12 @@ Miscellaneous:\n\
 "
 #ifdef USE_LIBUNWIND
 "  -k             obtain stack trace between each syscall (experimental)\n\
+  -kk            print stack frames as file offsets, without symbols\n\
+  -K             print every distinct stack trace once, then refer to it by id\n\
+  -U unwinder    walk stacks with: libunwind (default), fp (frame pointers,\n\
+                 falling back to libunwind if the chain is broken)\n\
+  -c -k          report the time blocked in syscalls by stack trace, in the\n\
+                 folded format of flame graphs\n\
 "
 #endif
 /* ancient, no one should use it
@@ -402,6 +463,8 @@ ptrace_restart(int op, struct tcb *tcp, int sig)
 	int err;
 	const char *msg;
 
+	umove_cache_invalidate();
+
 	errno = 0;
 	ptrace(op, tcp->pid, (void *) 0, (long) sig);
 	err = errno;
@@ -583,11 +646,19 @@ tprintf(const char *fmt, ...)
 	va_end(args);
 }
 
+/*
+ * With -j binary,raw the text printed by the decoders is not recorded,
+ * the decoders print it again when the recording is printed by -L.
+ */
 void
 vtprintf(const char *fmt, va_list args)
 {
-	if (current_tcp) {
-		int n = strace_vfprintf(current_tcp->outf, fmt, args);
+	if (current_tcp && !record_raw) {
+		int n = s_pipeline_threads ?
+			s_pipeline_vprintf(current_tcp->outf, fmt, args) :
+			outbuf_async ?
+			outbuf_vprintf(current_tcp->outf, fmt, args) :
+			strace_vfprintf(current_tcp->outf, fmt, args);
 		if (n < 0) {
 			if (current_tcp->outf != stderr)
 				perror_msg("%s", outfname);
@@ -603,8 +674,12 @@ vtprintf(const char *fmt, va_list args)
 void
 tprints(const char *str)
 {
-	if (current_tcp) {
-		int n = fputs_unlocked(str, current_tcp->outf);
+	if (current_tcp && !record_raw) {
+		int n = s_pipeline_threads ?
+			s_pipeline_puts(current_tcp->outf, str) :
+			outbuf_async ?
+			outbuf_puts(current_tcp->outf, str) :
+			fputs_unlocked(str, current_tcp->outf);
 		if (n >= 0) {
 			current_tcp->curcol += strlen(str);
 			return;
@@ -614,12 +689,51 @@ tprints(const char *str)
 	}
 }
 
+/*
+ * Write LEN bytes of BUF, which may contain NUL bytes, to the output of TCP.
+ * Used by the binary formatter, so neither -W (text only) nor ->curcol
+ * are taken care of.
+ */
+void
+twrite(struct tcb *tcp, const char *buf, size_t len)
+{
+	if (outbuf_async)
+		outbuf_put(tcp->outf, buf, len);
+	else if (fwrite(buf, 1, len, tcp->outf) != len &&
+		 tcp->outf != stderr)
+		perror_msg("%s", outfname);
+}
+
+/*
+ * Pass the output printed so far on to the formatter threads
+ * or the output writer, if any.
+ */
+void
+tflush(void)
+{
+	if (s_pipeline_threads)
+		s_pipeline_flush();
+	else if (outbuf_async)
+		outbuf_flush();
+}
+
+/* Wait until the output printed so far is written out. */
+static void
+sync_output(void)
+{
+	s_pipeline_sync();
+	outbuf_sync();
+}
+
 void
 line_ended(void)
 {
 	if (current_tcp) {
 		current_tcp->curcol = 0;
-		fflush(current_tcp->outf);
+		if (s_pipeline_threads || outbuf_async)
+			tflush();
+		else
+			fflush(current_tcp->outf);
 	}
 	if (printing_tcp) {
 		printing_tcp->curcol = 0;
@@ -655,10 +769,18 @@ printleader(struct tcb *tcp)
 	current_tcp = tcp;
 	current_tcp->curcol = 0;
 
+	if (loaded_seq)
+		print_seq = *loaded_seq;
+	else
+		print_seq++;
+
 	if (tflag) {
 		static struct timeval otv;
 
-		gettimeofday(&tv, NULL);
+		if (loaded_tv)
+			tv = *loaded_tv;
+		else
+			gettimeofday(&tv, NULL);
 
 		if (rflag) {
 			if (otv.tv_sec == 0)
@@ -693,6 +815,36 @@ newoutf(struct tcb *tcp)
 	}
 }
 
+static struct tcb **
+pidtab_bucket(int pid)
+{
+	return &pidtab[(unsigned int) pid & (tcbtabsize - 1)];
+}
+
+static void
+pidtab_insert(struct tcb *tcp)
+{
+	struct tcb **bucket = pidtab_bucket(tcp->pid);
+
+	tcp->next = *bucket;
+	*bucket = tcp;
+}
+
+static void
+pidtab_remove(struct tcb *tcp)
+{
+	struct tcb **link;
+
+	for (link = pidtab_bucket(tcp->pid); *link; link = &(*link)->next) {
+		if (*link == tcp) {
+			*link = tcp->next;
+			tcp->next = NULL;
+			return;
+		}
+	}
+	error_msg_and_die("bug in pidtab_remove");
+}
+
 static void
 expand_tcbtab(void)
 {
@@ -701,7 +853,7 @@ expand_tcbtab(void)
 	   callers have pointers and it would be a pain.
 	   So tcbtab is a table of pointers.  Since we never
 	   free the TCBs, we allocate a single chunk of many.  */
-	unsigned int new_tcbtabsize, alloc_tcbtabsize;
+	unsigned int i, old_tcbtabsize, new_tcbtabsize, alloc_tcbtabsize;
 	struct tcb *newtcbs;
 
 	if (tcbtabsize) {
@@ -713,41 +865,50 @@ expand_tcbtab(void)
 
 	newtcbs = xcalloc(alloc_tcbtabsize, sizeof(newtcbs[0]));
 	tcbtab = xreallocarray(tcbtab, new_tcbtabsize, sizeof(tcbtab[0]));
-	while (tcbtabsize < new_tcbtabsize)
+	old_tcbtabsize = tcbtabsize;
+	while (tcbtabsize < new_tcbtabsize) {
+		newtcbs->next = free_tcbs;
+		free_tcbs = newtcbs;
 		tcbtab[tcbtabsize++] = newtcbs++;
+	}
+
+	/* Rehash active tcbs into the bigger index. */
+	free(pidtab);
+	pidtab = xcalloc(tcbtabsize, sizeof(pidtab[0]));
+	for (i = 0; i < old_tcbtabsize; i++) {
+		if (tcbtab[i]->pid)
+			pidtab_insert(tcbtab[i]);
+	}
 }
 
 static struct tcb *
 alloctcb(int pid)
 {
-	unsigned int i;
 	struct tcb *tcp;
 
-	if (nprocs == tcbtabsize)
+	if (!free_tcbs)
 		expand_tcbtab();
 
-	for (i = 0; i < tcbtabsize; i++) {
-		tcp = tcbtab[i];
-		if (!tcp->pid) {
-			memset(tcp, 0, sizeof(*tcp));
-			tcp->pid = pid;
+	tcp = free_tcbs;
+	free_tcbs = tcp->next;
+
+	memset(tcp, 0, sizeof(*tcp));
+	tcp->pid = pid;
 #if SUPPORTED_PERSONALITIES > 1
-			tcp->currpers = current_personality;
+	tcp->currpers = current_personality;
 #endif
+	pidtab_insert(tcp);
 
 #ifdef USE_LIBUNWIND
-			if (stack_trace_enabled)
-				unwind_tcb_init(tcp);
+	if (stack_trace_enabled)
+		unwind_tcb_init(tcp);
 #endif
 
-			nprocs++;
-			if (debug_flag)
-				error_msg("new tcb for pid %d, active tcbs:%d",
-					  tcp->pid, nprocs);
-			return tcp;
-		}
-	}
-	error_msg_and_die("bug in alloctcb");
+	nprocs++;
+	if (debug_flag)
+		error_msg("new tcb for pid %d, active tcbs:%d",
+			  tcp->pid, nprocs);
+	return tcp;
 }
 
 void *
@@ -781,13 +942,18 @@ free_tcb_priv_data(struct tcb *tcp)
 	}
 }
 
-static void
+void
 droptcb(struct tcb *tcp)
 {
 	if (tcp->pid == 0)
 		return;
 
+	umove_cache_invalidate();
 	free_tcb_priv_data(tcp);
+	fdtable_release(tcp);
+	count_release(tcp);
+	s_syscall_release(tcp);
+	s_printer_release(tcp);
 
 #ifdef USE_LIBUNWIND
 	if (stack_trace_enabled) {
@@ -801,6 +967,7 @@ droptcb(struct tcb *tcp)
 			  tcp->pid, nprocs);
 
 	if (tcp->outf) {
+		sync_output();
 		if (followfork >= 2) {
 			if (tcp->curcol != 0)
 				fprintf(tcp->outf, " <detached ...>\n");
@@ -817,7 +984,10 @@ droptcb(struct tcb *tcp)
 	if (printing_tcp == tcp)
 		printing_tcp = NULL;
 
+	pidtab_remove(tcp);
 	memset(tcp, 0, sizeof(*tcp));
+	tcp->next = free_tcbs;
+	free_tcbs = tcp;
 }
 
 /* Detach traced process.
@@ -1213,6 +1383,9 @@ exec_or_die(void)
 		alarm(0);
 	}
 
+	if (seccomp_filtering)
+		init_seccomp_filter();
+
 	execv(params->pathname, params->argv);
 	perror_msg_and_die("exec");
 }
@@ -1557,14 +1730,157 @@ void
 set_printer_or_die(const char *optarg)
 {
 	struct s_printer **cur = s_printers;
+	const char *opts = strchr(optarg, ',');
+	size_t len = opts ? (size_t) (opts - optarg) : strlen(optarg);
+	char *copy, *opt;
+
 	for (; *cur; cur++) {
-		if (strcmp((*cur)->name, optarg) == 0) {
-			s_printer_cur = *cur;
-			return;
+		if (strlen((*cur)->name) == len &&
+		    strncmp((*cur)->name, optarg, len) == 0)
+			break;
+	}
+
+	if (!*cur)
+		error_msg_and_die("No such formatter '%.*s'", (int) len, optarg);
+
+	s_printer_cur = *cur;
+	if (!opts)
+		return;
+
+	copy = xstrdup(opts + 1);
+	for (opt = strtok(copy, ","); opt; opt = strtok(NULL, ",")) {
+		if (!s_printer_cur->set_option ||
+		    !s_printer_cur->set_option(opt))
+			error_msg_and_die("Invalid option '%s' of formatter '%s'",
+					  opt, s_printer_cur->name);
+	}
+	free(copy);
+}
+
+static void
+open_shared_log(void)
+{
+	/* Check if they want to redirect the output. */
+	if (outfname) {
+		/* See if they want to pipe the output. */
+		if (outfname[0] == '|' || outfname[0] == '!') {
+			/*
+			 * We can't do the <outfname>.PID funny business
+			 * when using popen, so prohibit it.
+			 */
+			if (followfork >= 2)
+				error_msg_and_help("piping the output and -ff are mutually exclusive");
+			shared_log = strace_popen(outfname + 1);
+		}
+		else if (followfork < 2)
+			shared_log = strace_fopen(outfname);
+	} else {
+		/* -ff without -o FILE is the same as single -f */
+		if (followfork >= 2)
+			followfork = 1;
+	}
+
+	if (!outfname || outfname[0] == '|' || outfname[0] == '!') {
+		char *buf = xmalloc(BUFSIZ);
+		setvbuf(shared_log, buf, outbuf_async ? _IOFBF : _IOLBF,
+			BUFSIZ);
+	}
+}
+
+/*
+ * -L: nothing is traced, the tcbs are made up from the records
+ * of the file, and anything that needs a live tracee is turned off.
+ */
+static void
+init_load(const char *prog, int optF)
+{
+	if (prog || nprocs)
+		error_msg_and_help("-L and PROG [ARGS] or -p PID are mutually exclusive");
+
+	if (!followfork)
+		followfork = optF;
+
+	if (cflag) {
+		error_msg("-%c has no effect with -L",
+			  cflag == CFLAG_BOTH ? 'C' : 'c');
+		cflag = 0;
+	}
+	if (iflag) {
+		error_msg("-%c has no effect with -L", 'i');
+		iflag = 0;
+	}
+#ifdef USE_LIBUNWIND
+	if (stack_trace_enabled) {
+		error_msg("-%c has no effect with -L", 'k');
+		stack_trace_enabled = 0;
+	}
+#endif
+	if (show_fd_path) {
+		error_msg("-%c has no effect with -L", 'y');
+		show_fd_path = 0;
+	}
+	if (record_raw)
+		error_msg_and_help("-j binary,raw and -L are mutually exclusive");
+
+	/* The rendered trace is the output proper, not a diagnostic */
+	if (!outfname)
+		shared_log = stdout;
+	open_shared_log();
+
+	/*
+	 * With -ff every process is printed to its own file regardless
+	 * of the others, so -W sets the number of processes printing them.
+	 */
+	if (followfork >= 2 && strcmp(loadfname, "-")) {
+		load_workers = s_pipeline_threads;
+		if (!load_workers) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+			load_workers = cpus > 0 ? cpus : 1;
+		}
+	} else if (s_pipeline_threads) {
+		error_msg("-W has no effect with -L without -ff -o FILE");
+	}
+	s_pipeline_threads = 0;
+
+	/* The workers start their output threads themselves */
+	if (load_workers <= 1)
+		outbuf_init();
+
+	print_pid_pfx = (outfname && followfork == 1);
+}
+
+/* -L -ff: print the processes of the trace in LOAD_WORKERS processes. */
+static int
+load_parallel(void)
+{
+	unsigned int i;
+	pid_t pid;
+	int status;
+	int rc = 0;
+
+	fflush(NULL);
+	for (i = 0; i < load_workers; i++) {
+		pid = fork();
+		if (pid < 0)
+			perror_msg_and_die("fork");
+		if (!pid) {
+			outbuf_init();
+			return s_binary_load(loadfname, i, load_workers);
+		}
+	}
+
+	for (;;) {
+		if (wait(&status) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			rc = 1;
 	}
 
-	error_msg_and_die("No such formatter '%s'", optarg);
+	return rc;
 }
 
 /*
@@ -1607,12 +1923,12 @@ init(int argc, char *argv[])
 #endif
 	qualify("signal=all");
 	while ((c = getopt(argc, argv,
-		"+b:cCdfFhiqNMrtTvVwxyz"
+		"+b:BcCdfFghHinqNMQrtTvVwxyz"
 #ifdef USE_LIBUNWIND
-		"k"
+		"kKU:"
 #endif
 		"D"
-		"a:e:j:o:O:p:s:S:u:E:P:I:")) != EOF) {
+		"a:e:G:j:L:o:O:p:R:s:S:u:E:P:I:W:")) != EOF) {
 		switch (c) {
 		case 'b':
 			if (strcmp(optarg, "execve") != 0)
@@ -1644,6 +1960,18 @@ init(int argc, char *argv[])
 		case 'f':
 			followfork++;
 			break;
+		case 'g':
+			count_procs++;
+			break;
+		case 'G':
+			i = string_to_uint(optarg);
+			if (i <= 0)
+				error_opt_arg(c, optarg);
+			count_procs_top = i;
+			break;
+		case 'H':
+			count_percentiles = 1;
+			break;
 		case 'h':
 			usage();
 			break;
@@ -1653,6 +1981,12 @@ init(int argc, char *argv[])
 		case 'j':
 			set_printer_or_die(optarg);
 			break;
+		case 'B':
+			outbuf_async = true;
+			break;
+		case 'n':
+			seccomp_filtering = true;
+			break;
 		case 'N':
 			show_arg_names--;
 			break;
@@ -1662,6 +1996,9 @@ init(int argc, char *argv[])
 		case 'q':
 			qflag++;
 			break;
+		case 'Q':
+			Qflag = 1;
+			break;
 		case 'r':
 			rflag = 1;
 			/* fall through to tflag++ */
@@ -1698,6 +2035,9 @@ init(int argc, char *argv[])
 		case 'e':
 			qualify(optarg);
 			break;
+		case 'L':
+			loadfname = xstrdup(optarg);
+			break;
 		case 'o':
 			outfname = xstrdup(optarg);
 			break;
@@ -1719,6 +2059,13 @@ init(int argc, char *argv[])
 				error_opt_arg(c, optarg);
 			max_strlen = i;
 			break;
+		case 'R':
+			i = string_to_uint(optarg);
+			if (i < 0)
+				error_opt_arg(c, optarg);
+			count_reports = 1;
+			count_report_interval = i;
+			break;
 		case 'S':
 			set_sortby(optarg);
 			break;
@@ -1727,7 +2074,18 @@ init(int argc, char *argv[])
 			break;
 #ifdef USE_LIBUNWIND
 		case 'k':
-			stack_trace_enabled = true;
+			stack_trace_enabled++;
+			break;
+		case 'K':
+			stack_trace_ids = true;
+			break;
+		case 'U':
+			if (!strcmp(optarg, "fp"))
+				stack_trace_fp = true;
+			else if (!strcmp(optarg, "libunwind"))
+				stack_trace_fp = false;
+			else
+				error_opt_arg(c, optarg);
 			break;
 #endif
 		case 'E':
@@ -1739,6 +2097,12 @@ init(int argc, char *argv[])
 			if (opt_intr <= 0 || opt_intr >= NUM_INTR_OPTS)
 				error_opt_arg(c, optarg);
 			break;
+		case 'W':
+			i = string_to_uint(optarg);
+			if (i < 0)
+				error_opt_arg(c, optarg);
+			s_pipeline_threads = i;
+			break;
 		default:
 			error_msg_and_help(NULL);
 			break;
@@ -1747,10 +2111,20 @@ init(int argc, char *argv[])
 	argv += optind;
 	/* argc -= optind; - no need, argc is not used below */
 
+#ifdef USE_LIBUNWIND
+	if ((stack_trace_ids || stack_trace_fp) && !stack_trace_enabled)
+		stack_trace_enabled = 1;
+#endif
+
 	acolumn_spaces = xmalloc(acolumn + 1);
 	memset(acolumn_spaces, ' ', acolumn);
 	acolumn_spaces[acolumn] = '\0';
 
+	if (loadfname) {
+		init_load(argv[0], optF);
+		return;
+	}
+
 	if (!argv[0] && !nprocs) {
 		error_msg_and_help("must have PROG [ARGS] or -p PID");
 	}
@@ -1770,13 +2144,63 @@ init(int argc, char *argv[])
 		error_msg_and_help("-w must be given with (-c or -C)");
 	}
 
+	if (count_percentiles && !cflag) {
+		error_msg_and_help("-H must be given with (-c or -C)");
+	}
+
+	if (count_procs_top && !count_procs)
+		count_procs = 1;
+	if (count_procs && !cflag) {
+		error_msg_and_help("-g must be given with (-c or -C)");
+	}
+
+	if (count_reports && !cflag) {
+		error_msg_and_help("-R must be given with (-c or -C)");
+	}
+
+	/*
+	 * Syscalls of tracees that are not traced by us
+	 * would fail with ENOSYS under the seccomp filter.
+	 */
+	if (seccomp_filtering && nprocs) {
+		error_msg("-n has no effect with -p");
+		seccomp_filtering = false;
+	}
+	if (seccomp_filtering && !followfork) {
+		error_msg("-n has no effect without -f");
+		seccomp_filtering = false;
+	}
+	if (seccomp_filtering && detach_on_execve) {
+		error_msg("-n has no effect with -b");
+		seccomp_filtering = false;
+	}
+	if (seccomp_filtering && NOMMU_SYSTEM) {
+		error_msg("-n is not supported on NOMMU systems");
+		seccomp_filtering = false;
+	}
+	check_seccomp_filter();
+
+	/*
+	 * Only the traditional formatter keeps no state between syscalls
+	 * that a formatter thread would need, and -y has to look at
+	 * the descriptors before the tracee is restarted.
+	 */
+	if (s_pipeline_threads && s_printer_cur != &s_printer_text) {
+		error_msg("-W is supported only by the text formatter, ignored");
+		s_pipeline_threads = 0;
+	}
+	if (s_pipeline_threads && show_fd_path) {
+		error_msg("-W has no effect with -y");
+		s_pipeline_threads = 0;
+	}
+	if (s_pipeline_threads && cflag == CFLAG_ONLY_STATS) {
+		error_msg("-W has no effect with -c");
+		s_pipeline_threads = 0;
+	}
+
 	if (cflag == CFLAG_ONLY_STATS) {
 		if (iflag)
 			error_msg("-%c has no effect with -c", 'i');
-#ifdef USE_LIBUNWIND
-		if (stack_trace_enabled)
-			error_msg("-%c has no effect with -c", 'k');
-#endif
 		if (rflag)
 			error_msg("-%c has no effect with -c", 'r');
 		if (tflag)
@@ -1787,6 +2211,20 @@ init(int argc, char *argv[])
 			error_msg("-%c has no effect with -c", 'y');
 	}
 
+	/* Stack traces and descriptor paths cannot be looked up by -L */
+	if (record_raw) {
+#ifdef USE_LIBUNWIND
+		if (stack_trace_enabled) {
+			error_msg("-%c has no effect with -j binary,raw", 'k');
+			stack_trace_enabled = 0;
+		}
+#endif
+		if (show_fd_path) {
+			error_msg("-%c has no effect with -j binary,raw", 'y');
+			show_fd_path = 0;
+		}
+	}
+
 #ifdef USE_LIBUNWIND
 	if (stack_trace_enabled)
 		unwind_init();
@@ -1815,6 +2253,8 @@ init(int argc, char *argv[])
 		ptrace_setoptions |= PTRACE_O_TRACECLONE |
 				     PTRACE_O_TRACEFORK |
 				     PTRACE_O_TRACEVFORK;
+	if (seccomp_filtering)
+		ptrace_setoptions |= PTRACE_O_TRACESECCOMP;
 	if (debug_flag)
 		error_msg("ptrace_setoptions = %#x", ptrace_setoptions);
 	test_ptrace_seize();
@@ -1832,30 +2272,7 @@ init(int argc, char *argv[])
 	 */
 	ensure_standard_fds_opened();
 
-	/* Check if they want to redirect the output. */
-	if (outfname) {
-		/* See if they want to pipe the output. */
-		if (outfname[0] == '|' || outfname[0] == '!') {
-			/*
-			 * We can't do the <outfname>.PID funny business
-			 * when using popen, so prohibit it.
-			 */
-			if (followfork >= 2)
-				error_msg_and_help("piping the output and -ff are mutually exclusive");
-			shared_log = strace_popen(outfname + 1);
-		}
-		else if (followfork < 2)
-			shared_log = strace_fopen(outfname);
-	} else {
-		/* -ff without -o FILE is the same as single -f */
-		if (followfork >= 2)
-			followfork = 1;
-	}
-
-	if (!outfname || outfname[0] == '|' || outfname[0] == '!') {
-		char *buf = xmalloc(BUFSIZ);
-		setvbuf(shared_log, buf, _IOLBF, BUFSIZ);
-	}
+	open_shared_log();
 	if (outfname && argv[0]) {
 		if (!opt_intr)
 			opt_intr = INTR_NEVER;
@@ -1916,9 +2333,27 @@ init(int argc, char *argv[])
 		sigaction(SIGPIPE, &sa, NULL);
 		sigaction(SIGTERM, &sa, NULL);
 	}
+	/*
+	 * Like fatal signals in interactive mode, report requests are
+	 * blocked while syscall stops are processed, and acted on while
+	 * waiting for new stops.
+	 */
+	if (count_reports) {
+		sigaddset(&blocked_set, SIGALRM);
+		sigaddset(&blocked_set, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &blocked_set, NULL);
+		sa.sa_handler = request_report;
+		sigaction(SIGALRM, &sa, NULL);
+		sigaction(SIGUSR1, &sa, NULL);
+		count_report_init(count_report_interval);
+	}
 	if (nprocs != 0 || daemonized_tracer)
 		startup_attach();
 
+	init_signal_fd();
+	s_pipeline_init();
+	outbuf_init();
+
 	/* Do we want pids printed in our -o OUTFILE?
 	 * -ff: no (every pid has its own file); or
 	 * -f: yes (there can be more pids in the future); or
@@ -1930,13 +2365,12 @@ init(int argc, char *argv[])
 static struct tcb *
 pid2tcb(int pid)
 {
-	unsigned int i;
+	struct tcb *tcp;
 
-	if (pid <= 0)
+	if (pid <= 0 || !tcbtabsize)
 		return NULL;
 
-	for (i = 0; i < tcbtabsize; i++) {
-		struct tcb *tcp = tcbtab[i];
+	for (tcp = *pidtab_bucket(pid); tcp; tcp = tcp->next) {
 		if (tcp->pid == pid)
 			return tcp;
 	}
@@ -1944,6 +2378,29 @@ pid2tcb(int pid)
 	return NULL;
 }
 
+/* Returns the tcb of PID in the trace being rendered (-L). */
+struct tcb *
+load_tcb(int pid)
+{
+	struct tcb *tcp = pid2tcb(pid);
+
+	if (!tcp) {
+		tcp = alloctcb(pid);
+		newoutf(tcp);
+	}
+
+	return tcp;
+}
+
+static void
+drop_loaded_tcbs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < tcbtabsize; i++)
+		droptcb(tcbtab[i]);
+}
+
 static void
 cleanup(void)
 {
@@ -1951,6 +2408,8 @@ cleanup(void)
 	struct tcb *tcp;
 	int fatal_sig;
 
+	s_pipeline_finish();
+
 	/* 'interrupted' is a volatile object, fetch it only once */
 	fatal_sig = interrupted;
 	if (!fatal_sig)
@@ -1968,6 +2427,7 @@ cleanup(void)
 		}
 		detach(tcp);
 	}
+	outbuf_finish();
 	if (cflag)
 		call_summary(shared_log);
 }
@@ -1978,6 +2438,12 @@ interrupt(int sig)
 	interrupted = sig;
 }
 
+static void
+request_report(int sig)
+{
+	report_pending = 1;
+}
+
 static void
 print_debug_info(const int pid, int status)
 {
@@ -2078,6 +2544,7 @@ maybe_switch_tcbs(struct tcb *tcp, const int pid)
 	if (!execve_thread)
 		return tcp;
 
+	sync_output();
 	if (execve_thread->curcol != 0) {
 		/*
 		 * One case we are here is -ff:
@@ -2097,7 +2564,9 @@ maybe_switch_tcbs(struct tcb *tcp, const int pid)
 	droptcb(tcp);
 	/* Switch to the thread, reusing leader's outfile and pid */
 	tcp = execve_thread;
+	pidtab_remove(tcp);
 	tcp->pid = pid;
+	pidtab_insert(tcp);
 	if (cflag != CFLAG_ONLY_STATS) {
 		s_print_message(tcp, S_MSG_INFO,
 			"superseded by execve in pid %lu", old_pid);
@@ -2177,63 +2646,206 @@ startup_tcb(struct tcb *tcp)
 	}
 }
 
-/* Returns true iff the main trace loop has to continue. */
-static bool
-trace(void)
-{
+/* A wait status reaped by wait4(), along with the rusage of the tracee. */
+struct wait_data {
 	int pid;
-	int wait_errno;
 	int status;
-	bool stopped;
-	unsigned int sig;
-	unsigned int event;
-	struct tcb *tcp;
 	struct rusage ru;
+};
 
-	if (interrupted)
-		return false;
+/* Wait statuses reaped by the last wait_for_tracees() call. */
+static struct wait_data *wait_batch;
+static unsigned int wait_batch_size;
 
+/* Batching statistics, reported with -d. */
+static unsigned long wait_wakeups;
+static unsigned long wait_events;
+static unsigned int wait_events_max;
+
+#ifdef HAVE_SYS_SIGNALFD_H
+/* Delivers fatal signals, report requests and SIGCHLD. */
+static int signal_fd = -1;
+#endif
+
+/*
+ * In interactive mode or with -R, keep the signals of blocked_set
+ * and SIGCHLD blocked and receive them via signalfd, so that waiting
+ * for tracees does not require unblocking signals around every wait.
+ */
+static void
+init_signal_fd(void)
+{
+#ifdef HAVE_SYS_SIGNALFD_H
+	sigset_t set;
+
+	if (!interactive && !count_reports)
+		return;
+
+	set = blocked_set;
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		if (debug_flag)
+			perror_msg("signalfd");
+		sigemptyset(&set);
+		sigaddset(&set, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+	}
+#endif
+}
+
+#ifdef HAVE_SYS_SIGNALFD_H
+/*
+ * Read the pending signals without blocking.
+ * Returns false if a fatal signal or a report request has been received.
+ */
+static bool
+read_signal_fd(void)
+{
+	struct signalfd_siginfo si;
+
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGALRM || si.ssi_signo == SIGUSR1)
+			report_pending = 1;
+		else if (si.ssi_signo != SIGCHLD)
+			interrupted = si.ssi_signo;
+	}
+
+	return !interrupted && !report_pending;
+}
+
+/*
+ * Wait for SIGCHLD, a fatal signal or a report request.
+ * Returns false if a fatal signal or a report request has been received.
+ */
+static bool
+wait_signal_fd(void)
+{
+	struct pollfd pfd = { .fd = signal_fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		perror_msg_and_die("poll");
+
+	return read_signal_fd();
+}
+#endif
+
+/*
+ * Wait for tracees to change state and reap all pending wait statuses
+ * into wait_batch.  Returns the number of reaped statuses, 0 if waiting
+ * was interrupted by a signal, or -1 if there is nobody left to wait for.
+ */
+static int
+wait_for_tracees(void)
+{
+	unsigned int n = 0;
+	bool block = true;
+
+#ifdef HAVE_SYS_SIGNALFD_H
 	/*
-	 * Used to exit simply when nprocs hits zero, but in this testcase:
-	 *  int main() { _exit(!!fork()); }
-	 * under strace -f, parent sometimes (rarely) manages
-	 * to exit before we see the first stop of the child,
-	 * and we are losing track of it:
-	 *  19923 clone(...) = 19924
-	 *  19923 exit_group(1)     = ?
-	 *  19923 +++ exited with 1 +++
-	 * Exiting only when wait() returns ECHILD works better.
+	 * With signal_fd, blocking happens in wait_signal_fd().
+	 * Pending signals are read every round, so that tracees
+	 * that keep stopping cannot hold them back.
 	 */
-	if (popen_pid != 0) {
-		/* However, if -o|logger is in use, we can't do that.
-		 * Can work around that by double-forking the logger,
-		 * but that loses the ability to wait for its completion
-		 * on exit. Oh well...
-		 */
-		if (nprocs == 0)
-			return false;
+	if (signal_fd >= 0) {
+		block = false;
+		if (!read_signal_fd())
+			return 0;
 	}
+#endif
 
-	if (interactive)
-		sigprocmask(SIG_SETMASK, &empty_set, NULL);
-	pid = wait4(-1, &status, __WALL, (cflag ? &ru : NULL));
-	wait_errno = errno;
-	if (interactive)
-		sigprocmask(SIG_BLOCK, &blocked_set, NULL);
+	for (;;) {
+		struct wait_data *wd;
+		int pid;
+		int wait_errno;
 
-	if (pid < 0) {
-		if (wait_errno == EINTR)
-			return true;
-		if (nprocs == 0 && wait_errno == ECHILD)
-			return false;
-		/*
-		 * If nprocs > 0, ECHILD is not expected,
-		 * treat it as any other error here:
-		 */
-		errno = wait_errno;
-		perror_msg_and_die("wait4(__WALL)");
+		if (n == wait_batch_size) {
+			wait_batch_size = wait_batch_size ? wait_batch_size * 2 : 64;
+			wait_batch = xreallocarray(wait_batch, wait_batch_size,
+						   sizeof(wait_batch[0]));
+		}
+		wd = &wait_batch[n];
+
+		if (block && (interactive || count_reports))
+			sigprocmask(SIG_SETMASK, &empty_set, NULL);
+		pid = wait4(-1, &wd->status, __WALL | (block ? 0 : WNOHANG),
+			    (cflag ? &wd->ru : NULL));
+		wait_errno = errno;
+		if (block && (interactive || count_reports))
+			sigprocmask(SIG_BLOCK, &blocked_set, NULL);
+
+		if (pid > 0) {
+			/* Drain everything else that is already pending. */
+			wd->pid = pid;
+			n++;
+			block = false;
+			continue;
+		}
+
+		if (n)
+			break;
+
+		if (pid < 0) {
+			if (wait_errno == EINTR)
+				return 0;
+			if (nprocs == 0 && wait_errno == ECHILD)
+				return -1;
+			/*
+			 * If nprocs > 0, ECHILD is not expected,
+			 * treat it as any other error here:
+			 */
+			errno = wait_errno;
+			perror_msg_and_die("wait4(__WALL)");
+		}
+
+#ifdef HAVE_SYS_SIGNALFD_H
+		/* Nothing is pending yet. */
+		if (!wait_signal_fd())
+			return 0;
+#endif
 	}
 
+	wait_wakeups++;
+	wait_events += n;
+	if (wait_events_max < n)
+		wait_events_max = n;
+
+	return n;
+}
+
+/*
+ * Forget wait statuses that have been reaped but not handled
+ * because we are about to detach.  Tracees that are in ptrace-stop
+ * can be detached right away, tracees that are gone need no detaching.
+ */
+static void
+drop_wait_batch(unsigned int i, unsigned int n)
+{
+	for (; i < n; i++) {
+		struct tcb *tcp = pid2tcb(wait_batch[i].pid);
+
+		if (!tcp)
+			continue;
+		if (WIFSTOPPED(wait_batch[i].status))
+			tcp->flags &= ~TCB_IGNORE_ONE_SIGSTOP;
+		else
+			droptcb(tcp);
+	}
+}
+
+/* Returns true iff the main trace loop has to continue. */
+static bool
+trace_event(const struct wait_data *wd)
+{
+	int pid = wd->pid;
+	int status = wd->status;
+	bool stopped;
+	unsigned int sig;
+	unsigned int event;
+	struct tcb *tcp;
+
 	if (pid == popen_pid) {
 		if (!WIFSTOPPED(status))
 			popen_pid = 0;
@@ -2252,10 +2864,8 @@ trace(void)
 			return true;
 	}
 
-	if (WIFSTOPPED(status))
-		get_regs(pid);
-	else
-		clear_regs();
+	/* Registers of the tracee are fetched on demand. */
+	clear_regs();
 
 	event = (unsigned int) status >> 16;
 
@@ -2289,8 +2899,8 @@ trace(void)
 	current_tcp = tcp;
 
 	if (cflag) {
-		tv_sub(&tcp->dtime, &ru.ru_stime, &tcp->stime);
-		tcp->stime = ru.ru_stime;
+		tv_sub(&tcp->dtime, &wd->ru.ru_stime, &tcp->stime);
+		tcp->stime = wd->ru.ru_stime;
 	}
 
 	if (WIFSIGNALED(status)) {
@@ -2324,6 +2934,14 @@ trace(void)
 
 	sig = WSTOPSIG(status);
 
+	if (event == PTRACE_EVENT_SECCOMP && seccomp_filtering) {
+		/*
+		 * With -n, the seccomp stop is reported instead of
+		 * syscall-enter-stop: the tracee was resumed with PTRACE_CONT.
+		 */
+		goto trace_syscall_stop;
+	}
+
 	if (event != 0) {
 		/* Ptrace event */
 #if USE_SEIZE
@@ -2396,6 +3014,7 @@ show_stopsig:
 		goto restart_tracee;
 	}
 
+trace_syscall_stop:
 	/* We handled quick cases, we are permitted to interrupt now. */
 	if (interrupted)
 		return false;
@@ -2423,7 +3042,12 @@ restart_tracee_with_sig_0:
 	sig = 0;
 
 restart_tracee:
-	if (ptrace_restart(PTRACE_SYSCALL, tcp, sig) < 0) {
+	/*
+	 * With -n, syscall-enter-stops are replaced by seccomp stops,
+	 * so PTRACE_SYSCALL is needed only to catch the syscall exit.
+	 */
+	if (ptrace_restart(seccomp_filtering && entering(tcp)
+			   ? PTRACE_CONT : PTRACE_SYSCALL, tcp, sig) < 0) {
 		/* Note: ptrace_restart emitted error message */
 		exit_code = 1;
 		return false;
@@ -2432,19 +3056,106 @@ restart_tracee:
 	return true;
 }
 
+static bool
+trace(void)
+{
+	int n, i;
+
+	if (interrupted)
+		return false;
+
+	if (report_pending) {
+		report_pending = 0;
+		sync_output();
+		count_report(shared_log);
+	}
+
+	/*
+	 * Used to exit simply when nprocs hits zero, but in this testcase:
+	 *  int main() { _exit(!!fork()); }
+	 * under strace -f, parent sometimes (rarely) manages
+	 * to exit before we see the first stop of the child,
+	 * and we are losing track of it:
+	 *  19923 clone(...) = 19924
+	 *  19923 exit_group(1)     = ?
+	 *  19923 +++ exited with 1 +++
+	 * Exiting only when wait() returns ECHILD works better.
+	 */
+	if (popen_pid != 0) {
+		/* However, if -o|logger is in use, we can't do that.
+		 * Can work around that by double-forking the logger,
+		 * but that loses the ability to wait for its completion
+		 * on exit. Oh well...
+		 */
+		if (nprocs == 0)
+			return false;
+	}
+
+	n = wait_for_tracees();
+	if (n < 0)
+		return false;
+
+	/*
+	 * Handle all reaped stops before waiting again.  Every stopped
+	 * tracee is restarted once per round, so tracees that stop often
+	 * cannot starve the others.
+	 */
+	for (i = 0; i < n; i++) {
+		if (!trace_event(&wait_batch[i])) {
+			drop_wait_batch(i + 1, n);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 int
 main(int argc, char *argv[])
 {
 	init(argc, argv);
 
-	exit_code = !nprocs;
+	if (loadfname) {
+		exit_code = load_workers > 1 ? load_parallel() :
+			s_binary_load(loadfname, 0, 1);
+		drop_loaded_tcbs();
+	} else {
+		exit_code = !nprocs;
 
-	while (trace())
-		;
+		while (trace())
+			;
+	}
+
+	if (debug_flag)
+		error_msg("%lu wait events in %lu wakeups, at most %u per wakeup",
+			  wait_events, wait_wakeups, wait_events_max);
+	if (debug_flag)
+		error_msg("%lu tracee memory cache hits, %lu misses, "
+			  "%lu buffers gathered in %lu reads",
+			  umove_cache_hits, umove_cache_misses,
+			  umove_gather_bufs, umove_gather_reads);
+	if (debug_flag && (show_fd_path || tracing_paths))
+		error_msg("%lu descriptor table hits, %lu misses",
+			  fdtable_hits, fdtable_misses);
+	if (debug_flag && show_fd_path > 1)
+		print_sockaddr_cache_stats();
+#ifdef USE_LIBUNWIND
+	if (debug_flag && stack_trace_enabled)
+		error_msg("%lu memory map cache updates, %lu rebuilds, "
+			  "%lu symbol cache hits, %lu misses, "
+			  "%lu frame pointer walks, %lu fallbacks",
+			  unwind_cache_updates, unwind_cache_rebuilds,
+			  unwind_symbol_hits, unwind_symbol_misses,
+			  unwind_fp_walks, unwind_fp_fallbacks);
+#endif
+	if (debug_flag)
+		error_msg("%lu syscall tree allocations, %lu arena chunks "
+			  "allocated, %lu arenas reused",
+			  s_arena_allocs, s_arena_chunks, s_arena_reuses);
 
 	cleanup();
 	fflush(NULL);
-	if (shared_log != stderr)
+	if (shared_log != stderr && shared_log != stdout)
 		fclose(shared_log);
 	if (popen_pid) {
 		while (waitpid(popen_pid, NULL, 0) < 0 && errno == EINTR)
@@ -162,10 +162,8 @@ s_insert_addr_type(const char *name, unsigned long value, enum s_type type,
 		break;
 	}
 
-	if (ret < 0) {
-		s_arg_free(addr->val);
+	if (ret < 0)
 		addr->val = NULL;
-	}
 
 	return ret;
 }
@@ -242,6 +240,10 @@ s_array_fetch_wrapper(struct s_arg *arg, unsigned long addr, void *fn_data)
 	const unsigned long abbrev_end =
 		(abbrev(current_tcp) && max_strlen < args->nmemb) ?
 			addr + args->memb_size * max_strlen : end_addr;
+	const unsigned long fetch_end =
+		abbrev_end < end_addr ? abbrev_end + args->memb_size : end_addr;
+	struct umove_array arr = {};
+	const void *elem;
 	void *buf = NULL;
 	void *outbuf = args->buf;
 	ssize_t res = 0;
@@ -263,8 +265,13 @@ s_array_fetch_wrapper(struct s_arg *arg, unsigned long addr, void *fn_data)
 	}
 
 	for (cur = addr; cur < end_addr; cur += args->memb_size) {
-		if (s_umoven_verbose(current_tcp, cur, args->memb_size, outbuf))
-		{
+		/* Elements after the first one are fetched at once. */
+		if (cur != addr &&
+		    (elem = umove_array_elem(current_tcp, &arr, cur, fetch_end,
+					     args->memb_size))) {
+			memcpy(outbuf, elem, args->memb_size);
+		} else if (s_umoven_verbose(current_tcp, cur, args->memb_size,
+					    outbuf)) {
 			if (!res)
 				res = -1;
 
@@ -311,6 +318,7 @@ s_array_fetch_wrapper(struct s_arg *arg, unsigned long addr, void *fn_data)
 		res += args->memb_size;
 	}
 
+	umove_array_free(&arr);
 	free(buf);
 
 	return res;
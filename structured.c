@@ -15,12 +15,14 @@
 #include "structured_fmt_text.h"
 #include "structured_fmt_text_z.h"
 #include "structured_fmt_json.h"
+#include "structured_fmt_binary.h"
 
 /** List of printers used. */
 struct s_printer *s_printers[] = {
 	&s_printer_text,
 	&s_printer_text_z,
 	&s_printer_json,
+	&s_printer_binary,
 	NULL
 };
 
@@ -81,11 +83,145 @@ s_type_to_arg(void *p, enum s_type type)
 }
 
 
+/*
+ * Memory of a syscall tree.
+ *
+ * Everything referenced by a syscall tree is bump-allocated from chunks
+ * of the arena of the syscall, and the whole tree is freed at once by
+ * resetting the arena.  A reset arena is kept by the tcb for its next
+ * syscall, so building a tree usually does not call malloc at all.
+ */
+struct s_arena_chunk {
+	struct s_arena_chunk *next;
+	size_t size;
+	char data[] ATTRIBUTE_ALIGNED(16);
+};
+
+struct s_arena {
+	/* The chunk being filled, earlier ones follow it */
+	struct s_arena_chunk *chunks;
+	char *pos;
+	char *end;
+};
+
+#define S_ARENA_CHUNK_SIZE	8192
+/* Larger allocations get a chunk of their own */
+#define S_ARENA_MAX_SMALL	(S_ARENA_CHUNK_SIZE / 4)
+
+unsigned long s_arena_allocs;
+unsigned long s_arena_chunks;
+unsigned long s_arena_reuses;
+
+static struct s_arena_chunk *
+s_arena_chunk_new(size_t size)
+{
+	struct s_arena_chunk *c = xmalloc(sizeof(*c) + size);
+
+	c->size = size;
+	s_arena_chunks++;
+
+	return c;
+}
+
+static void *
+s_arena_alloc(struct s_arena *arena, size_t size)
+{
+	struct s_arena_chunk *c;
+	void *p;
+
+	size = (size + 15) & ~(size_t) 15;
+	s_arena_allocs++;
+
+	if (size <= (size_t) (arena->end - arena->pos)) {
+		p = arena->pos;
+		arena->pos += size;
+		return p;
+	}
+
+	if (size > S_ARENA_MAX_SMALL) {
+		/* Keep filling the current chunk */
+		c = s_arena_chunk_new(size);
+		if (arena->chunks) {
+			c->next = arena->chunks->next;
+			arena->chunks->next = c;
+		} else {
+			c->next = NULL;
+			arena->chunks = c;
+			arena->pos = arena->end = c->data + size;
+		}
+		return c->data;
+	}
+
+	c = s_arena_chunk_new(S_ARENA_CHUNK_SIZE);
+	c->next = arena->chunks;
+	arena->chunks = c;
+	arena->pos = c->data + size;
+	arena->end = c->data + S_ARENA_CHUNK_SIZE;
+
+	return c->data;
+}
+
+static void *
+s_arena_zalloc(struct s_arena *arena, size_t size)
+{
+	return memset(s_arena_alloc(arena, size), 0, size);
+}
+
+static char *
+s_arena_strndup(struct s_arena *arena, const char *str, size_t len)
+{
+	char *p;
+
+	len = strnlen(str, len);
+	p = s_arena_alloc(arena, len + 1);
+	memcpy(p, str, len);
+	p[len] = '\0';
+
+	return p;
+}
+
+/* Free all the chunks but one of regular size. */
+static void
+s_arena_reset(struct s_arena *arena)
+{
+	struct s_arena_chunk *c;
+	struct s_arena_chunk *next;
+	struct s_arena_chunk *keep = NULL;
+
+	for (c = arena->chunks; c; c = next) {
+		next = c->next;
+		if (!keep && c->size == S_ARENA_CHUNK_SIZE)
+			keep = c;
+		else
+			free(c);
+	}
+
+	arena->chunks = keep;
+	if (keep) {
+		keep->next = NULL;
+		arena->pos = keep->data;
+		arena->end = keep->data + S_ARENA_CHUNK_SIZE;
+	} else {
+		arena->pos = arena->end = NULL;
+	}
+}
+
+static void
+s_arena_free(struct s_arena *arena)
+{
+	if (!arena)
+		return;
+
+	s_arena_reset(arena);
+	free(arena->chunks);
+	free(arena);
+}
+
 struct s_arg *
 s_arg_new(struct tcb *tcp, enum s_type type, const char *name)
 {
 	struct s_syscall *syscall = tcp->s_syscall;
-	void *p = xcalloc(1, s_type_size(type));
+	void *p = s_arena_zalloc(syscall->arena, s_type_size(type));
 	struct s_arg *arg = s_type_to_arg(p, type);
 
 	arg->syscall = syscall;
@@ -145,57 +281,6 @@ s_arg_insert(struct s_syscall *syscall, struct s_arg *arg, int force_arg)
 	syscall->last_arg_inserted = arg;
 }
 
-void
-s_arg_free(struct s_arg *arg)
-{
-	switch (arg->type) {
-	case S_TYPE_str: {
-		struct s_str *s_p = S_ARG_TO_TYPE(arg, str);
-
-		if (s_p->str)
-			free(s_p->str);
-
-		break;
-	}
-	case S_TYPE_addr: {
-		struct s_addr *p = S_ARG_TO_TYPE(arg, addr);
-
-		if (p->val)
-			s_arg_free(p->val);
-
-		break;
-	}
-	case S_TYPE_struct: {
-		struct s_struct *p = S_ARG_TO_TYPE(arg, struct);
-		struct s_arg *arg;
-		struct s_arg *tmp;
-
-		list_foreach_safe(arg, &p->args.args, entry, tmp)
-			s_arg_free(arg);
-
-		if (p->own)
-			free(p->own_aux_str);
-
-		break;
-	}
-	case S_TYPE_changeable: {
-		struct s_changeable *p = S_ARG_TO_TYPE(arg, changeable);
-
-		if (p->entering)
-			s_arg_free(p->entering);
-		if (p->exiting)
-			s_arg_free(p->exiting);
-
-		break;
-	}
-	default:
-		break;
-	}
-
-	free(s_arg_to_type(arg));
-}
-
-
 struct s_num *
 s_num_new(enum s_type type, const char *name, uint64_t value)
 {
@@ -214,7 +299,7 @@ s_str_new(enum s_type type, const char *name, long addr, long len,
 {
 	struct s_str *res = S_ARG_TO_TYPE(s_arg_new(current_tcp, type, name),
 		str);
-	char *buf = NULL;
+	char *buf;
 	size_t size;
 	unsigned add_flags = 0;
 	int ret;
@@ -229,7 +314,7 @@ s_str_new(enum s_type type, const char *name, long addr, long len,
 	if (!addr)
 		goto s_str_new_fail;
 
-	buf = xmalloc(size + 1);
+	buf = s_arena_alloc(current_tcp->s_syscall->arena, size + 1);
 
 	if (flags & QUOTE_0_TERMINATED) {
 		ret = umovestr(current_tcp, addr, size + 1, buf);
@@ -250,9 +335,7 @@ s_str_new(enum s_type type, const char *name, long addr, long len,
 	return res;
 
 s_str_new_fail:
-	free(buf);
-	s_arg_free(&res->arg);
-
+	/* Released along with the syscall */
 	return NULL;
 }
 
@@ -263,12 +346,15 @@ s_str_val_new(enum s_type type, const char *name, const char *str, long len,
 	struct s_str *res = S_ARG_TO_TYPE(s_arg_new(current_tcp, type, name),
 		str);
 
+	struct s_arena *arena = current_tcp->s_syscall->arena;
+
 	if (len >= 0) {
-		res->str = strndup(str, len + !!(flags & QUOTE_0_TERMINATED));
+		res->str = s_arena_strndup(arena, str,
+			len + !!(flags & QUOTE_0_TERMINATED));
 		res->len = len;
 		res->flags = flags;
 	} else {
-		res->str = strdup(str);
+		res->str = s_arena_strndup(arena, str, strlen(str));
 		res->len = strlen(res->str);
 		res->flags = flags | QUOTE_0_TERMINATED;
 	}
@@ -592,23 +678,20 @@ s_xlat_append(enum s_type type, const char *name, const struct xlat *x,
 struct s_struct *
 s_struct_set_aux_str(struct s_struct *s, const char *aux_str)
 {
-	if (s->own)
-		free(s->own_aux_str);
-
 	s->own = false;
 	s->aux_str = aux_str;
 
 	return s;
 }
 
+/* Takes ownership of AUX_STR, which is moved to the arena of the syscall. */
 struct s_struct *
 s_struct_set_own_aux_str(struct s_struct *s, char *aux_str)
 {
-	if (s->own)
-		free(s->own_aux_str);
-
 	s->own = true;
-	s->own_aux_str = aux_str;
+	s->own_aux_str = s_arena_strndup(s->arg.syscall->arena, aux_str,
+		strlen(aux_str));
+	free(aux_str);
 
 	return s;
 }
@@ -665,10 +748,27 @@ s_syscall_pop_all(struct s_syscall *s)
 struct s_syscall *
 s_syscall_new(struct tcb *tcp, enum s_syscall_type sc_type)
 {
-	struct s_syscall *syscall = xmalloc(sizeof(*syscall));
+	struct s_arena *arena;
+	struct s_syscall *syscall;
+
+	if (tcp->s_syscall) {
+		/*
+		 * The tree is abandoned, but it may still be referenced,
+		 * so it is released along with the new one.
+		 */
+		arena = tcp->s_syscall->arena;
+	} else if (tcp->s_arena) {
+		arena = tcp->s_arena;
+		tcp->s_arena = NULL;
+		s_arena_reuses++;
+	} else {
+		arena = xcalloc(1, sizeof(*arena));
+	}
 
+	syscall = s_arena_zalloc(arena, sizeof(*syscall));
 	tcp->s_syscall = syscall;
 
+	syscall->arena = arena;
 	syscall->tcp = tcp;
 	syscall->type = sc_type;
 	syscall->next_get_idx = syscall->next_ins_idx = 0;
@@ -683,6 +783,13 @@ s_syscall_new(struct tcb *tcp, enum s_syscall_type sc_type)
 	return syscall;
 }
 
+/* Allocates memory released along with the syscall tree. */
+void *
+s_syscall_alloc(struct s_syscall *syscall, size_t size)
+{
+	return s_arena_alloc(syscall->arena, size);
+}
+
 void
 s_last_is_changeable(struct tcb *tcp)
 {
@@ -704,16 +811,25 @@ s_last_is_changeable(struct tcb *tcp)
 void
 s_syscall_free(struct tcb *tcp)
 {
-	struct s_syscall *syscall = tcp->s_syscall;
-	struct s_arg *arg;
-	struct s_arg *tmp;
-
-	list_foreach_safe(arg, &syscall->args.args, entry, tmp) {
-		s_arg_free(arg);
-	}
+	struct s_arena *arena = tcp->s_syscall->arena;
 
-	free(syscall);
 	tcp->s_syscall = NULL;
+
+	s_arena_reset(arena);
+	if (tcp->s_arena)
+		s_arena_free(arena);
+	else
+		tcp->s_arena = arena;
+}
+
+/* Free the syscall tree of TCP along with its spare arena. */
+void
+s_syscall_release(struct tcb *tcp)
+{
+	if (tcp->s_syscall)
+		s_syscall_free(tcp);
+	s_arena_free(tcp->s_arena);
+	tcp->s_arena = NULL;
 }
 
 struct s_arg *
@@ -976,6 +1092,7 @@ s_syscall_print_entering(struct tcb *tcp)
 		list_head(&tcp->s_syscall->changeable_args, struct s_arg,
 			chg_entry);
 
+	tflush();
 	if (s_printer_cur->print_entering)
 		s_printer_cur->print_entering(tcp);
 }
@@ -996,6 +1113,9 @@ s_syscall_init_exiting(struct tcb *tcp)
 void
 s_syscall_print_exiting(struct tcb *tcp)
 {
+	/* Done by a formatter thread along with print_after */
+	if (s_pipeline_threads)
+		return;
 	if (s_printer_cur->print_exiting)
 		s_printer_cur->print_exiting(tcp);
 }
@@ -1003,6 +1123,11 @@ s_syscall_print_exiting(struct tcb *tcp)
 void
 s_syscall_print_after(struct tcb *tcp)
 {
+	if (s_pipeline_threads) {
+		s_pipeline_submit(tcp);
+		return;
+	}
+
 	if (s_printer_cur->print_after)
 		s_printer_cur->print_after(tcp);
 
@@ -1045,6 +1170,8 @@ s_syscall_print_signal(struct tcb *tcp, const void *si_void, unsigned sig)
 	const siginfo_t *si = si_void;
 	struct s_syscall *saved_syscall = tcp->s_syscall;
 
+	/* The interrupted syscall has to be kept intact */
+	tcp->s_syscall = NULL;
 	s_syscall_new(tcp, S_SCT_SIGNAL);
 
 	s_insert_signo("signal", sig);
@@ -1062,6 +1189,14 @@ s_syscall_print_signal(struct tcb *tcp, const void *si_void, unsigned sig)
 	tcp->s_syscall = saved_syscall;
 }
 
+void
+s_syscall_print_stack(struct tcb *tcp, unsigned long id,
+	const struct stack_frame *frames, unsigned int nframes)
+{
+	if (s_printer_cur->print_stack)
+		s_printer_cur->print_stack(tcp, id, frames, nframes);
+}
+
 void
 s_print_message(struct tcb *tcp, enum s_msg_type type, const char *msg, ...)
 {
@@ -1072,3 +1207,10 @@ s_print_message(struct tcb *tcp, enum s_msg_type type, const char *msg, ...)
 		s_printer_cur->print_message(tcp, type, msg, args);
 	va_end(args);
 }
+
+void
+s_printer_release(struct tcb *tcp)
+{
+	if (s_printer_cur->release)
+		s_printer_cur->release(tcp);
+}
@@ -271,8 +271,12 @@ struct s_args_list {
 	struct list_item entry;
 };
 
+struct s_arena;
+
 struct s_syscall {
 	struct tcb *tcp;
+	/* Memory of the syscall and all its arguments */
+	struct s_arena *arena;
 	int arg_idx[MAX_ARGS + 1];
 	int next_get_idx;
 	int next_ins_idx;
@@ -359,6 +363,18 @@ struct s_changeable {
 	struct s_arg *exiting;
 };
 
+/* A frame of a stack trace printed by -k */
+struct stack_frame {
+	const char *binary_filename;
+	/* NULL if not looked up (-kk) */
+	const char *symbol_name;
+	unsigned long function_offset;
+	/* The offset in the file, or the address with an error */
+	unsigned long true_offset;
+	/* The reason the frame could not be unwound */
+	const char *error;
+};
+
 struct s_printer {
 	const char *name;
 	void (*print_unfinished)(struct tcb *tcp);
@@ -375,6 +391,19 @@ struct s_printer {
 	void (*print_signal)(struct tcb *tcp);
 	void (*print_message)(struct tcb *tcp, enum s_msg_type type,
 		const char *msg, va_list args);
+	/*
+	 * Prints the stack trace (-k) as a part of the syscall record.
+	 * ID is the number of the trace in the stack table (-K) or 0,
+	 * FRAMES is NULL if the trace has been printed to the output
+	 * already.  Without this callback the trace is printed as text lines
+	 * following the record.
+	 */
+	void (*print_stack)(struct tcb *tcp, unsigned long id,
+		const struct stack_frame *frames, unsigned int nframes);
+	/* Handles an option given as -j name,option; false if unknown */
+	bool (*set_option)(const char *option);
+	/* The tcb is dropped, its -ff output file is about to be closed */
+	void (*release)(struct tcb *tcp);
 };
 
 extern struct s_printer *s_printer_cur;
@@ -410,7 +439,6 @@ extern void *s_arg_to_type(struct s_arg *arg);
 
 extern struct s_arg *s_arg_new(struct tcb *tcp, enum s_type type,
 	const char *name);
-extern void s_arg_free(struct s_arg *arg);
 extern void s_arg_insert(struct s_syscall *syscall, struct s_arg *arg,
 	int force_arg);
 
@@ -465,8 +493,10 @@ extern struct s_args_list *s_syscall_pop_all(struct s_syscall *s);
 
 extern struct s_syscall *s_syscall_new(struct tcb *tcp,
 	enum s_syscall_type sc_type);
+extern void *s_syscall_alloc(struct s_syscall *syscall, size_t size);
 extern void s_last_is_changeable(struct tcb *tcp);
 extern void s_syscall_free(struct tcb *tcp);
+extern void s_syscall_release(struct tcb *tcp);
 
 extern struct s_arg *s_syscall_get_last_arg(struct s_syscall *syscall);
 extern struct s_arg *s_syscall_pop_last_arg(struct s_syscall *syscall);
@@ -498,7 +528,24 @@ extern void s_syscall_print_unavailable_entering(struct tcb *tcp,
 extern void s_syscall_print_unavailable_exiting(struct tcb *tcp);
 extern void s_syscall_print_signal(struct tcb *tcp, const void *si,
 	unsigned sig);
+extern void s_syscall_print_stack(struct tcb *tcp, unsigned long id,
+	const struct stack_frame *frames, unsigned int nframes);
 extern void s_print_message(struct tcb *tcp, enum s_msg_type type,
 	const char *msg, ...);
+extern void s_printer_release(struct tcb *tcp);
+
+extern unsigned long s_arena_allocs;
+extern unsigned long s_arena_chunks;
+extern unsigned long s_arena_reuses;
+
+extern unsigned s_pipeline_threads;
+
+extern void s_pipeline_init(void);
+extern int s_pipeline_vprintf(FILE *outf, const char *fmt, va_list args);
+extern int s_pipeline_puts(FILE *outf, const char *str);
+extern void s_pipeline_flush(void);
+extern void s_pipeline_submit(struct tcb *tcp);
+extern void s_pipeline_sync(void);
+extern void s_pipeline_finish(void);
 
 #endif /* #ifndef STRACE_STRUCTURED_H */
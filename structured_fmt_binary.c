@@ -0,0 +1,1686 @@
+/*
+ * Compact binary formatter (-j binary) and printing of its output
+ * with the other formatters (-L).
+ *
+ * The output is a sequence of records
+ *
+ *	'\0' TYPE LENGTH PAYLOAD
+ *
+ * LENGTH and the integers of PAYLOAD are LEB128 varints, signed ones are
+ * zigzag-encoded, byte strings are prefixed with their length.  Names
+ * (argument names, comments, syscall names, xlat strings) are written once
+ * per output file as S_BIN_STRING records and referred to by their number
+ * afterwards, xlat tables are written once as S_BIN_XLAT records the same
+ * way.  Reference 0 is NULL, reference N is the N-th definition following
+ * the last S_BIN_HEADER, so concatenated files can be read as well.
+ *
+ * There is a record per formatter call, and printing the records replays
+ * the calls made while tracing.  Text printed by the core itself (the
+ * newline ending a syscall, -e read/write dumps) never contains NUL bytes
+ * and is left in between the records as is.
+ *
+ * With -j binary,raw syscalls are recorded undecoded: S_BIN_RAW_ENTERING
+ * and S_BIN_RAW_EXITING hold the syscall number, arguments and result,
+ * S_BIN_MEM records hold every read of the tracee memory made by the
+ * decoders, in the order they are made.  The decoders are run again on
+ * these when the records are printed, so the arguments are formatted
+ * then instead of while tracing.  Raw records are only meant to be read
+ * by the strace binary that has written them.
+ */
+
+#include "defs.h"
+
+#include <limits.h>
+
+#include "structured.h"
+#include "structured_sigmask.h"
+#include "structured_fmt_binary.h"
+
+#define S_BIN_MAGIC "strace"
+#define S_BIN_VERSION 1
+
+#define S_TYPE_MASK (S_TYPE_SIZE_MASK | S_TYPE_SIGN_MASK | S_TYPE_FMT_MASK | \
+	S_TYPE_KIND_MASK)
+
+enum s_bin_record {
+	S_BIN_HEADER,
+	S_BIN_STRING,
+	S_BIN_XLAT,
+	S_BIN_LEADER,
+	S_BIN_BEFORE,
+	S_BIN_ENTERING,
+	S_BIN_EXITING,
+	S_BIN_AFTER,
+	S_BIN_RESUMED,
+	S_BIN_TV,
+	S_BIN_UNAVAILABLE_ENTERING,
+	S_BIN_UNAVAILABLE_EXITING,
+	S_BIN_SIGNAL,
+	S_BIN_MESSAGE,
+	S_BIN_RELEASE,
+	S_BIN_MEM,
+	S_BIN_RAW_ENTERING,
+	S_BIN_RAW_EXITING,
+};
+
+bool record_raw;
+bool replay_raw;
+
+struct s_bin_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void
+s_bin_reserve(struct s_bin_buf *b, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = xreallocarray(b->data, b->size, 1);
+	}
+}
+
+static void
+s_bin_put(struct s_bin_buf *b, const void *data, size_t len)
+{
+	s_bin_reserve(b, len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void
+s_bin_put_u(struct s_bin_buf *b, uint64_t val)
+{
+	s_bin_reserve(b, 10);
+
+	while (val >= 0x80) {
+		b->data[b->len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	b->data[b->len++] = val;
+}
+
+static void
+s_bin_put_s(struct s_bin_buf *b, int64_t val)
+{
+	s_bin_put_u(b, val < 0 ? ~((uint64_t) val << 1) : (uint64_t) val << 1);
+}
+
+static void
+s_bin_put_blob(struct s_bin_buf *b, const void *data, size_t len)
+{
+	s_bin_put_u(b, len);
+	s_bin_put(b, data, len);
+}
+
+static void
+s_bin_put_record(struct s_bin_buf *b, enum s_bin_record type,
+	const void *payload, size_t len)
+{
+	const char head[] = { '\0', type };
+
+	s_bin_put(b, head, sizeof(head));
+	s_bin_put_blob(b, payload, len);
+}
+
+
+/* formatter */
+
+struct s_bin_entry {
+	const void *key;
+	unsigned id;
+};
+
+/* Open addressing hash of the definitions written so far */
+struct s_bin_table {
+	struct s_bin_entry *entries;
+	unsigned size;
+	unsigned count;
+};
+
+struct s_bin_output {
+	FILE *fp;
+	struct s_bin_output *next;
+	/* Keys are copies of the strings */
+	struct s_bin_table strings;
+	/* Keys are the xlat tables themselves */
+	struct s_bin_table xlats;
+};
+
+static struct s_bin_output *outputs;
+/* Output of the record being built */
+static struct s_bin_output *output;
+/* Payload of the record being built */
+static struct s_bin_buf rec;
+/* Definitions the record refers to, followed by the record itself */
+static struct s_bin_buf out;
+/* Payload of a definition being built */
+static struct s_bin_buf def;
+
+static uint32_t
+s_bin_hash(const void *key, bool is_str)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261U;
+
+	if (!is_str)
+		return ((uintptr_t) key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for (p = key; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	return h;
+}
+
+static void
+s_bin_table_grow(struct s_bin_table *t, bool is_str)
+{
+	struct s_bin_entry *old = t->entries;
+	unsigned old_size = t->size;
+	unsigned i;
+	unsigned j;
+
+	t->size = old_size ? old_size * 2 : 64;
+	t->entries = xcalloc(t->size, sizeof(*t->entries));
+
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].key)
+			continue;
+
+		j = s_bin_hash(old[i].key, is_str) & (t->size - 1);
+		while (t->entries[j].key)
+			j = (j + 1) & (t->size - 1);
+		t->entries[j] = old[i];
+	}
+
+	free(old);
+}
+
+/* Returns the entry of KEY, or the empty one to be filled in. */
+static struct s_bin_entry *
+s_bin_table_lookup(struct s_bin_table *t, const void *key, bool is_str)
+{
+	unsigned i;
+
+	if (t->count * 2 >= t->size)
+		s_bin_table_grow(t, is_str);
+
+	for (i = s_bin_hash(key, is_str) & (t->size - 1); t->entries[i].key;
+	     i = (i + 1) & (t->size - 1)) {
+		if (is_str ? !strcmp(t->entries[i].key, key) :
+		    t->entries[i].key == key)
+			break;
+	}
+
+	return &t->entries[i];
+}
+
+/* Returns the reference to STR, defining it first if needed. */
+static uint64_t
+s_bin_string(const char *str)
+{
+	struct s_bin_table *t = &output->strings;
+	struct s_bin_entry *e;
+
+	if (!str)
+		return 0;
+
+	e = s_bin_table_lookup(t, str, true);
+	if (!e->key) {
+		e->key = xstrdup(str);
+		e->id = t->count++;
+		s_bin_put_record(&out, S_BIN_STRING, str, strlen(str));
+	}
+
+	return e->id + 1;
+}
+
+/* Returns the reference to X, defining it first if needed. */
+static uint64_t
+s_bin_xlat(const struct xlat *x)
+{
+	struct s_bin_table *t = &output->xlats;
+	struct s_bin_entry *e;
+	const struct xlat *p;
+
+	if (!x)
+		return 0;
+
+	e = s_bin_table_lookup(t, x, false);
+	if (!e->key) {
+		e->key = x;
+		e->id = t->count++;
+
+		for (p = x; p->str; p++)
+			;
+		def.len = 0;
+		s_bin_put_u(&def, p - x);
+		for (p = x; p->str; p++) {
+			s_bin_put_u(&def, p->val);
+			s_bin_put_u(&def, s_bin_string(p->str));
+		}
+		s_bin_put_record(&out, S_BIN_XLAT, def.data, def.len);
+	}
+
+	return e->id + 1;
+}
+
+static struct s_bin_output *
+s_bin_output_get(FILE *fp)
+{
+	struct s_bin_output *o;
+
+	for (o = outputs; o; o = o->next) {
+		if (o->fp == fp)
+			return o;
+	}
+
+	o = xcalloc(1, sizeof(*o));
+	o->fp = fp;
+	o->next = outputs;
+	outputs = o;
+
+	def.len = 0;
+	s_bin_put(&def, S_BIN_MAGIC, sizeof(S_BIN_MAGIC) - 1);
+	s_bin_put_u(&def, S_BIN_VERSION);
+	s_bin_put_record(&out, S_BIN_HEADER, def.data, def.len);
+
+	return o;
+}
+
+static void
+s_bin_output_free(FILE *fp)
+{
+	struct s_bin_output **link;
+	struct s_bin_output *o;
+	unsigned i;
+
+	for (link = &outputs; *link; link = &(*link)->next) {
+		if ((*link)->fp == fp)
+			break;
+	}
+	if (!*link)
+		return;
+
+	o = *link;
+	*link = o->next;
+	if (output == o)
+		output = NULL;
+
+	for (i = 0; i < o->strings.size; i++)
+		free((void *) o->strings.entries[i].key);
+	free(o->strings.entries);
+	free(o->xlats.entries);
+	free(o);
+}
+
+static void
+s_bin_begin(struct tcb *tcp)
+{
+	if (!output || output->fp != tcp->outf)
+		output = s_bin_output_get(tcp->outf);
+
+	rec.len = 0;
+	s_bin_put_u(&rec, tcp->pid);
+}
+
+static void
+s_bin_end(struct tcb *tcp, enum s_bin_record type)
+{
+	s_bin_put_record(&out, type, rec.data, rec.len);
+	twrite(tcp, out.data, out.len);
+	out.len = 0;
+}
+
+static void
+s_bin_put_tv(const struct timeval *tv)
+{
+	s_bin_put_s(&rec, tv->tv_sec);
+	s_bin_put_u(&rec, tv->tv_usec);
+}
+
+static void s_bin_put_arg(struct s_arg *arg);
+
+static void
+s_bin_put_args(struct s_args_list *list)
+{
+	struct s_arg *arg;
+	uint64_t count = 0;
+
+	list_foreach(arg, &list->args, entry)
+		count++;
+
+	s_bin_put_u(&rec, count);
+	list_foreach(arg, &list->args, entry)
+		s_bin_put_arg(arg);
+}
+
+static void
+s_bin_put_arg_head(struct s_arg *arg)
+{
+	s_bin_put_u(&rec, arg->type);
+	s_bin_put_u(&rec, s_bin_string(arg->name));
+	s_bin_put_u(&rec, s_bin_string(arg->comment));
+	s_bin_put_s(&rec, arg->arg_num);
+}
+
+static void
+s_bin_put_xlat(struct s_xlat *x)
+{
+	s_bin_put_u(&rec, s_bin_xlat(x->x));
+	s_bin_put_u(&rec, x->val);
+	s_bin_put_u(&rec, s_bin_string(x->dflt));
+	s_bin_put_u(&rec, x->flags | (x->empty << 1));
+	s_bin_put_s(&rec, x->scale);
+}
+
+static void
+s_bin_put_arg(struct s_arg *arg)
+{
+	s_bin_put_arg_head(arg);
+
+	switch (S_TYPE_KIND(arg->type)) {
+	case S_TYPE_KIND_num:
+		s_bin_put_u(&rec, S_ARG_TO_TYPE(arg, num)->val);
+		break;
+
+	case S_TYPE_KIND_str: {
+		struct s_str *p = S_ARG_TO_TYPE(arg, str);
+
+		s_bin_put_u(&rec, !!p->str);
+		if (!p->str)
+			break;
+
+		s_bin_put_s(&rec, p->len);
+		s_bin_put_u(&rec, p->flags);
+		/* The byte following LEN tells whether the string is cut */
+		s_bin_put_blob(&rec, p->str, p->flags & QUOTE_0_TERMINATED ?
+			strnlen(p->str, p->len + 1) : (size_t) p->len);
+		break;
+	}
+
+	case S_TYPE_KIND_addr: {
+		struct s_addr *p = S_ARG_TO_TYPE(arg, addr);
+
+		s_bin_put_u(&rec, p->addr);
+		s_bin_put_u(&rec, !!p->val);
+		if (p->val)
+			s_bin_put_arg(p->val);
+		break;
+	}
+
+	case S_TYPE_KIND_xlat: {
+		struct s_xlat *first = S_ARG_TO_TYPE(arg, xlat);
+		struct s_xlat *cur = first;
+		uint64_t count = 0;
+
+		do {
+			count++;
+			cur = list_next(cur, entry);
+		} while (cur != first);
+
+		s_bin_put_u(&rec, count);
+		s_bin_put_xlat(first);
+		for (cur = list_next(first, entry); cur != first;
+		     cur = list_next(cur, entry)) {
+			s_bin_put_arg_head(&cur->arg);
+			s_bin_put_xlat(cur);
+		}
+		break;
+	}
+
+	case S_TYPE_KIND_sigmask: {
+		struct s_sigmask *p = S_ARG_TO_TYPE(arg, sigmask);
+
+		s_bin_put_blob(&rec, p->sigmask, p->bytes);
+		break;
+	}
+
+	case S_TYPE_KIND_struct: {
+		struct s_struct *p = S_ARG_TO_TYPE(arg, struct);
+
+		s_bin_put_u(&rec, !!p->aux_str);
+		if (p->aux_str)
+			s_bin_put_blob(&rec, p->aux_str, strlen(p->aux_str));
+		s_bin_put_args(&p->args);
+		break;
+	}
+
+	case S_TYPE_KIND_changeable: {
+		struct s_changeable *p = S_ARG_TO_TYPE(arg, changeable);
+
+		s_bin_put_u(&rec, (p->entering ? 1 : 0) | (p->exiting ? 2 : 0));
+		if (p->entering)
+			s_bin_put_arg(p->entering);
+		if (p->exiting)
+			s_bin_put_arg(p->exiting);
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+static void
+s_syscall_binary_print_leader(struct tcb *tcp, struct timeval *tv,
+	struct timeval *dtv)
+{
+	struct timeval now;
+
+	/* Time stamps are recorded regardless of -t */
+	if (loaded_tv)
+		now = *loaded_tv;
+	else if (tflag)
+		now = *tv;
+	else
+		gettimeofday(&now, NULL);
+
+	s_bin_begin(tcp);
+	s_bin_put_tv(&now);
+	s_bin_end(tcp, S_BIN_LEADER);
+}
+
+static void
+s_syscall_binary_print_before(struct tcb *tcp)
+{
+	if (record_raw)
+		return;
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, s_bin_string(tcp->s_ent->sys_name));
+	s_bin_end(tcp, S_BIN_BEFORE);
+}
+
+static void
+s_syscall_binary_print_entering(struct tcb *tcp)
+{
+	unsigned i;
+
+	if (!record_raw) {
+		s_bin_begin(tcp);
+		s_bin_end(tcp, S_BIN_ENTERING);
+		return;
+	}
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, current_personality);
+	s_bin_put_u(&rec, tcp->scno);
+	s_bin_put_u(&rec, tcp->qual_flg);
+	s_bin_put_u(&rec, MAX_ARGS);
+	for (i = 0; i < MAX_ARGS; i++) {
+		s_bin_put_u(&rec, (unsigned long) tcp->u_arg[i]);
+#if HAVE_STRUCT_TCB_EXT_ARG
+		s_bin_put_u(&rec, tcp->ext_arg[i]);
+#endif
+	}
+	s_bin_end(tcp, S_BIN_RAW_ENTERING);
+}
+
+static void
+s_syscall_binary_print_exiting(struct tcb *tcp)
+{
+	struct s_syscall *syscall = tcp->s_syscall;
+
+	if (record_raw)
+		return;
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, current_personality);
+	s_bin_put_u(&rec, syscall->name_level);
+	s_bin_put_u(&rec, syscall->comment_level);
+	s_bin_put_args(&syscall->args);
+	s_bin_end(tcp, S_BIN_EXITING);
+}
+
+static void
+s_syscall_binary_print_after(struct tcb *tcp)
+{
+	bool auxstr = (tcp->sys_res & RVAL_STR) && tcp->auxstr;
+	struct timeval now;
+
+	if (record_raw) {
+		/* In case the syscall is resumed while printing only */
+		gettimeofday(&now, NULL);
+
+		s_bin_begin(tcp);
+		s_bin_put_u(&rec, current_personality);
+		s_bin_put_s(&rec, tcp->u_error);
+		s_bin_put_u(&rec, (unsigned long) tcp->u_rval);
+#if HAVE_STRUCT_TCB_EXT_ARG
+		s_bin_put_u(&rec, tcp->u_lrval);
+#else
+		s_bin_put_u(&rec, 0);
+#endif
+		s_bin_put_tv(&now);
+		s_bin_end(tcp, S_BIN_RAW_EXITING);
+		return;
+	}
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, current_personality);
+	s_bin_put_s(&rec, tcp->u_error);
+	s_bin_put_u(&rec, tcp->sys_res);
+	s_bin_put_u(&rec, (unsigned long) tcp->u_rval);
+#if HAVE_STRUCT_TCB_EXT_ARG
+	s_bin_put_u(&rec, tcp->u_lrval);
+#else
+	s_bin_put_u(&rec, 0);
+#endif
+	s_bin_put_u(&rec, auxstr);
+	if (auxstr)
+		s_bin_put_blob(&rec, tcp->auxstr, strlen(tcp->auxstr));
+	s_bin_put_u(&rec, !!(tcp->qual_flg & QUAL_RAW));
+	s_bin_end(tcp, S_BIN_AFTER);
+}
+
+static void
+s_syscall_binary_print_resumed(struct tcb *tcp)
+{
+	if (record_raw)
+		return;
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, s_bin_string(tcp->s_ent->sys_name));
+	s_bin_end(tcp, S_BIN_RESUMED);
+}
+
+static void
+s_syscall_binary_print_tv(struct tcb *tcp, struct timeval *tv)
+{
+	s_bin_begin(tcp);
+	s_bin_put_tv(tv);
+	s_bin_end(tcp, S_BIN_TV);
+}
+
+static void
+s_syscall_binary_print_unavailable_entering(struct tcb *tcp, int scno_good)
+{
+	s_bin_begin(tcp);
+	s_bin_put_s(&rec, scno_good);
+	s_bin_put_u(&rec, scno_good == 1 ?
+		s_bin_string(tcp->s_ent->sys_name) : 0);
+	s_bin_end(tcp, S_BIN_UNAVAILABLE_ENTERING);
+}
+
+/*
+ * The calls below end lines the way the text formatter does, so that
+ * the syscalls to be resumed are recorded as they are printed.
+ */
+
+static void
+s_syscall_binary_print_unavailable_exiting(struct tcb *tcp)
+{
+	s_bin_begin(tcp);
+	s_bin_end(tcp, S_BIN_UNAVAILABLE_EXITING);
+	line_ended();
+}
+
+static void
+s_syscall_binary_print_signal(struct tcb *tcp)
+{
+	s_bin_begin(tcp);
+	s_bin_put_args(&tcp->s_syscall->args);
+	s_bin_end(tcp, S_BIN_SIGNAL);
+	line_ended();
+}
+
+static void
+s_binary_print_message(struct tcb *tcp, enum s_msg_type type, const char *msg,
+	va_list args)
+{
+	char *text;
+	int len;
+
+	printleader(tcp);
+
+	len = vasprintf(&text, msg, args);
+	if (len < 0)
+		die_out_of_memory();
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, type);
+	s_bin_put_blob(&rec, text, len);
+	s_bin_end(tcp, S_BIN_MESSAGE);
+
+	free(text);
+	line_ended();
+}
+
+static bool
+s_binary_set_option(const char *option)
+{
+	if (strcmp(option, "raw"))
+		return false;
+
+	record_raw = true;
+	return true;
+}
+
+static void
+s_binary_release(struct tcb *tcp)
+{
+	if (!tcp->outf)
+		return;
+
+	s_bin_begin(tcp);
+	s_bin_end(tcp, S_BIN_RELEASE);
+
+	/* A new file may get the same FILE pointer */
+	if (followfork >= 2)
+		s_bin_output_free(tcp->outf);
+}
+
+struct s_printer s_printer_binary = {
+	.name = "binary",
+	.print_leader = s_syscall_binary_print_leader,
+	.print_before = s_syscall_binary_print_before,
+	.print_entering = s_syscall_binary_print_entering,
+	.print_exiting = s_syscall_binary_print_exiting,
+	.print_after = s_syscall_binary_print_after,
+	.print_resumed = s_syscall_binary_print_resumed,
+	.print_tv = s_syscall_binary_print_tv,
+	.print_unavailable_entering =
+		s_syscall_binary_print_unavailable_entering,
+	.print_unavailable_exiting = s_syscall_binary_print_unavailable_exiting,
+	.print_signal = s_syscall_binary_print_signal,
+	.print_message = s_binary_print_message,
+	.set_option = s_binary_set_option,
+	.release = s_binary_release,
+};
+
+/*
+ * -j binary,raw: record a read of LEN bytes at ADDR made by the decoders,
+ * RC is what umoven or umovestr (if STR) has returned.
+ */
+void
+record_mem(struct tcb *tcp, long addr, unsigned int len, const void *laddr,
+	int rc, bool str)
+{
+	size_t size = rc < 0 ? 0 : str && rc > 0 ? strnlen(laddr, len) + 1 : len;
+
+	s_bin_begin(tcp);
+	s_bin_put_u(&rec, str);
+	s_bin_put_u(&rec, (unsigned long) addr);
+	s_bin_put_u(&rec, len);
+	s_bin_put_s(&rec, rc);
+	s_bin_put_blob(&rec, laddr, size);
+	s_bin_end(tcp, S_BIN_MEM);
+}
+
+
+/* reader */
+
+struct s_bin_input {
+	const char *fname;
+	FILE *fp;
+	bool header_seen;
+
+	/* Payload of the current record */
+	struct s_bin_buf rec;
+	const unsigned char *pos;
+	const unsigned char *end;
+	bool bad;
+
+	/* Definitions of all the files read */
+	char **strings;
+	struct_sysent **sysents;
+	unsigned nstrings;
+	unsigned strings_size;
+	unsigned string_base;
+	struct xlat **xlats;
+	unsigned nxlats;
+	unsigned xlat_base;
+
+	/* Text printed by the core, pending up to the end of the line */
+	struct s_bin_buf text;
+	/* Printed along with the next record */
+	struct tcb *leader_tcp;
+	struct timeval leader_tv;
+	unsigned long long leader_seq;
+	/* Leaders read so far, of all the pids, for -Q */
+	unsigned long long nleaders;
+	/* The syscall record opened by the last leader, until printed */
+	struct tcb *open_tcp;
+	char *auxstr;
+
+	/* Only the pids equal to WORKER modulo NWORKERS are printed */
+	unsigned worker;
+	unsigned nworkers;
+
+	/* -j binary,raw: recorded reads of the tracee memory */
+	struct s_bin_mem *mem;
+	unsigned nmem;
+	unsigned mem_size;
+	/* Syscall exit to be printed once -e read/write dumps are read */
+	struct tcb *raw_tcp;
+	struct timeval raw_tv;
+	unsigned long long raw_seq;
+	struct timeval raw_duration;
+};
+
+struct s_bin_mem {
+	struct tcb *tcp;
+	unsigned long addr;
+	unsigned int len;
+	int rc;
+	bool str;
+	size_t size;
+	char *data;
+};
+
+/* The input being read, for replay_mem */
+static struct s_bin_input *input;
+
+static const struct_sysent s_bin_unknown_sysent = {
+	.sys_name = "????",
+};
+
+static char *
+s_bin_strndup(const void *str, size_t len)
+{
+	char *res = xmalloc(len + 1);
+
+	memcpy(res, str, len);
+	res[len] = '\0';
+
+	return res;
+}
+
+static uint64_t
+s_bin_get_u(struct s_bin_input *r)
+{
+	uint64_t val = 0;
+	unsigned shift = 0;
+
+	do {
+		if (r->pos >= r->end || shift > 63) {
+			r->bad = true;
+			return 0;
+		}
+		val |= (uint64_t) (*r->pos & 0x7f) << shift;
+		shift += 7;
+	} while (*r->pos++ & 0x80);
+
+	return val;
+}
+
+static int64_t
+s_bin_get_s(struct s_bin_input *r)
+{
+	uint64_t val = s_bin_get_u(r);
+
+	return (val & 1) ? ~(val >> 1) : (val >> 1);
+}
+
+static const void *
+s_bin_get_blob(struct s_bin_input *r, size_t *len)
+{
+	uint64_t n = s_bin_get_u(r);
+	const unsigned char *p = r->pos;
+
+	if (r->bad || n > (uint64_t) (r->end - r->pos)) {
+		r->bad = true;
+		*len = 0;
+		return NULL;
+	}
+
+	r->pos += n;
+	*len = n;
+
+	return p;
+}
+
+/* Messages and auxstr are made by strace itself, so they are plain ASCII */
+static char *
+s_bin_get_text(struct s_bin_input *r)
+{
+	size_t len;
+	size_t i;
+	const unsigned char *p = s_bin_get_blob(r, &len);
+
+	for (i = 0; i < len; i++) {
+		if ((p[i] < ' ' && p[i] != '\t' && p[i] != '\n') ||
+		    p[i] > '~')
+			r->bad = true;
+	}
+	if (r->bad)
+		return NULL;
+
+	return s_bin_strndup(p, len);
+}
+
+static bool
+s_bin_get_ref(struct s_bin_input *r, unsigned count, unsigned *idx)
+{
+	uint64_t ref = s_bin_get_u(r);
+
+	if (!ref)
+		return false;
+	if (ref > count) {
+		r->bad = true;
+		return false;
+	}
+
+	*idx = ref - 1;
+
+	return true;
+}
+
+static const char *
+s_bin_get_string(struct s_bin_input *r)
+{
+	unsigned idx;
+
+	if (!s_bin_get_ref(r, r->nstrings - r->string_base, &idx))
+		return NULL;
+
+	return r->strings[r->string_base + idx];
+}
+
+static const struct_sysent *
+s_bin_get_sysent(struct s_bin_input *r)
+{
+	unsigned idx;
+
+	if (!s_bin_get_ref(r, r->nstrings - r->string_base, &idx))
+		return &s_bin_unknown_sysent;
+
+	idx += r->string_base;
+	if (!r->sysents[idx]) {
+		r->sysents[idx] = xcalloc(1, sizeof(*r->sysents[idx]));
+		r->sysents[idx]->sys_name = r->strings[idx];
+	}
+
+	return r->sysents[idx];
+}
+
+static void
+s_bin_get_tv(struct s_bin_input *r, struct timeval *tv)
+{
+	tv->tv_sec = s_bin_get_s(r);
+	tv->tv_usec = s_bin_get_u(r);
+}
+
+static void
+s_bin_get_personality(struct s_bin_input *r)
+{
+	uint64_t personality = s_bin_get_u(r);
+
+	if (personality >= SUPPORTED_PERSONALITIES)
+		r->bad = true;
+	else if (personality != current_personality)
+		set_personality(personality);
+}
+
+static struct s_arg *s_bin_get_arg(struct s_bin_input *r, struct tcb *tcp);
+
+static void
+s_bin_get_args(struct s_bin_input *r, struct tcb *tcp,
+	struct s_args_list *list)
+{
+	uint64_t count = s_bin_get_u(r);
+	struct s_arg *arg;
+
+	while (count-- && !r->bad) {
+		arg = s_bin_get_arg(r, tcp);
+		if (arg)
+			list_append(&list->args, &arg->entry);
+	}
+}
+
+static struct s_arg *
+s_bin_get_arg_head(struct s_bin_input *r, struct tcb *tcp)
+{
+	uint64_t type = s_bin_get_u(r);
+	const char *name = s_bin_get_string(r);
+	const char *comment = s_bin_get_string(r);
+	int64_t arg_num = s_bin_get_s(r);
+	struct s_arg *arg;
+
+	if (r->bad || (type & ~(uint64_t) S_TYPE_MASK)) {
+		r->bad = true;
+		return NULL;
+	}
+
+	arg = s_arg_new(tcp, type, name);
+	arg->comment = comment;
+	arg->arg_num = arg_num;
+
+	return arg;
+}
+
+static void
+s_bin_get_xlat(struct s_bin_input *r, struct s_xlat *x)
+{
+	unsigned idx;
+	uint64_t bits;
+
+	if (s_bin_get_ref(r, r->nxlats - r->xlat_base, &idx))
+		x->x = r->xlats[r->xlat_base + idx];
+	x->val = s_bin_get_u(r);
+	x->dflt = s_bin_get_string(r);
+	bits = s_bin_get_u(r);
+	x->flags = bits & 1;
+	x->empty = !!(bits & 2);
+	x->scale = s_bin_get_s(r);
+
+	list_init(&x->entry);
+}
+
+static struct s_arg *
+s_bin_get_arg(struct s_bin_input *r, struct tcb *tcp)
+{
+	struct s_arg *arg = s_bin_get_arg_head(r, tcp);
+	const void *data;
+	size_t len;
+
+	if (!arg)
+		return NULL;
+
+	switch (S_TYPE_KIND(arg->type)) {
+	case S_TYPE_KIND_num:
+		S_ARG_TO_TYPE(arg, num)->val = s_bin_get_u(r);
+		break;
+
+	case S_TYPE_KIND_str: {
+		struct s_str *p = S_ARG_TO_TYPE(arg, str);
+		int64_t size;
+
+		if (!s_bin_get_u(r))
+			break;
+
+		size = s_bin_get_s(r);
+		p->flags = s_bin_get_u(r);
+		data = s_bin_get_blob(r, &len);
+		if (r->bad || size < 0 || len > (uint64_t) size + 1) {
+			r->bad = true;
+			break;
+		}
+
+		p->str = s_syscall_alloc(tcp->s_syscall, size + 2);
+		memcpy(p->str, data, len);
+		memset(p->str + len, 0, size + 2 - len);
+		p->len = size;
+		break;
+	}
+
+	case S_TYPE_KIND_addr: {
+		struct s_addr *p = S_ARG_TO_TYPE(arg, addr);
+
+		p->addr = s_bin_get_u(r);
+		if (s_bin_get_u(r))
+			p->val = s_bin_get_arg(r, tcp);
+		break;
+	}
+
+	case S_TYPE_KIND_xlat: {
+		struct s_xlat *first = S_ARG_TO_TYPE(arg, xlat);
+		uint64_t count = s_bin_get_u(r);
+
+		if (!count) {
+			r->bad = true;
+			break;
+		}
+
+		s_bin_get_xlat(r, first);
+		while (--count && !r->bad) {
+			struct s_arg *next = s_bin_get_arg_head(r, tcp);
+
+			if (!next || S_TYPE_KIND(next->type) != S_TYPE_KIND_xlat) {
+				r->bad = true;
+				break;
+			}
+
+			s_bin_get_xlat(r, S_ARG_TO_TYPE(next, xlat));
+			list_append(&first->entry,
+				&S_ARG_TO_TYPE(next, xlat)->entry);
+		}
+		break;
+	}
+
+	case S_TYPE_KIND_sigmask: {
+		struct s_sigmask *p = S_ARG_TO_TYPE(arg, sigmask);
+
+		data = s_bin_get_blob(r, &len);
+		if (len > sizeof(p->sigmask)) {
+			r->bad = true;
+			break;
+		}
+
+		memcpy(p->sigmask, data, len);
+		p->bytes = len;
+		break;
+	}
+
+	case S_TYPE_KIND_struct: {
+		struct s_struct *p = S_ARG_TO_TYPE(arg, struct);
+
+		list_init(&p->args.args);
+		if (s_bin_get_u(r)) {
+			data = s_bin_get_blob(r, &len);
+			if (r->bad)
+				break;
+
+			p->own_aux_str = s_syscall_alloc(tcp->s_syscall,
+				len + 1);
+			memcpy(p->own_aux_str, data, len);
+			p->own_aux_str[len] = '\0';
+		}
+		s_bin_get_args(r, tcp, &p->args);
+		break;
+	}
+
+	case S_TYPE_KIND_changeable: {
+		struct s_changeable *p = S_ARG_TO_TYPE(arg, changeable);
+		uint64_t present = s_bin_get_u(r);
+
+		if (present & 1)
+			p->entering = s_bin_get_arg(r, tcp);
+		if (present & 2)
+			p->exiting = s_bin_get_arg(r, tcp);
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return r->bad ? NULL : arg;
+}
+
+static struct s_syscall *
+s_bin_syscall(struct tcb *tcp)
+{
+	return tcp->s_syscall ? tcp->s_syscall :
+		s_syscall_new(tcp, S_SCT_SYSCALL);
+}
+
+static void
+s_bin_flush_leader(struct s_bin_input *r)
+{
+	if (!r->leader_tcp)
+		return;
+
+	loaded_tv = &r->leader_tv;
+	loaded_seq = &r->leader_seq;
+	printleader(r->leader_tcp);
+	loaded_tv = NULL;
+	loaded_seq = NULL;
+	r->open_tcp = r->leader_tcp;
+	r->leader_tcp = NULL;
+}
+
+/* Forgets the reads of TCP among the first COUNT ones. */
+static void
+s_bin_drop_mem(struct s_bin_input *r, struct tcb *tcp, unsigned count)
+{
+	unsigned i;
+	unsigned n = 0;
+
+	for (i = 0; i < r->nmem; i++) {
+		if (i < count && r->mem[i].tcp == tcp)
+			free(r->mem[i].data);
+		else
+			r->mem[n++] = r->mem[i];
+	}
+	r->nmem = n;
+}
+
+/*
+ * Returns what umoven or umovestr (if STR) returned while recording
+ * for the same read, the decoders being run again make the same reads
+ * in the same order.  The reads made for nothing but -P filtering, or
+ * with different -s, are skipped.
+ */
+int
+replay_mem(struct tcb *tcp, long addr, unsigned int len, void *laddr,
+	bool str)
+{
+	struct s_bin_mem *m;
+	unsigned i;
+	int rc;
+
+	if (!input)
+		return -1;
+
+	for (i = 0; i < input->nmem; i++) {
+		m = &input->mem[i];
+		if (m->tcp == tcp && m->addr == (unsigned long) addr &&
+		    m->len == len && m->str == str)
+			break;
+	}
+	if (i == input->nmem)
+		return -1;
+
+	memcpy(laddr, m->data, m->size);
+	rc = m->rc;
+	s_bin_drop_mem(input, tcp, i + 1);
+
+	return rc;
+}
+
+static void
+s_bin_flush_raw(struct s_bin_input *r)
+{
+	struct tcb *tcp = r->raw_tcp;
+
+	if (!tcp)
+		return;
+
+	r->raw_tcp = NULL;
+	current_tcp = tcp;
+	loaded_tv = &r->raw_tv;
+	loaded_seq = &r->raw_seq;
+	replay_syscall_exiting(tcp, &r->raw_duration);
+	loaded_tv = NULL;
+	loaded_seq = NULL;
+	r->open_tcp = NULL;
+	s_bin_drop_mem(r, tcp, r->nmem);
+}
+
+static void
+s_bin_flush_text(struct s_bin_input *r)
+{
+	if (!r->text.len)
+		return;
+
+	s_bin_flush_raw(r);
+	s_bin_flush_leader(r);
+
+	/* The text follows a record of a pid printed by another worker */
+	if (!current_tcp) {
+		r->text.len = 0;
+		return;
+	}
+
+	s_bin_put(&r->text, "", 1);
+	tprints(r->text.data);
+	if (r->text.data[r->text.len - 2] == '\n')
+		line_ended();
+
+	r->text.len = 0;
+}
+
+static void
+s_bin_define(struct s_bin_input *r, enum s_bin_record type)
+{
+	size_t len;
+	uint64_t count;
+	uint64_t i;
+	struct xlat *x;
+	const unsigned char *p;
+
+	switch (type) {
+	case S_BIN_HEADER:
+		len = sizeof(S_BIN_MAGIC) - 1;
+		if ((size_t) (r->end - r->pos) < len ||
+		    memcmp(r->pos, S_BIN_MAGIC, len)) {
+			r->bad = true;
+			return;
+		}
+		r->pos += len;
+		if (s_bin_get_u(r) != S_BIN_VERSION)
+			error_msg_and_die("%s: unsupported version of -j binary "
+					  "output", r->fname);
+
+		r->header_seen = true;
+		r->string_base = r->nstrings;
+		r->xlat_base = r->nxlats;
+		break;
+
+	case S_BIN_STRING:
+		/* Names and xlat constants are plain ASCII */
+		for (p = r->pos; p < r->end; p++) {
+			if (*p < ' ' || *p > '~') {
+				r->bad = true;
+				return;
+			}
+		}
+		if (r->nstrings == r->strings_size) {
+			r->strings_size = r->strings_size ?
+				r->strings_size * 2 : 256;
+			r->strings = xreallocarray(r->strings,
+				r->strings_size, sizeof(*r->strings));
+			r->sysents = xreallocarray(r->sysents,
+				r->strings_size, sizeof(*r->sysents));
+		}
+		r->strings[r->nstrings] = s_bin_strndup(r->pos,
+			r->end - r->pos);
+		r->sysents[r->nstrings] = NULL;
+		r->nstrings++;
+		break;
+
+	case S_BIN_XLAT:
+		count = s_bin_get_u(r);
+		/* Every entry takes two bytes at least */
+		if (count > (uint64_t) (r->end - r->pos) / 2) {
+			r->bad = true;
+			return;
+		}
+
+		x = xcalloc(count + 1, sizeof(*x));
+		for (i = 0; i < count; i++) {
+			x[i].val = s_bin_get_u(r);
+			x[i].str = s_bin_get_string(r);
+		}
+
+		r->xlats = xreallocarray(r->xlats, r->nxlats + 1,
+			sizeof(*r->xlats));
+		r->xlats[r->nxlats++] = x;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void
+s_bin_get_mem(struct s_bin_input *r, struct tcb *tcp)
+{
+	struct s_bin_mem *m;
+	const void *data;
+
+	if (r->nmem == r->mem_size) {
+		r->mem_size = r->mem_size ? r->mem_size * 2 : 64;
+		r->mem = xreallocarray(r->mem, r->mem_size, sizeof(*r->mem));
+	}
+	m = &r->mem[r->nmem];
+
+	m->tcp = tcp;
+	m->str = s_bin_get_u(r);
+	m->addr = s_bin_get_u(r);
+	m->len = s_bin_get_u(r);
+	m->rc = s_bin_get_s(r);
+	data = s_bin_get_blob(r, &m->size);
+	if (r->bad || m->size > m->len)
+		r->bad = true;
+	if (r->bad)
+		return;
+
+	m->data = xmalloc(m->size ? m->size : 1);
+	memcpy(m->data, data, m->size);
+	r->nmem++;
+}
+
+static void
+s_bin_replay(struct s_bin_input *r, enum s_bin_record type)
+{
+	uint64_t pid = s_bin_get_u(r);
+	struct tcb *tcp;
+	struct timeval tv;
+
+	if (r->bad || !pid || pid > INT_MAX) {
+		r->bad = true;
+		return;
+	}
+
+	if (type == S_BIN_LEADER)
+		r->nleaders++;
+
+	if (pid % r->nworkers != r->worker) {
+		current_tcp = NULL;
+		return;
+	}
+
+	tcp = load_tcb(pid);
+
+	/*
+	 * The reads of -e read/write dumps follow the syscall exit,
+	 * and so does its duration.
+	 */
+	if (type != S_BIN_MEM && !(type == S_BIN_TV && r->raw_tcp == tcp))
+		s_bin_flush_raw(r);
+
+	/* The core prints these right after the leader or "before" */
+	switch (type) {
+	case S_BIN_BEFORE:
+	case S_BIN_RESUMED:
+	case S_BIN_UNAVAILABLE_ENTERING:
+	case S_BIN_SIGNAL:
+		if (r->leader_tcp != tcp) {
+			r->bad = true;
+			return;
+		}
+		break;
+	case S_BIN_ENTERING:
+	case S_BIN_EXITING:
+	case S_BIN_AFTER:
+	case S_BIN_UNAVAILABLE_EXITING:
+		/* These go into the record opened by the leader */
+		if (r->open_tcp != tcp || !tcp->s_syscall) {
+			r->bad = true;
+			return;
+		}
+		break;
+	case S_BIN_RAW_ENTERING:
+		if (r->leader_tcp != tcp) {
+			r->bad = true;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/*
+	 * A message prints its leader itself, if the formatter wants it,
+	 * and so does a raw syscall.  The reads of the syscall come after
+	 * its leader.
+	 */
+	switch (type) {
+	case S_BIN_MESSAGE:
+	case S_BIN_MEM:
+	case S_BIN_RAW_ENTERING:
+	case S_BIN_RAW_EXITING:
+		if (r->leader_tcp == tcp)
+			break;
+		/* fall through */
+	default:
+		s_bin_flush_leader(r);
+		break;
+	}
+
+	current_tcp = tcp;
+
+	switch (type) {
+	case S_BIN_LEADER:
+		s_bin_get_tv(r, &r->leader_tv);
+		r->leader_seq = r->nleaders;
+		r->leader_tcp = tcp;
+		/* Made before the syscall is decoded, for -P */
+		s_bin_drop_mem(r, tcp, r->nmem);
+		break;
+
+	case S_BIN_BEFORE:
+		tcp->s_ent = s_bin_get_sysent(r);
+		s_syscall_print_before(tcp);
+		break;
+
+	case S_BIN_ENTERING:
+		s_bin_syscall(tcp);
+		s_syscall_print_entering(tcp);
+		break;
+
+	case S_BIN_EXITING: {
+		struct s_syscall *syscall = s_bin_syscall(tcp);
+
+		s_bin_get_personality(r);
+		syscall->name_level = s_bin_get_u(r);
+		syscall->comment_level = s_bin_get_u(r);
+		s_bin_get_args(r, tcp, &syscall->args);
+		if (!r->bad)
+			s_syscall_print_exiting(tcp);
+		break;
+	}
+
+	case S_BIN_AFTER:
+		s_bin_syscall(tcp);
+		s_bin_get_personality(r);
+		tcp->u_error = s_bin_get_s(r);
+		tcp->sys_res = s_bin_get_u(r);
+		tcp->u_rval = s_bin_get_u(r);
+#if HAVE_STRUCT_TCB_EXT_ARG
+		tcp->u_lrval = s_bin_get_u(r);
+#else
+		s_bin_get_u(r);
+#endif
+		free(r->auxstr);
+		r->auxstr = NULL;
+		if (s_bin_get_u(r))
+			r->auxstr = s_bin_get_text(r);
+		tcp->auxstr = r->auxstr;
+		tcp->qual_flg = s_bin_get_u(r) ? QUAL_RAW : 0;
+		if (!r->bad)
+			s_syscall_print_after(tcp);
+		r->open_tcp = NULL;
+		break;
+
+	case S_BIN_RESUMED:
+		tcp->s_ent = s_bin_get_sysent(r);
+		s_syscall_print_resumed(tcp);
+		break;
+
+	case S_BIN_TV:
+		s_bin_get_tv(r, &tv);
+		if (r->raw_tcp == tcp)
+			r->raw_duration = tv;
+		else
+			s_syscall_print_tv(tcp, &tv);
+		break;
+
+	case S_BIN_UNAVAILABLE_ENTERING: {
+		int scno_good = s_bin_get_s(r);
+
+		tcp->s_ent = s_bin_get_sysent(r);
+		s_syscall_print_unavailable_entering(tcp, scno_good);
+		break;
+	}
+
+	case S_BIN_UNAVAILABLE_EXITING:
+		s_bin_syscall(tcp);
+		s_syscall_print_unavailable_exiting(tcp);
+		break;
+
+	case S_BIN_SIGNAL: {
+		/* The interrupted syscall has to be kept intact */
+		struct s_syscall *saved_syscall = tcp->s_syscall;
+
+		tcp->s_syscall = NULL;
+		s_syscall_new(tcp, S_SCT_SIGNAL);
+		s_bin_get_args(r, tcp, &tcp->s_syscall->args);
+		if (!r->bad && s_printer_cur->print_signal)
+			s_printer_cur->print_signal(tcp);
+		s_syscall_free(tcp);
+		tcp->s_syscall = saved_syscall;
+		break;
+	}
+
+	case S_BIN_MESSAGE: {
+		enum s_msg_type msg_type = s_bin_get_u(r);
+		char *text;
+
+		text = s_bin_get_text(r);
+		if (!text)
+			break;
+
+		if (r->leader_tcp) {
+			loaded_tv = &r->leader_tv;
+			loaded_seq = &r->leader_seq;
+		}
+		r->leader_tcp = NULL;
+		s_print_message(tcp, msg_type, "%s", text);
+		loaded_tv = NULL;
+		loaded_seq = NULL;
+		free(text);
+		break;
+	}
+
+	case S_BIN_RELEASE:
+		if (r->open_tcp == tcp)
+			r->open_tcp = NULL;
+		droptcb(tcp);
+		break;
+
+	case S_BIN_MEM:
+		s_bin_get_mem(r, tcp);
+		break;
+
+	case S_BIN_RAW_ENTERING: {
+		unsigned i;
+		int qual_flg;
+
+		s_bin_get_personality(r);
+		tcp->scno = s_bin_get_u(r);
+		qual_flg = s_bin_get_u(r);
+		if (s_bin_get_u(r) != MAX_ARGS)
+			r->bad = true;
+		for (i = 0; i < MAX_ARGS && !r->bad; i++) {
+			tcp->u_arg[i] = s_bin_get_u(r);
+#if HAVE_STRUCT_TCB_EXT_ARG
+			tcp->ext_arg[i] = s_bin_get_u(r);
+#endif
+		}
+		if (r->bad)
+			break;
+
+		loaded_tv = &r->leader_tv;
+		loaded_seq = &r->leader_seq;
+		r->leader_tcp = NULL;
+		replay_syscall_entering(tcp, qual_flg);
+		loaded_tv = NULL;
+		loaded_seq = NULL;
+		r->open_tcp = tcp;
+		s_bin_drop_mem(r, tcp, r->nmem);
+		break;
+	}
+
+	case S_BIN_RAW_EXITING:
+		s_bin_get_personality(r);
+		tcp->u_error = s_bin_get_s(r);
+		tcp->u_rval = s_bin_get_u(r);
+#if HAVE_STRUCT_TCB_EXT_ARG
+		tcp->u_lrval = s_bin_get_u(r);
+#else
+		s_bin_get_u(r);
+#endif
+		s_bin_get_tv(r, &r->raw_tv);
+		/* Its entering has not been printed, if it was unavailable */
+		if (r->bad || !(tcp->flags & TCB_INSYSCALL))
+			break;
+		/* The record of the syscall is printed already */
+		if (r->open_tcp != tcp && printing_tcp == tcp) {
+			r->bad = true;
+			break;
+		}
+
+		r->raw_seq = r->nleaders;
+		if (r->leader_tcp == tcp) {
+			r->raw_tv = r->leader_tv;
+			r->raw_seq = r->leader_seq;
+		}
+		r->leader_tcp = NULL;
+		memset(&r->raw_duration, 0, sizeof(r->raw_duration));
+		r->raw_tcp = tcp;
+		break;
+
+	default:
+		r->bad = true;
+		break;
+	}
+}
+
+/* Reads the record following a NUL byte; false if there is none. */
+static bool
+s_bin_read_record(struct s_bin_input *r)
+{
+	int type = getc(r->fp);
+	uint64_t len = 0;
+	unsigned shift = 0;
+	int c;
+
+	do {
+		c = getc(r->fp);
+		if (c == EOF || shift > 63 || type == EOF)
+			return false;
+		len |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	if (len > SIZE_MAX / 2)
+		return false;
+
+	r->rec.len = 0;
+	s_bin_reserve(&r->rec, len);
+	if (fread(r->rec.data, 1, len, r->fp) != len)
+		return false;
+
+	r->pos = (const unsigned char *) r->rec.data;
+	r->end = r->pos + len;
+
+	if (type != S_BIN_HEADER && !r->header_seen)
+		error_msg_and_die("%s: not an output of -j binary", r->fname);
+
+	if (type <= S_BIN_XLAT)
+		s_bin_define(r, type);
+	else
+		s_bin_replay(r, type);
+
+	if (r->bad)
+		error_msg_and_die("%s: malformed record of type %d",
+				  r->fname, type);
+
+	return true;
+}
+
+int
+s_binary_load(const char *fname, unsigned worker, unsigned nworkers)
+{
+	struct s_bin_input r = {
+		.fname = fname,
+		.worker = worker,
+		.nworkers = nworkers,
+	};
+	int rc = 0;
+	unsigned i;
+	int c;
+
+	input = &r;
+	replay_raw = true;
+
+	r.fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	if (!r.fp)
+		perror_msg_and_die("Can't fopen '%s'", fname);
+
+	if ((c = getc(r.fp)) != '\0' && c != EOF)
+		error_msg_and_die("%s: not an output of -j binary", fname);
+
+	for (; c != EOF; c = getc(r.fp)) {
+		if (c) {
+			char ch = c;
+
+			s_bin_put(&r.text, &ch, 1);
+			if (c == '\n')
+				s_bin_flush_text(&r);
+			continue;
+		}
+
+		s_bin_flush_text(&r);
+		if (!s_bin_read_record(&r)) {
+			error_msg("%s: truncated record", fname);
+			rc = 1;
+			break;
+		}
+	}
+
+	s_bin_flush_text(&r);
+	s_bin_flush_raw(&r);
+	s_bin_flush_leader(&r);
+
+	if (ferror(r.fp)) {
+		perror_msg("%s", fname);
+		rc = 1;
+	}
+	if (r.fp != stdin)
+		fclose(r.fp);
+
+	for (i = 0; i < r.nstrings; i++) {
+		free(r.sysents[i]);
+		free(r.strings[i]);
+	}
+	free(r.sysents);
+	free(r.strings);
+	for (i = 0; i < r.nxlats; i++)
+		free(r.xlats[i]);
+	free(r.xlats);
+	free(r.rec.data);
+	free(r.text.data);
+	free(r.auxstr);
+	for (i = 0; i < r.nmem; i++)
+		free(r.mem[i].data);
+	free(r.mem);
+	input = NULL;
+
+	return rc;
+}
@@ -0,0 +1,15 @@
+#ifndef STRACE_STRUCTURED_FMT_BINARY_H
+#define STRACE_STRUCTURED_FMT_BINARY_H
+
+#include "structured.h"
+
+extern struct s_printer s_printer_binary;
+
+/*
+ * Prints FNAME recorded with -j binary using the current formatter (-L),
+ * only the processes with pids equal to WORKER modulo NWORKERS.
+ */
+extern int s_binary_load(const char *fname, unsigned worker,
+	unsigned nworkers);
+
+#endif /* #ifndef STRACE_STRUCTURED_FMT_BINARY_H */
@@ -1,3 +1,14 @@
+/*
+ * JSON formatter.
+ *
+ * Records are written straight into a JsonWriter while the s_syscall tree
+ * is walked, without building a JsonNode tree first.  A syscall record is
+ * opened by print_leader, filled in by the subsequent callbacks and output
+ * by print_after; signals and messages are written as separate records.
+ * The text is the same as json_stringify would produce for a JsonNode
+ * tree of the record.
+ */
+
 #include <assert.h>
 #include <fcntl.h>
 #include <stdarg.h>
@@ -14,49 +25,186 @@ static const char *s_syscall_type_names[] = {
 	[S_SCT_SIGNAL]  = "signal",
 };
 
-JsonNode *root_node;
+/*
+ * The syscall record being written.  It is kept per process, as with -ff
+ * the records of several processes are open at the same time.
+ */
+struct s_json_record {
+	JsonWriter w;
+	bool open;
+};
+
+static struct s_json_record *
+s_json_record(struct tcb *tcp)
+{
+	if (!tcp->s_printer_data)
+		tcp->s_printer_data = xcalloc(1, sizeof(struct s_json_record));
+
+	return tcp->s_printer_data;
+}
+
+/* Signals and messages, which may come in the middle of a record */
+static JsonWriter aux;
+
+/* Buffer for quoted strings */
+static char *quoted;
+static size_t quoted_size;
+
+bool s_json_hex_addr;
+
+bool
+s_json_set_option(const char *option)
+{
+	if (strcmp(option, "hex") == 0) {
+		s_json_hex_addr = true;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Sign-extend the value of a signed xlat the way the text formatter
+ * prints it.
+ */
+JsonIntFormat
+s_json_xlat_value(struct s_xlat *x, uint64_t *value)
+{
+	switch (x->arg.type) {
+	case S_TYPE_xlat_d:
+		*value = (int32_t) *value;
+		return JSON_INT_SIGNED;
+	case S_TYPE_xlat_ld:
+		if (current_wordsize > sizeof(int))
+			*value = (int64_t) *value;
+		else
+			*value = (int32_t) *value;
+		return JSON_INT_SIGNED;
+	case S_TYPE_xlat_lld:
+		return JSON_INT_SIGNED;
+	default:
+		return JSON_INT_UNSIGNED;
+	}
+}
+
+/* The return value for RVAL_HEX, RVAL_OCTAL and RVAL_UDECIMAL */
+uint64_t
+s_json_urval(struct tcb *tcp)
+{
+#if SUPPORTED_PERSONALITIES > 1
+	if (current_wordsize < sizeof(long))
+		return (unsigned int) tcp->u_rval;
+#endif
+	return (unsigned long) tcp->u_rval;
+}
+
+#define S_JSON_ADDR_FORMAT \
+	(s_json_hex_addr ? JSON_INT_HEX : JSON_INT_UNSIGNED)
+
+static JsonWriter *
+s_json_writer(JsonWriter *w)
+{
+	if (!w->sb.start)
+		json_writer_init(w, "\t");
+	else
+		json_writer_reset(w);
+
+	return w;
+}
+
+static void
+s_json_output(struct tcb *tcp, JsonWriter *w)
+{
+	tprints(json_writer_finish(w));
+}
 
 static void
 s_print_xlat_json(struct s_xlat *x, uint64_t value, uint64_t mask,
 	const char *str, uint32_t flags, void *fn_data)
 {
-	JsonNode *parent = fn_data;
-	JsonNode *obj;
+	JsonWriter *w = fn_data;
+	JsonIntFormat format;
 
 	/* Corner case */
 	if (!(flags & SPXF_FIRST) && (flags & SPXF_DEFAULT) && !value)
 		return;
 
-	obj = json_mkobject();
+	json_write_begin_object(w, NULL);
 
-	json_append_member(obj, "default", json_mkbool(!!(flags & SPXF_DEFAULT)));
-	json_append_member(obj, "value", json_mknumber(value));
+	json_write_bool(w, "default", !!(flags & SPXF_DEFAULT));
+
+	format = s_json_xlat_value(x, &value);
+	json_write_integer(w, "value", value, format);
 
 	if (str && value)
-		json_append_member(obj, "str", json_mkstring_static(str));
+		json_write_string(w, "str", str);
 
 	if (x->arg.comment)
-		json_append_member(obj, "comment",
-			json_mkstring_static(x->arg.comment));
+		json_write_string(w, "comment", x->arg.comment);
 
-	json_append_element(parent, obj);
+	json_write_end_object(w);
 }
 
-void
+struct s_sigmask_json_data {
+	JsonWriter *w;
+	/* Which signals are written in this pass */
+	bool set;
+	/* Whether the object of this pass has been opened */
+	bool open;
+};
+
+static void
+s_sigmask_json_first(int bit, const char *str, bool set, void *data)
+{
+	int *first = data;
+
+	if (*first < 0)
+		*first = set;
+}
+
+static void
 s_print_sigmask_json(int bit, const char *str, bool set, void *data)
 {
-	JsonNode *root = data;
-	JsonNode *ins_point = json_find_member(root, set ? "set" : "unset");
+	struct s_sigmask_json_data *d = data;
 	char buf[sizeof(bit) * 3 + 1];
 
-	if (!ins_point) {
-		ins_point = json_mkobject();
-		json_append_member(root, set ? "set" : "unset", ins_point);
+	if (set != d->set)
+		return;
+
+	if (!d->open) {
+		json_write_begin_object(d->w, set ? "set" : "unset");
+		d->open = true;
 	}
 
 	snprintf(buf, sizeof(buf), "%u", bit);
 
-	json_append_member(ins_point, buf, json_mkstring(str));
+	json_write_string(d->w, buf, str);
+}
+
+/*
+ * Write the "set" and "unset" objects, the one containing
+ * the first signal goes first.
+ */
+static void
+s_print_sigmask_groups(JsonWriter *w, struct s_sigmask *p)
+{
+	struct s_sigmask_json_data d = { .w = w };
+	int first = -1;
+	unsigned i;
+
+	s_process_sigmask(p, s_sigmask_json_first, &first);
+	if (first < 0)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		d.set = i ? !first : first;
+		d.open = false;
+
+		s_process_sigmask(p, s_print_sigmask_json, &d);
+
+		if (d.open)
+			json_write_end_object(w);
+	}
 }
 
 #ifndef AT_FDCWD
@@ -66,52 +214,96 @@ s_print_sigmask_json(int bit, const char *str, bool set, void *data)
 # define FAN_NOFD -1
 #endif
 
-static JsonNode *
-s_val_print(struct s_arg *arg)
+static void
+s_val_print(JsonWriter *w, const char *key, struct s_arg *arg)
 {
-	JsonNode *new_obj = json_mkobject();
+	switch (arg->type) {
+	case S_TYPE_ellipsis:
+		json_write_string(w, key, "...");
+		return;
+
+	case S_TYPE_changeable:
+	case S_TYPE_str:
+	case S_TYPE_path:
+	case S_TYPE_ptrace_uaddr:
+	case S_TYPE_addr:
+	case S_TYPE_fan_dirfd:
+	case S_TYPE_dirfd:
+	case S_TYPE_fd:
+	case S_TYPE_xlat:
+	case S_TYPE_xlat_l:
+	case S_TYPE_xlat_ll:
+	case S_TYPE_xlat_d:
+	case S_TYPE_xlat_ld:
+	case S_TYPE_xlat_lld:
+	case S_TYPE_sigmask:
+	case S_TYPE_sa_handler:
+	case S_TYPE_array:
+	case S_TYPE_struct:
+		break;
+
+#define CASE_INT(ENUM) case S_TYPE_ ## ENUM:
+	CASE_INT(hhd) CASE_INT(hd) CASE_INT(d) CASE_INT(ld) CASE_INT(lld)
+	CASE_INT(hhu) CASE_INT(hu) CASE_INT(u) CASE_INT(lu) CASE_INT(llu)
+	CASE_INT(hhx) CASE_INT(hx) CASE_INT(x) CASE_INT(lx) CASE_INT(llx)
+	CASE_INT(hho) CASE_INT(ho) CASE_INT(o) CASE_INT(lo) CASE_INT(llo)
+	CASE_INT(wstatus) CASE_INT(rlim32) CASE_INT(rlim64)
+	CASE_INT(c) CASE_INT(dev_t) CASE_INT(uid) CASE_INT(gid)
+	CASE_INT(uid16) CASE_INT(gid16) CASE_INT(time) CASE_INT(signo)
+	CASE_INT(clockid)
+#undef CASE_INT
+		break;
 
-	json_append_member(new_obj, "name",
-		arg->name ? json_mkstring_static(arg->name) : json_mknull());
+	default:
+		json_write_string(w, key, ">:[");
+		return;
+	}
+
+	json_write_begin_object(w, key);
+
+	if (arg->name)
+		json_write_string(w, "name", arg->name);
+	else
+		json_write_null(w, "name");
 	if (arg->comment)
-		json_append_member(new_obj, "comment",
-			json_mkstring_static(arg->comment));
+		json_write_string(w, "comment", arg->comment);
 
 	switch (arg->type) {
-#define PRINT_INT(TYPE, ENUM) \
+#define PRINT_INT(TYPE, ENUM, SIGN) \
 	case S_TYPE_ ## ENUM: \
-		json_append_member(new_obj, "value", \
-		json_mknumber((TYPE) (((struct s_num *)s_arg_to_type(arg))->val))); \
+		json_write_integer(w, "value", \
+			(TYPE) (((struct s_num *)s_arg_to_type(arg))->val), \
+			JSON_INT_ ## SIGN); \
 		break;
 
-	PRINT_INT(signed char, hhd);
-	PRINT_INT(short, hd);
-	PRINT_INT(int, d);
-	PRINT_INT(long, ld);
-	PRINT_INT(long long, lld);
+	PRINT_INT(signed char, hhd, SIGNED);
+	PRINT_INT(short, hd, SIGNED);
+	PRINT_INT(int, d, SIGNED);
+	PRINT_INT(long, ld, SIGNED);
+	PRINT_INT(long long, lld, SIGNED);
 
-	PRINT_INT(unsigned char, hhu);
-	PRINT_INT(unsigned short, hu);
-	PRINT_INT(unsigned, u);
-	PRINT_INT(unsigned long, lu);
-	PRINT_INT(unsigned long long, llu);
+	PRINT_INT(unsigned char, hhu, UNSIGNED);
+	PRINT_INT(unsigned short, hu, UNSIGNED);
+	PRINT_INT(unsigned, u, UNSIGNED);
+	PRINT_INT(unsigned long, lu, UNSIGNED);
+	PRINT_INT(unsigned long long, llu, UNSIGNED);
 
-	PRINT_INT(unsigned char, hhx);
-	PRINT_INT(unsigned short, hx);
-	PRINT_INT(unsigned, x);
-	PRINT_INT(unsigned long, lx);
-	PRINT_INT(unsigned long long, llx);
+	PRINT_INT(unsigned char, hhx, UNSIGNED);
+	PRINT_INT(unsigned short, hx, UNSIGNED);
+	PRINT_INT(unsigned, x, UNSIGNED);
+	PRINT_INT(unsigned long, lx, UNSIGNED);
+	PRINT_INT(unsigned long long, llx, UNSIGNED);
 
-	PRINT_INT(unsigned char, hho);
-	PRINT_INT(unsigned short, ho);
-	PRINT_INT(int, o);
-	PRINT_INT(long, lo);
-	PRINT_INT(long long, llo);
+	PRINT_INT(unsigned char, hho, UNSIGNED);
+	PRINT_INT(unsigned short, ho, UNSIGNED);
+	PRINT_INT(int, o, SIGNED);
+	PRINT_INT(long, lo, SIGNED);
+	PRINT_INT(long long, llo, SIGNED);
 
-	PRINT_INT(int, wstatus);
+	PRINT_INT(int, wstatus, SIGNED);
 
-	PRINT_INT(unsigned, rlim32);
-	PRINT_INT(unsigned long long, rlim64);
+	PRINT_INT(unsigned, rlim32, UNSIGNED);
+	PRINT_INT(unsigned long long, rlim64, UNSIGNED);
 
 #undef PRINT_INT
 
@@ -119,22 +311,21 @@ s_val_print(struct s_arg *arg)
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 		char buf[2] = { (char)p->val, '\0' };
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("char"));
-		json_append_member(new_obj, "value", json_mkstring(buf));
+		json_write_string(w, "type", "char");
+		json_write_string(w, "value", buf);
 		break;
 	}
 
 	case S_TYPE_dev_t: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
-		JsonNode *dev_obj = json_mkobject();
-		json_append_member(new_obj, "type",
-			json_mkstring_static("dev_t"));
-		json_append_member(dev_obj, "major",
-			json_mknumber(major((dev_t)p->val)));
-		json_append_member(dev_obj, "minor",
-			json_mknumber(minor((dev_t)p->val)));
-		json_append_member(new_obj, "value", dev_obj);
+
+		json_write_string(w, "type", "dev_t");
+		json_write_begin_object(w, "value");
+		json_write_integer(w, "major", major((dev_t)p->val),
+			JSON_INT_UNSIGNED);
+		json_write_integer(w, "minor", minor((dev_t)p->val),
+			JSON_INT_UNSIGNED);
+		json_write_end_object(w);
 		break;
 	}
 
@@ -142,15 +333,14 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_gid: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static((arg->type == S_TYPE_uid) ?
-				"uid" : "gid"));
+		json_write_string(w, "type",
+			(arg->type == S_TYPE_uid) ? "uid" : "gid");
 
 		if ((uid_t) -1U == (uid_t)p->val)
-			json_append_member(new_obj, "value", json_mknumber(-1));
+			json_write_integer(w, "value", -1, JSON_INT_SIGNED);
 		else
-			json_append_member(new_obj, "value",
-				json_mknumber((uid_t)p->val));
+			json_write_integer(w, "value", (uid_t)p->val,
+				JSON_INT_UNSIGNED);
 
 		break;
 	}
@@ -159,15 +349,14 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_gid16: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static((arg->type == S_TYPE_uid) ?
-				"uid16" : "gid16"));
+		json_write_string(w, "type",
+			(arg->type == S_TYPE_uid) ? "uid16" : "gid16");
 
 		if ((uint16_t)-1U == (uint16_t)p->val)
-			json_append_member(new_obj, "value", json_mknumber(-1));
+			json_write_integer(w, "value", -1, JSON_INT_SIGNED);
 		else
-			json_append_member(new_obj, "value",
-				json_mknumber((uint16_t)p->val));
+			json_write_integer(w, "value", (uint16_t)p->val,
+				JSON_INT_UNSIGNED);
 
 		break;
 	}
@@ -175,10 +364,8 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_time: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("time"));
-		json_append_member(new_obj, "value",
-			json_mkstring(sprinttime(p->val)));
+		json_write_string(w, "type", "time");
+		json_write_string(w, "value", sprinttime(p->val));
 
 		break;
 	}
@@ -186,12 +373,9 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_signo: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("signo"));
-		json_append_member(new_obj, "value",
-			json_mknumber(p->val));
-		json_append_member(new_obj, "signame",
-			json_mkstring(signame(p->val)));
+		json_write_string(w, "type", "signo");
+		json_write_integer(w, "value", p->val, JSON_INT_UNSIGNED);
+		json_write_string(w, "signame", signame(p->val));
 
 		break;
 	}
@@ -199,12 +383,10 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_clockid: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("clockid"));
-		json_append_member(new_obj, "value",
-			json_mknumber((int)p->val));
-		json_append_member(new_obj, "clockname",
-			json_mkstring(sprintclockname((int)p->val)));
+		json_write_string(w, "type", "clockid");
+		json_write_integer(w, "value", (int)p->val, JSON_INT_SIGNED);
+		json_write_string(w, "clockname",
+			sprintclockname((int)p->val));
 
 		break;
 	}
@@ -212,28 +394,22 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_changeable: {
 		struct s_changeable *s_ch = S_ARG_TO_TYPE(arg, changeable);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("changeable"));
+		json_write_string(w, "type", "changeable");
 
 		if (!s_ch->entering && !s_ch->exiting) {
-			json_append_member(new_obj, "value", json_mknull());
+			json_write_null(w, "value");
 		} else {
 			if (s_ch->entering) {
 				if (!s_arg_equal(s_ch->entering, s_ch->exiting))
-					json_append_member(new_obj,
-						"entering_value",
-						s_val_print(s_ch->entering));
-			} else {
-				json_append_member(new_obj, "entering_value",
-					json_mknull());
-			}
-			if (s_ch->exiting) {
-				json_append_member(new_obj, "exiting_value",
-					s_val_print(s_ch->exiting));
+					s_val_print(w, "entering_value",
+						s_ch->entering);
 			} else {
-				json_append_member(new_obj, "exiting_value",
-					json_mknull());
+				json_write_null(w, "entering_value");
 			}
+			if (s_ch->exiting)
+				s_val_print(w, "exiting_value", s_ch->exiting);
+			else
+				json_write_null(w, "exiting_value");
 		}
 
 		break;
@@ -242,21 +418,26 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_str:
 	case S_TYPE_path: {
 		struct s_str *s_p = S_ARG_TO_TYPE(arg, str);
-		char *outstr;
 		unsigned int style = (s_p->flags |
 			QUOTE_OMIT_LEADING_TRAILING_QUOTES) & ~QUOTE_ELLIPSIS;
+		size_t size = s_p->len;
 		bool truncated;
 
-		alloc_quoted_string(s_p->str, &outstr, s_p->len, style);
-		truncated = string_quote(s_p->str, outstr,
+		/* The same size alloc_quoted_string would allocate */
+		if (size && (style & QUOTE_0_TERMINATED))
+			size--;
+		if (4 * size + 1 > quoted_size) {
+			quoted_size = 4 * size + 1;
+			quoted = xreallocarray(quoted, quoted_size, 1);
+		}
+
+		truncated = string_quote(s_p->str, quoted,
 			(s_p->len ? s_p->len : 0), style);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("str"));
-		json_append_member(new_obj, "value", json_mkstring(outstr));
-		json_append_member(new_obj, "size", json_mknumber(s_p->len));
-		json_append_member(new_obj, "truncated",
-			json_mkbool(truncated));
+		json_write_string(w, "type", "str");
+		json_write_string(w, "value", quoted);
+		json_write_integer(w, "size", s_p->len, JSON_INT_SIGNED);
+		json_write_bool(w, "truncated", truncated);
 
 		break;
 	}
@@ -264,12 +445,11 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_addr: {
 		struct s_addr *p = S_ARG_TO_TYPE(arg, addr);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("address"));
-		json_append_member(new_obj, "addr", json_mknumber(p->addr));
+		json_write_string(w, "type", "address");
+		json_write_integer(w, "addr", p->addr, S_JSON_ADDR_FORMAT);
 
 		if (p->val)
-			json_append_member(new_obj, "value", s_val_print(p->val));
+			s_val_print(w, "value", p->val);
 
 		break;
 	}
@@ -278,18 +458,15 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_fd: {
 		struct s_num *p = S_ARG_TO_TYPE(arg, num);
 
-		json_append_member(new_obj, "type", json_mkstring_static("fd"));
+		json_write_string(w, "type", "fd");
 
 		if ((arg->type == S_TYPE_fan_dirfd) &&
 		    ((int)p->val == FAN_NOFD))
-			json_append_member(new_obj, "string",
-				json_mkstring_static("FAN_NOFD"));
+			json_write_string(w, "string", "FAN_NOFD");
 		else if ((arg->type != S_TYPE_fd) && ((int)p->val == AT_FDCWD))
-			json_append_member(new_obj, "string",
-				json_mkstring_static("AT_FDCWD"));
+			json_write_string(w, "string", "AT_FDCWD");
 
-		json_append_member(new_obj, "value",
-			json_mknumber((int)p->val));
+		json_write_integer(w, "value", (int)p->val, JSON_INT_SIGNED);
 
 		break;
 	}
@@ -300,13 +477,11 @@ s_val_print(struct s_arg *arg)
 	case S_TYPE_xlat_ld:
 	case S_TYPE_xlat_lld: {
 		struct s_xlat *f_p = S_ARG_TO_TYPE(arg, xlat);
-		JsonNode *arr = json_mkarray();
 
-		s_process_xlat(f_p, s_print_xlat_json, arr);
-
-		json_append_member(new_obj, "type",
-			json_mkstring_static("xlat"));
-		json_append_member(new_obj, "value", arr);
+		json_write_string(w, "type", "xlat");
+		json_write_begin_array(w, "value");
+		s_process_xlat(f_p, s_print_xlat_json, w);
+		json_write_end_array(w);
 
 		break;
 	}
@@ -321,9 +496,10 @@ s_val_print(struct s_arg *arg)
 		char *ptr = buf;
 		unsigned i;
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("sigmask"));
+		json_write_string(w, "type", "sigmask");
 
+		/* Initialized for a zero-sized mask */
+		buf[0] = '\0';
 		for (i = 0; i < p->bytes; i++) {
 			unsigned cur_byte = i ^ pos_xor_mask;
 
@@ -339,9 +515,9 @@ s_val_print(struct s_arg *arg)
 				!!(p->sigmask[cur_byte] >> 7));
 		}
 
-		json_append_member(new_obj, "bitmask", json_mkstring(buf));
+		json_write_string(w, "bitmask", buf);
 
-		s_process_sigmask(p, s_print_sigmask_json, new_obj);
+		s_print_sigmask_groups(w, p);
 
 		break;
 	}
@@ -350,60 +526,56 @@ s_val_print(struct s_arg *arg)
 		const char *str = xlookup(sa_handler_values,
 			(unsigned long)p->val);
 
-		json_append_member(new_obj, "type",
-			json_mkstring_static("sa_handler"));
-		json_append_member(new_obj, "value", json_mknumber(p->val));
+		json_write_string(w, "type", "sa_handler");
+		json_write_integer(w, "value", p->val, S_JSON_ADDR_FORMAT);
 
 		if (str)
-			json_append_member(new_obj, "str", json_mkstring(str));
+			json_write_string(w, "str", str);
 
 		break;
 	}
 	case S_TYPE_array: {
 		struct s_struct *p = S_ARG_TO_TYPE(arg, struct);
 		struct s_arg *field;
-		JsonNode *arr = json_mkarray();
 
+		json_write_begin_array(w, "value");
 		list_foreach(field, &p->args.args, entry) {
-			json_append_element(arr, s_val_print(field));
+			s_val_print(w, NULL, field);
 		}
-
-		json_append_member(new_obj, "value", arr);
+		json_write_end_array(w);
 
 		break;
 	}
 	case S_TYPE_struct: {
 		struct s_struct *p = S_ARG_TO_TYPE(arg, struct);
 		struct s_arg *field;
-		JsonNode *arr = json_mkobject();
 
+		json_write_begin_object(w, "value");
 		list_foreach(field, &p->args.args, entry) {
-			json_append_member(arr, field->name, s_val_print(field));
+			s_val_print(w, field->name, field);
 		}
-
-		json_append_member(new_obj, "value", arr);
+		json_write_end_object(w);
 
 		break;
 	}
-	case S_TYPE_ellipsis:
-		json_delete(new_obj);
-		return json_mkstring_static("...");
-
 	default:
-		json_delete(new_obj);
-		return json_mkstring_static(">:[");
+		break;
 	}
 
-	return new_obj;
+	json_write_end_object(w);
 }
 
 static void
 s_syscall_json_print_unfinished(struct tcb *tcp)
 {
-	if (root_node) {
-		json_append_member(root_node, "unfinished", json_mkbool(true));
+	struct s_json_record *rec = s_json_record(tcp);
+
+	if (rec->open) {
+		json_write_bool(&rec->w, "unfinished", true);
+		json_write_end_object(&rec->w);
+		rec->open = false;
 
-		tprints(json_stringify(root_node, "\t"));
+		s_json_output(tcp, &rec->w);
 		fflush(tcp->outf);
 	}
 }
@@ -412,31 +584,35 @@ static void
 s_syscall_json_print_leader(struct tcb *tcp, struct timeval *tv,
 	struct timeval *dtv)
 {
-	json_delete(root_node);
-	root_node = json_mkobject();
+	struct s_json_record *rec = s_json_record(tcp);
+	JsonWriter *w = s_json_writer(&rec->w);
+
+	rec->open = true;
+	json_write_begin_object(w, NULL);
+
+	json_write_integer(w, "pid", tcp->pid, JSON_INT_SIGNED);
 
-	json_append_member(root_node, "pid", json_mknumber(tcp->pid));
+	if (Qflag)
+		json_write_integer(w, "seq", print_seq, JSON_INT_UNSIGNED);
 
 	if (tflag) {
 		if (rflag)
-			json_append_member(root_node, "time_delta",
-				json_mknumber(
-					dtv->tv_sec + dtv->tv_usec / 1e6));
+			json_write_number(w, "time_delta",
+				dtv->tv_sec + dtv->tv_usec / 1e6);
 
 		if (tflag > 2)
-			json_append_member(root_node, "timestamp",
-				json_mknumber(tv->tv_sec + tv->tv_usec / 1e6));
+			json_write_number(w, "timestamp",
+				tv->tv_sec + tv->tv_usec / 1e6);
 		else {
 			time_t local = tv->tv_sec;
-			char *ts_str = xmalloc(sizeof("HH:MM:SS.123456"));
+			char ts_str[sizeof("HH:MM:SS.123456")];
 
 			strftime(ts_str, sizeof("HH:MM:SS"), "%T",
 				localtime(&local));
 			snprintf(ts_str + sizeof("HH:MM:SS") - 1,
 				sizeof(".123456"), ".%06ld", tv->tv_usec);
 
-			json_append_member(root_node, "timestamp",
-				json_mkstring_own(ts_str));
+			json_write_string(w, "timestamp", ts_str);
 		}
 	}
 }
@@ -444,230 +620,243 @@ s_syscall_json_print_leader(struct tcb *tcp, struct timeval *tv,
 static void
 s_syscall_json_print_before(struct tcb *tcp)
 {
-	assert(root_node);
+	struct s_json_record *rec = s_json_record(tcp);
 
-	json_append_member(root_node, "name",
-		json_mkstring(tcp->s_ent->sys_name));
+	assert(rec->open);
+
+	json_write_string(&rec->w, "name", tcp->s_ent->sys_name);
 }
 
 static void
 s_syscall_json_print_entering(struct tcb *tcp)
 {
-	assert(root_node);
+	struct s_json_record *rec = s_json_record(tcp);
+
+	assert(rec->open);
 
-	json_append_member(root_node, "type",
-		json_mkstring_static(
-			s_syscall_type_names[tcp->s_syscall->type]));
+	json_write_string(&rec->w, "type",
+		s_syscall_type_names[tcp->s_syscall->type]);
 }
 
 static void
 s_syscall_json_print_exiting(struct tcb *tcp)
 {
+	struct s_json_record *rec = s_json_record(tcp);
 	struct s_syscall *syscall = tcp->s_syscall;
 	struct s_arg *arg;
-	JsonNode *args_node = json_mkarray();
 
-	assert(root_node);
+	assert(rec->open);
 
+	json_write_begin_array(&rec->w, "args");
 	list_foreach(arg, &syscall->args.args, entry) {
-		json_append_element(args_node, s_val_print(arg));
+		s_val_print(&rec->w, NULL, arg);
 	}
+	json_write_end_array(&rec->w);
+}
 
-	json_append_member(root_node, "args", args_node);
+static void
+s_json_write_frames(JsonWriter *w, const char *name,
+	const struct stack_frame *frames, unsigned int nframes)
+{
+	unsigned int i;
+
+	json_write_begin_array(w, name);
+	for (i = 0; i < nframes; i++) {
+		const struct stack_frame *frame = &frames[i];
+
+		json_write_begin_object(w, NULL);
+		if (frame->error) {
+			json_write_string(w, "error", frame->error);
+			if (frame->true_offset)
+				json_write_integer(w, "address",
+					frame->true_offset, S_JSON_ADDR_FORMAT);
+		} else {
+			json_write_string(w, "file", frame->binary_filename);
+			if (frame->symbol_name && frame->symbol_name[0]) {
+				json_write_string(w, "symbol",
+					frame->symbol_name);
+				json_write_integer(w, "symbol_offset",
+					frame->function_offset,
+					JSON_INT_UNSIGNED);
+			}
+			json_write_integer(w, "file_offset",
+				frame->true_offset, S_JSON_ADDR_FORMAT);
+		}
+		json_write_end_object(w);
+	}
+	json_write_end_array(w);
+}
+
+/*
+ * The frames are written into the record, or with -K into a separate
+ * stack record, output before the syscall record refers to it by id.
+ */
+static void
+s_syscall_json_print_stack(struct tcb *tcp, unsigned long id,
+	const struct stack_frame *frames, unsigned int nframes)
+{
+	struct s_json_record *rec = s_json_record(tcp);
+
+	assert(rec->open);
+
+	if (!id) {
+		s_json_write_frames(&rec->w, "stack", frames, nframes);
+		return;
+	}
+
+	if (frames) {
+		JsonWriter *w = s_json_writer(&aux);
+
+		json_write_begin_object(w, NULL);
+		json_write_string(w, "type", "stack");
+		json_write_integer(w, "id", id, JSON_INT_UNSIGNED);
+		s_json_write_frames(w, "frames", frames, nframes);
+		json_write_end_object(w);
+		s_json_output(tcp, w);
+		tprints("\n");
+	}
+
+	json_write_integer(&rec->w, "stack", id, JSON_INT_UNSIGNED);
+}
+
+static void
+s_json_print_restart(JsonWriter *w, long error, const char *errnostr,
+	const char *retstring)
+{
+	json_write_string(w, "return", "?");
+	json_write_integer(w, "errno", error, JSON_INT_SIGNED);
+	json_write_string(w, "errnostr", errnostr);
+	json_write_string(w, "retstring", retstring);
 }
 
 static void
 s_syscall_json_print_after(struct tcb *tcp)
 {
+	struct s_json_record *rec = s_json_record(tcp);
+	JsonWriter *w = &rec->w;
 	long u_error = tcp->u_error;
 	int sys_res = tcp->sys_res;
 
-	assert(root_node);
+	assert(rec->open);
 
 	if (!(sys_res & RVAL_NONE) && u_error) {
+		/* See the comments in structured_fmt_text.c */
 		switch (u_error) {
-		/* Blocked signals do not interrupt any syscalls.
-		 * In this case syscalls don't return ERESTARTfoo codes.
-		 *
-		 * Deadly signals set to SIG_DFL interrupt syscalls
-		 * and kill the process regardless of which of the codes below
-		 * is returned by the interrupted syscall.
-		 * In some cases, kernel forces a kernel-generated deadly
-		 * signal to be unblocked and set to SIG_DFL (and thus cause
-		 * death) if it is blocked or SIG_IGNed: for example, SIGSEGV
-		 * or SIGILL. (The alternative is to leave process spinning
-		 * forever on the faulty instruction - not useful).
-		 *
-		 * SIG_IGNed signals and non-deadly signals set to SIG_DFL
-		 * (for example, SIGCHLD, SIGWINCH) interrupt syscalls,
-		 * but kernel will always restart them.
-		 */
 		case ERESTARTSYS:
-			/* Most common type of signal-interrupted syscall exit code.
-			 * The system call will be restarted with the same arguments
-			 * if SA_RESTART is set; otherwise, it will fail with EINTR.
-			 */
-			json_append_member(root_node, "return",
-				json_mkstring_static("?"));
-			json_append_member(root_node, "errno",
-				json_mknumber(ERESTARTSYS));
-			json_append_member(root_node, "errnostr",
-				json_mkstring_static("ERESTARTSYS"));
-			json_append_member(root_node, "retstring",
-				json_mkstring_static("To be restarted if "
-					"SA_RESTART is set"));
+			s_json_print_restart(w, ERESTARTSYS, "ERESTARTSYS",
+				"To be restarted if SA_RESTART is set");
 			break;
 		case ERESTARTNOINTR:
-			/* Rare. For example, fork() returns this if interrupted.
-			 * SA_RESTART is ignored (assumed set): the restart is unconditional.
-			 */
-			json_append_member(root_node, "return",
-				json_mkstring_static("?"));
-			json_append_member(root_node, "errno",
-				json_mknumber(ERESTARTNOINTR));
-			json_append_member(root_node, "errnostr",
-				json_mkstring_static("ERESTARTNOINTR"));
-			json_append_member(root_node, "retstring",
-				json_mkstring_static("To be restarted"));
+			s_json_print_restart(w, ERESTARTNOINTR,
+				"ERESTARTNOINTR", "To be restarted");
 			break;
 		case ERESTARTNOHAND:
-			/* pause(), rt_sigsuspend() etc use this code.
-			 * SA_RESTART is ignored (assumed not set):
-			 * syscall won't restart (will return EINTR instead)
-			 * even after signal with SA_RESTART set. However,
-			 * after SIG_IGN or SIG_DFL signal it will restart
-			 * (thus the name "restart only if has no handler").
-			 */
-			json_append_member(root_node, "return",
-				json_mkstring_static("?"));
-			json_append_member(root_node, "errno",
-				json_mknumber(ERESTARTNOHAND));
-			json_append_member(root_node, "errnostr",
-				json_mkstring_static("ERESTARTNOHAND"));
-			json_append_member(root_node, "retstring",
-				json_mkstring_static("To be restarted if no "
-					"handler"));
+			s_json_print_restart(w, ERESTARTNOHAND,
+				"ERESTARTNOHAND", "To be restarted if no handler");
 			break;
 		case ERESTART_RESTARTBLOCK:
-			/* Syscalls like nanosleep(), poll() which can't be
-			 * restarted with their original arguments use this
-			 * code. Kernel will execute restart_syscall() instead,
-			 * which changes arguments before restarting syscall.
-			 * SA_RESTART is ignored (assumed not set) similarly
-			 * to ERESTARTNOHAND. (Kernel can't honor SA_RESTART
-			 * since restart data is saved in "restart block"
-			 * in task struct, and if signal handler uses a syscall
-			 * which in turn saves another such restart block,
-			 * old data is lost and restart becomes impossible)
-			 */
-			json_append_member(root_node, "return",
-				json_mkstring_static("?"));
-			json_append_member(root_node, "errno",
-				json_mknumber(ERESTART_RESTARTBLOCK));
-			json_append_member(root_node, "errnostr",
-				json_mkstring_static("ERESTART_RESTARTBLOCK"));
-			json_append_member(root_node, "retstring",
-				json_mkstring_static("Interrupted by signal"));
+			s_json_print_restart(w, ERESTART_RESTARTBLOCK,
+				"ERESTART_RESTARTBLOCK", "Interrupted by signal");
 			break;
 		default:
-			json_append_member(root_node, "return", json_mknumber(-1));
-			json_append_member(root_node, "errno", json_mknumber(u_error));
-			if ((unsigned long) u_error < nerrnos && errnoent[u_error]) {
-				json_append_member(root_node, "errnostr",
-					json_mkstring_static(
-						errnoent[u_error]));
-			}
-			json_append_member(root_node, "retstring",
-				json_mkstring(strerror(u_error)));
+			json_write_integer(w, "return", -1, JSON_INT_SIGNED);
+			json_write_integer(w, "errno", u_error, JSON_INT_SIGNED);
+			if ((unsigned long) u_error < nerrnos && errnoent[u_error])
+				json_write_string(w, "errnostr",
+					errnoent[u_error]);
+			json_write_string(w, "retstring", strerror(u_error));
 			break;
 		}
-		if ((sys_res & RVAL_STR) && tcp->auxstr)
-			json_append_member(root_node, "auxstr",
-				json_mkstring(tcp->auxstr));
+	} else if (sys_res & RVAL_NONE) {
+		json_write_string(w, "return", "?");
 	} else {
-		if (sys_res & RVAL_NONE) {
-			json_append_member(root_node, "return",
-				json_mkstring_static("?"));
-		} else {
-			switch (sys_res & RVAL_MASK) {
-			case RVAL_HEX:
-			case RVAL_OCTAL:
-			case RVAL_UDECIMAL:
-			case RVAL_DECIMAL:
-			case RVAL_FD:
-				json_append_member(root_node, "return",
-					json_mknumber(tcp->u_rval));
-				break;
+		switch (sys_res & RVAL_MASK) {
+		case RVAL_HEX:
+		case RVAL_OCTAL:
+		case RVAL_UDECIMAL:
+			json_write_integer(w, "return", s_json_urval(tcp),
+				JSON_INT_UNSIGNED);
+			break;
+		case RVAL_DECIMAL:
+		case RVAL_FD:
+			json_write_integer(w, "return", tcp->u_rval,
+				JSON_INT_SIGNED);
+			break;
 #if HAVE_STRUCT_TCB_EXT_ARG
-			/*
-			case RVAL_LHEX:
-			case RVAL_LOCTAL:
-			case RVAL_LDECIMAL:
-			*/
-			case RVAL_LUDECIMAL:
-				json_append_member(root_node, "return",
-					json_mknumber(tcp->u_lrval));
-				break;
+		/*
+		case RVAL_LHEX:
+		case RVAL_LOCTAL:
+		case RVAL_LDECIMAL:
+		*/
+		case RVAL_LUDECIMAL:
+			json_write_integer(w, "return", tcp->u_lrval,
+				JSON_INT_UNSIGNED);
+			break;
 #endif /* HAVE_STRUCT_TCB_EXT_ARG */
-			default:
-				json_append_member(root_node, "return",
-					json_mkstring_static("?"));
-				json_append_member(root_node, "retstring",
-					json_mkstring_static("Invalid rval format"));
-				break;
-			}
+		default:
+			json_write_string(w, "return", "?");
+			json_write_string(w, "retstring",
+				"Invalid rval format");
+			break;
 		}
-		if ((sys_res & RVAL_STR) && tcp->auxstr)
-			json_append_member(root_node, "auxstr",
-				json_mkstring(tcp->auxstr));
 	}
+	if ((sys_res & RVAL_STR) && tcp->auxstr)
+		json_write_string(w, "auxstr", tcp->auxstr);
+
+	json_write_end_object(w);
+	rec->open = false;
 
-	tprints(json_stringify(root_node, "\t"));
+	s_json_output(tcp, w);
 	fflush(tcp->outf);
-	json_delete(root_node);
-	root_node = NULL;
 }
 
 static void
 s_syscall_json_print_tv(struct tcb *tcp, struct timeval *tv)
 {
-	JsonNode *tv_node = json_mkobject();
+	struct s_json_record *rec = s_json_record(tcp);
 
-	assert(root_node);
+	/* The record has been output already by print_after */
+	if (!rec->open)
+		return;
 
-	json_append_member(tv_node, "sec", json_mknumber(tv->tv_sec));
-	json_append_member(tv_node, "usec", json_mknumber(tv->tv_usec));
-	json_append_member(root_node, "time", tv_node);
+	json_write_begin_object(&rec->w, "time");
+	json_write_integer(&rec->w, "sec", tv->tv_sec, JSON_INT_SIGNED);
+	json_write_integer(&rec->w, "usec", tv->tv_usec, JSON_INT_SIGNED);
+	json_write_end_object(&rec->w);
 }
 
 static void
 s_syscall_json_print_resumed(struct tcb *tcp)
 {
-	assert(root_node);
+	struct s_json_record *rec = s_json_record(tcp);
+
+	assert(rec->open);
 
-	json_append_member(root_node, "resumed", json_mkbool(true));
+	json_write_bool(&rec->w, "resumed", true);
 }
 
 static void
 s_syscall_json_print_unavailable_entering(struct tcb *tcp, int scno_good)
 {
-	assert(root_node);
+	struct s_json_record *rec = s_json_record(tcp);
 
-	json_append_member(root_node, "type",
-		json_mkstring_static(
-			s_syscall_type_names[tcp->s_syscall->type]));
-	json_append_member(root_node, "name",
-		json_mkstring(scno_good == 1 ? tcp->s_ent->sys_name : "????"));
+	assert(rec->open);
+
+	json_write_string(&rec->w, "type",
+		s_syscall_type_names[tcp->s_syscall->type]);
+	json_write_string(&rec->w, "name",
+		scno_good == 1 ? tcp->s_ent->sys_name : "????");
 }
 
 static void
 s_syscall_json_print_unavailable_exiting(struct tcb *tcp)
 {
-	assert(root_node);
+	struct s_json_record *rec = s_json_record(tcp);
+
+	assert(rec->open);
 
-	json_append_member(root_node, "return", json_mkstring_static("?"));
-	json_append_member(root_node, "retstring",
-		json_mkstring_static("<unavailable>"));
+	json_write_string(&rec->w, "return", "?");
+	json_write_string(&rec->w, "retstring", "<unavailable>");
 }
 
 static void
@@ -675,18 +864,18 @@ s_syscall_json_print_signal(struct tcb *tcp)
 {
 	struct s_syscall *syscall = tcp->s_syscall;
 	struct s_arg *arg;
-	JsonNode *signal_node = json_mkobject();
+	JsonWriter *w = s_json_writer(&aux);
 
-	json_append_member(signal_node, "type",
-		json_mkstring_static(
-			s_syscall_type_names[tcp->s_syscall->type]));
+	json_write_begin_object(w, NULL);
+	json_write_string(w, "type",
+		s_syscall_type_names[tcp->s_syscall->type]);
 
 	list_foreach(arg, &syscall->args.args, entry) {
-		json_append_member(signal_node, arg->name, s_val_print(arg));
+		s_val_print(w, arg->name, arg);
 	}
 
-	tprints(json_stringify(signal_node, "\t"));
-	json_delete(signal_node);
+	json_write_end_object(w);
+	s_json_output(tcp, w);
 }
 
 static void
@@ -697,38 +886,57 @@ s_json_print_message(struct tcb *tcp, enum s_msg_type type, const char *msg,
 		[S_MSG_INFO] = "info",
 		[S_MSG_ERROR] = "error"
 	};
-	JsonNode *msg_node = json_mkobject();
+	JsonWriter *w = s_json_writer(&aux);
 	char *buf = NULL;
 	ssize_t size;
 	va_list args_copy;
 
-	json_append_member(msg_node, "type", json_mkstring_static("message"));
+	json_write_begin_object(w, NULL);
+	json_write_string(w, "type", "message");
 
 	if ((type < ARRAY_SIZE(msg_type_names)) && msg_type_names[type])
-		json_append_member(msg_node, "msg_type",
-			json_mkstring_static(msg_type_names[type]));
+		json_write_string(w, "msg_type", msg_type_names[type]);
 	else
-		json_append_member(msg_node, "msg_type",
-			json_mkstring_static("unknown"));
+		json_write_string(w, "msg_type", "unknown");
 
 	va_copy(args_copy, args);
 	size = vsnprintf(buf, 0, msg, args_copy);
 	va_end(args_copy);
 
 	if (size < 0) {
-		json_append_member(msg_node, "error",
-			json_mkstring_static("printf"));
-		json_append_member(msg_node, "msg_format",
-			json_mkstring_static(msg));
+		json_write_string(w, "error", "printf");
+		json_write_string(w, "msg_format", msg);
 	} else {
 		buf = xmalloc(size + 1);
 		vsnprintf(buf, size + 1, msg, args);
 
-		json_append_member(msg_node, "msg", json_mkstring_own(buf));
+		json_write_string(w, "msg", buf);
+		free(buf);
+	}
+
+	json_write_end_object(w);
+	s_json_output(tcp, w);
+}
+
+static void
+s_json_release(struct tcb *tcp)
+{
+	struct s_json_record *rec = tcp->s_printer_data;
+
+	if (!rec)
+		return;
+
+	if (rec->open && tcp->outf) {
+		struct tcb *save = current_tcp;
+
+		current_tcp = tcp;
+		s_syscall_json_print_unfinished(tcp);
+		current_tcp = save;
 	}
 
-	tprints(json_stringify(msg_node, "\t"));
-	json_delete(msg_node);
+	json_writer_free(&rec->w);
+	free(rec);
+	tcp->s_printer_data = NULL;
 }
 
 struct s_printer s_printer_json = {
@@ -744,5 +952,8 @@ struct s_printer s_printer_json = {
 	.print_unavailable_entering = s_syscall_json_print_unavailable_entering,
 	.print_unavailable_exiting = s_syscall_json_print_unavailable_exiting,
 	.print_signal = s_syscall_json_print_signal,
+	.print_stack = s_syscall_json_print_stack,
 	.print_message = s_json_print_message,
+	.set_option = s_json_set_option,
+	.release = s_json_release,
 };
@@ -6,4 +6,11 @@
 
 extern struct s_printer s_printer_json;
 
+/* Print addresses as hexadecimal strings (-j json,hex) */
+extern bool s_json_hex_addr;
+
+extern bool s_json_set_option(const char *option);
+extern JsonIntFormat s_json_xlat_value(struct s_xlat *x, uint64_t *value);
+extern uint64_t s_json_urval(struct tcb *tcp);
+
 #endif /* #ifndef STRACE_STRUCTURED_FMT_JSON_H */
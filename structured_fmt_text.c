@@ -507,6 +507,9 @@ s_syscall_text_print_leader(struct tcb *tcp, struct timeval *tv,
 	else if (nprocs > 1 && !outfname)
 		tprintf("[pid %5u] ", tcp->pid);
 
+	if (Qflag)
+		tprintf("%llu ", print_seq);
+
 	if (tflag) {
 		char str[sizeof("HH:MM:SS")];
 
@@ -0,0 +1,366 @@
+/* Formatting of finished syscall records in worker threads.
+ *
+ * The tracer thread decodes syscall arguments into an s_syscall tree while
+ * the tracee is stopped, since decoders have to read tracee memory.  Once
+ * the syscall has exited, the tree holds everything the printer needs, so
+ * instead of formatting it in place the tracer hands it over to a pool of
+ * formatter threads and restarts the tracee.
+ *
+ * All output goes through a single queue of jobs kept in the order the
+ * tracer has issued them.  A job is either a chunk of text printed by the
+ * tracer itself (leader, "<unfinished ...>", signals, I/O dumps) or
+ * a syscall record to be formatted by a worker.  Jobs are written out
+ * strictly in queue order as soon as all the preceding ones are done, so the
+ * output is byte-for-byte the same as without the pipeline.
+ */
+
+#include "defs.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#include "structured.h"
+
+struct s_job {
+	/* Next job in output order */
+	struct s_job *next;
+	/* Next job to be picked up by a worker */
+	struct s_job *next_pending;
+	FILE *outf;
+	char *buf;
+	size_t len;
+	size_t size;
+	bool done;
+
+	/* Formatting jobs only */
+	unsigned personality;
+	char *auxstr;
+	struct tcb tcb;
+};
+
+unsigned s_pipeline_threads;
+
+static pthread_t *workers;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when a job is queued for formatting or the pool stops */
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+/* Signalled when the output queue becomes empty */
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static struct s_job *queue_head;
+static struct s_job *queue_tail;
+static struct s_job *pending_head;
+static struct s_job *pending_tail;
+static unsigned idle_workers;
+static bool stopping;
+
+/* Text printed by the tracer thread which is not queued yet */
+static struct s_job *open_job;
+/* Formatting job of the current worker thread */
+static __thread struct s_job *worker_job;
+
+static unsigned long jobs_formatted;
+static unsigned long jobs_written;
+static unsigned long jobs_queued_max;
+static unsigned long jobs_queued;
+
+static struct s_job *
+s_job_new(FILE *outf)
+{
+	struct s_job *job = xcalloc(1, sizeof(*job));
+
+	job->outf = outf;
+
+	return job;
+}
+
+static void
+s_job_free(struct s_job *job)
+{
+	free(job->auxstr);
+	free(job->buf);
+	free(job);
+}
+
+static int
+s_job_vprintf(struct s_job *job, const char *fmt, va_list args)
+{
+	va_list a1;
+	int n;
+
+	va_copy(a1, args);
+	n = vsnprintf(job->buf + job->len, job->size - job->len, fmt, a1);
+	va_end(a1);
+
+	if (n < 0)
+		return n;
+
+	if ((size_t) n >= job->size - job->len) {
+		job->size = job->len + n + 256;
+		job->buf = xreallocarray(job->buf, job->size, 1);
+		vsnprintf(job->buf + job->len, job->size - job->len, fmt, args);
+	}
+
+	job->len += n;
+
+	return n;
+}
+
+static void
+s_job_puts(struct s_job *job, const char *str, size_t len)
+{
+	if (len >= job->size - job->len) {
+		job->size = job->len + len + 256;
+		job->buf = xreallocarray(job->buf, job->size, 1);
+	}
+
+	memcpy(job->buf + job->len, str, len + 1);
+	job->len += len;
+}
+
+/* Must be called with queue_lock held. */
+static void
+s_pipeline_write_done(void)
+{
+	struct s_job *job;
+
+	while ((job = queue_head) && job->done) {
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		jobs_queued--;
+
+		if (job->len)
+			outbuf_write(job->outf, job->buf, job->len);
+		if (!outbuf_async &&
+		    (!queue_head || queue_head->outf != job->outf))
+			fflush(job->outf);
+
+		jobs_written++;
+		s_job_free(job);
+	}
+
+	if (!queue_head)
+		pthread_cond_broadcast(&idle_cond);
+}
+
+/* Must be called with queue_lock held. */
+static void
+s_pipeline_enqueue(struct s_job *job)
+{
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+
+	if (++jobs_queued > jobs_queued_max)
+		jobs_queued_max = jobs_queued;
+}
+
+static void *
+s_pipeline_worker(void *arg)
+{
+	struct s_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while (!pending_head && !stopping) {
+			idle_workers++;
+			pthread_cond_wait(&pending_cond, &queue_lock);
+			idle_workers--;
+		}
+		job = pending_head;
+		if (!job) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		pending_head = job->next_pending;
+		if (!pending_head)
+			pending_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		worker_job = job;
+		current_tcp = &job->tcb;
+		set_personality(job->personality);
+
+		s_printer_cur->print_exiting(&job->tcb);
+		s_printer_cur->print_after(&job->tcb);
+		s_syscall_release(&job->tcb);
+
+		current_tcp = NULL;
+		worker_job = NULL;
+
+		pthread_mutex_lock(&queue_lock);
+		job->done = true;
+		jobs_formatted++;
+		s_pipeline_write_done();
+		pthread_mutex_unlock(&queue_lock);
+	}
+
+	return NULL;
+}
+
+void
+s_pipeline_init(void)
+{
+	sigset_t all_set;
+	sigset_t saved_set;
+	unsigned i;
+	int err;
+
+	if (!s_pipeline_threads)
+		return;
+
+	/* Signals are handled by the tracer thread only. */
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_SETMASK, &all_set, &saved_set);
+
+	workers = xcalloc(s_pipeline_threads, sizeof(*workers));
+	for (i = 0; i < s_pipeline_threads; i++) {
+		err = pthread_create(&workers[i], NULL, s_pipeline_worker,
+				     NULL);
+		if (err) {
+			errno = err;
+			perror_msg_and_die("pthread_create");
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved_set, NULL);
+
+	if (debug_flag)
+		error_msg("started %u formatter threads", s_pipeline_threads);
+}
+
+int
+s_pipeline_vprintf(FILE *outf, const char *fmt, va_list args)
+{
+	if (worker_job)
+		return s_job_vprintf(worker_job, fmt, args);
+
+	if (open_job && open_job->outf != outf)
+		s_pipeline_flush();
+	if (!open_job)
+		open_job = s_job_new(outf);
+
+	return s_job_vprintf(open_job, fmt, args);
+}
+
+int
+s_pipeline_puts(FILE *outf, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (worker_job) {
+		s_job_puts(worker_job, str, len);
+		return len;
+	}
+
+	if (open_job && open_job->outf != outf)
+		s_pipeline_flush();
+	if (!open_job)
+		open_job = s_job_new(outf);
+
+	s_job_puts(open_job, str, len);
+
+	return len;
+}
+
+/* Queue the text printed by the tracer so far. */
+void
+s_pipeline_flush(void)
+{
+	struct s_job *job = open_job;
+
+	if (!job)
+		return;
+	open_job = NULL;
+
+	job->done = true;
+
+	pthread_mutex_lock(&queue_lock);
+	s_pipeline_enqueue(job);
+	s_pipeline_write_done();
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Hand the syscall record of TCP over to a formatter thread.
+ * Everything the printer looks at is copied, so TCP can be reused
+ * for the next stop right away.
+ */
+void
+s_pipeline_submit(struct tcb *tcp)
+{
+	struct s_job *job = s_job_new(tcp->outf);
+
+	job->personality = current_personality;
+	job->tcb = *tcp;
+	/* The spare arena stays with the tracee */
+	job->tcb.s_arena = NULL;
+	if (tcp->auxstr)
+		job->tcb.auxstr = job->auxstr = xstrdup(tcp->auxstr);
+	job->tcb.s_syscall->tcp = &job->tcb;
+	tcp->s_syscall = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	if (open_job) {
+		open_job->done = true;
+		s_pipeline_enqueue(open_job);
+		open_job = NULL;
+		s_pipeline_write_done();
+	}
+	s_pipeline_enqueue(job);
+	if (pending_tail)
+		pending_tail->next_pending = job;
+	else
+		pending_head = job;
+	pending_tail = job;
+	if (idle_workers)
+		pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Wait until everything queued so far has been written out. */
+void
+s_pipeline_sync(void)
+{
+	if (!s_pipeline_threads)
+		return;
+
+	s_pipeline_flush();
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_head)
+		pthread_cond_wait(&idle_cond, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void
+s_pipeline_finish(void)
+{
+	unsigned i;
+
+	if (!s_pipeline_threads)
+		return;
+
+	s_pipeline_sync();
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = true;
+	pthread_cond_broadcast(&pending_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	for (i = 0; i < s_pipeline_threads; i++)
+		pthread_join(workers[i], NULL);
+
+	if (debug_flag)
+		error_msg("%lu records formatted by %u threads, "
+			  "%lu output chunks written, at most %lu queued",
+			  jobs_formatted, s_pipeline_threads,
+			  jobs_written, jobs_queued_max);
+
+	free(workers);
+	workers = NULL;
+	s_pipeline_threads = 0;
+}
@@ -42,6 +42,11 @@
 #include "regs.h"
 #include "ptrace.h"
 
+#if defined X86_64 || defined X32 || defined I386
+# include <linux/audit.h>
+# define HAVE_SYSCALL_INFO_ARCH 1
+#endif
+
 #if defined(SPARC64)
 # undef PTRACE_GETREGS
 # define PTRACE_GETREGS PTRACE_GETREGS64
@@ -212,17 +217,17 @@ enum {
 };
 
 #if SUPPORTED_PERSONALITIES > 1
-const struct_sysent *sysent = sysent0;
-const char *const *errnoent = errnoent0;
-const char *const *signalent = signalent0;
-const struct_ioctlent *ioctlent = ioctlent0;
-const struct_printers *printers = &printers0;
+__thread const struct_sysent *sysent = sysent0;
+__thread const char *const *errnoent = errnoent0;
+__thread const char *const *signalent = signalent0;
+__thread const struct_ioctlent *ioctlent = ioctlent0;
+__thread const struct_printers *printers = &printers0;
 #endif
 
-unsigned nsyscalls = nsyscalls0;
-unsigned nerrnos = nerrnos0;
-unsigned nsignals = nsignals0;
-unsigned nioctlents = nioctlents0;
+__thread unsigned nsyscalls = nsyscalls0;
+__thread unsigned nerrnos = nerrnos0;
+__thread unsigned nsignals = nsignals0;
+__thread unsigned nioctlents = nioctlents0;
 
 unsigned num_quals;
 qualbits_t *qual_vec[SUPPORTED_PERSONALITIES];
@@ -267,10 +272,10 @@ enum {
 };
 
 #if SUPPORTED_PERSONALITIES > 1
-unsigned current_personality;
+__thread unsigned current_personality;
 
 # ifndef current_wordsize
-unsigned current_wordsize;
+__thread unsigned current_wordsize;
 static const int personality_wordsize[SUPPORTED_PERSONALITIES] = {
 	PERSONALITY0_WORDSIZE,
 	PERSONALITY1_WORDSIZE,
@@ -748,7 +753,7 @@ shuffle_scno(unsigned long scno)
 const char *
 syscall_name(long scno)
 {
-	static char buf[sizeof("syscall_%lu") + sizeof(long)*3];
+	static __thread char buf[sizeof("syscall_%lu") + sizeof(long)*3];
 
 	if (SCNO_IS_VALID(scno))
 		return sysent[scno].sys_name;
@@ -759,21 +764,158 @@ syscall_name(long scno)
 }
 
 static long get_regs_error;
+static bool regs_fetched;
+
+#ifdef HAVE_SYSCALL_INFO_ARCH
+/* Same layout as struct ptrace_syscall_info in linux/ptrace.h */
+typedef struct {
+	uint8_t op;
+	uint8_t pad[3];
+	uint32_t arch;
+	uint64_t instruction_pointer;
+	uint64_t stack_pointer;
+	union {
+		struct {
+			uint64_t nr;
+			uint64_t args[6];
+		} entry;
+		struct {
+			int64_t rval;
+			uint8_t is_error;
+		} exit;
+		struct {
+			uint64_t nr;
+			uint64_t args[6];
+			uint32_t ret_data;
+		} seccomp;
+	} u;
+} struct_ptrace_syscall_info;
+
+/* 1 - supported, 0 - not checked yet, -1 - not supported. */
+static int syscall_info_support;
+static struct_ptrace_syscall_info syscall_info;
+static bool syscall_info_fetched;
+#endif
 
+/* Forget the registers and syscall info fetched at the previous stop. */
 void
 clear_regs(void)
 {
 	get_regs_error = -1;
+	regs_fetched = false;
+#ifdef HAVE_SYSCALL_INFO_ARCH
+	syscall_info_fetched = false;
+#endif
 }
 
+static int fetch_syscall_args(struct tcb *);
+static int fetch_syscall_result(struct tcb *);
 static int get_syscall_args(struct tcb *);
 static int get_syscall_result(struct tcb *);
 static int arch_get_scno(struct tcb *tcp);
+static void set_sysent(struct tcb *tcp);
 static void get_error(struct tcb *, const bool);
 #if defined X86_64 || defined POWERPC
 static int getregs_old(pid_t);
 #endif
 
+/*
+ * Decode and print the syscall whose number and arguments are in TCP.
+ * Used both while tracing and by -L on syscalls recorded undecoded.
+ */
+static int
+decode_syscall_entering(struct tcb *tcp)
+{
+	int res;
+
+#ifdef USE_LIBUNWIND
+	if (stack_trace_enabled) {
+		if (tcp->s_ent->sys_flags & STACKTRACE_CAPTURE_ON_ENTER)
+			unwind_capture_stacktrace(tcp);
+	}
+#endif
+
+	printleader(tcp);
+	s_syscall_print_before(tcp);
+	if ((tcp->qual_flg & QUAL_RAW) && SEN_exit != tcp->s_ent->sen)
+		res = printargs(tcp);
+	else {
+		res = tcp->s_ent->sys_func(tcp);
+	}
+	s_syscall_print_entering(tcp);
+
+	return res;
+}
+
+/*
+ * Decode and print the result of the syscall, TV is the time
+ * of the syscall exit, RES is the result of fetching it.
+ * Returns RES if the result is unavailable, 0 otherwise.
+ */
+static int
+decode_syscall_exiting(struct tcb *tcp, struct timeval *tv, int res)
+{
+	/* If not in -ff mode, and printing_tcp != tcp,
+	 * then the log currently does not end with output
+	 * of _our syscall entry_, but with something else.
+	 * We need to say which syscall's return is this.
+	 *
+	 * Forced reprinting via TCB_REPRINT is used only by
+	 * "strace -ff -oLOG test/threaded_execve" corner case.
+	 * It's the only case when -ff mode needs reprinting.
+	 */
+	if ((followfork < 2 && printing_tcp != tcp) || (tcp->flags & TCB_REPRINT)) {
+		tcp->flags &= ~TCB_REPRINT;
+		printleader(tcp);
+		s_syscall_print_resumed(tcp);
+	}
+	printing_tcp = tcp;
+
+	tcp->s_prev_ent = NULL;
+	if (res != 1) {
+		/* There was error in one of prior ptrace ops */
+		s_syscall_print_unavailable_exiting(tcp);
+		return res;
+	}
+	tcp->s_prev_ent = tcp->s_ent;
+
+	s_syscall_init_exiting(tcp);
+
+	tcp->sys_res = 0;
+	if (tcp->qual_flg & QUAL_RAW) {
+		/* tcp->sys_res = printargs(tcp); - but it's nop on sysexit */
+	} else {
+		if (tcp->sys_func_rval & RVAL_DECODED)
+			tcp->sys_res = tcp->sys_func_rval;
+		else {
+			tcp->sys_res = tcp->s_ent->sys_func(tcp);
+		}
+	}
+	s_syscall_print_exiting(tcp);
+
+#ifdef USE_LIBUNWIND
+	/* The formatters with print_stack print it as a part of the record */
+	if (stack_trace_enabled && s_printer_cur->print_stack)
+		unwind_print_stacktrace(tcp);
+#endif
+
+	s_syscall_print_after(tcp);
+	if (Tflag) {
+		tv_sub(tv, tv, &tcp->etime);
+		s_syscall_print_tv(tcp, tv);
+	}
+	tprints("\n");
+	dumpio(tcp);
+	line_ended();
+
+#ifdef USE_LIBUNWIND
+	if (stack_trace_enabled && !s_printer_cur->print_stack)
+		unwind_print_stacktrace(tcp);
+#endif
+
+	return 0;
+}
+
 static int
 trace_syscall_entering(struct tcb *tcp)
 {
@@ -783,7 +925,7 @@ trace_syscall_entering(struct tcb *tcp)
 	if (res == 0)
 		return res;
 	if (res == 1)
-		res = get_syscall_args(tcp);
+		res = fetch_syscall_args(tcp);
 
 	if (res != 1) {
 		printleader(tcp);
@@ -838,21 +980,7 @@ trace_syscall_entering(struct tcb *tcp)
 		goto ret;
 	}
 
-#ifdef USE_LIBUNWIND
-	if (stack_trace_enabled) {
-		if (tcp->s_ent->sys_flags & STACKTRACE_CAPTURE_ON_ENTER)
-			unwind_capture_stacktrace(tcp);
-	}
-#endif
-
-	printleader(tcp);
-	s_syscall_print_before(tcp);
-	if ((tcp->qual_flg & QUAL_RAW) && SEN_exit != tcp->s_ent->sen)
-		res = printargs(tcp);
-	else {
-		res = tcp->s_ent->sys_func(tcp);
-	}
-	s_syscall_print_entering(tcp);
+	res = decode_syscall_entering(tcp);
 
  ret:
 	tcp->flags |= TCB_INSYSCALL;
@@ -873,17 +1001,20 @@ trace_syscall_exiting(struct tcb *tcp)
 	if (Tflag || cflag)
 		gettimeofday(&tv, NULL);
 
-#ifdef USE_LIBUNWIND
-	if (stack_trace_enabled) {
-		if (tcp->s_ent->sys_flags & STACKTRACE_INVALIDATE_CACHE)
-			unwind_cache_invalidate(tcp);
-	}
-#endif
-
 #if SUPPORTED_PERSONALITIES > 1
 	update_personality(tcp, tcp->currpers);
 #endif
-	res = (get_regs_error ? -1 : get_syscall_result(tcp));
+	res = fetch_syscall_result(tcp);
+	if (res == 1) {
+		fdtable_update(tcp);
+#ifdef USE_LIBUNWIND
+		if (stack_trace_enabled &&
+		    (tcp->s_ent->sys_flags & STACKTRACE_INVALIDATE_CACHE))
+			unwind_cache_update(tcp);
+#endif
+		if (show_fd_path > 1)
+			invalidate_sockaddr_cache(tcp);
+	}
 	if (filtered(tcp) || hide_log_until_execve)
 		goto ret;
 
@@ -894,59 +1025,7 @@ trace_syscall_exiting(struct tcb *tcp)
 		}
 	}
 
-	/* If not in -ff mode, and printing_tcp != tcp,
-	 * then the log currently does not end with output
-	 * of _our syscall entry_, but with something else.
-	 * We need to say which syscall's return is this.
-	 *
-	 * Forced reprinting via TCB_REPRINT is used only by
-	 * "strace -ff -oLOG test/threaded_execve" corner case.
-	 * It's the only case when -ff mode needs reprinting.
-	 */
-	if ((followfork < 2 && printing_tcp != tcp) || (tcp->flags & TCB_REPRINT)) {
-		tcp->flags &= ~TCB_REPRINT;
-		printleader(tcp);
-		s_syscall_print_resumed(tcp);
-	}
-	printing_tcp = tcp;
-
-	tcp->s_prev_ent = NULL;
-	if (res != 1) {
-		/* There was error in one of prior ptrace ops */
-		s_syscall_print_unavailable_exiting(tcp);
-		goto ret;
-	}
-	tcp->s_prev_ent = tcp->s_ent;
-
-	s_syscall_init_exiting(tcp);
-
-	tcp->sys_res = 0;
-	if (tcp->qual_flg & QUAL_RAW) {
-		/* tcp->sys_res = printargs(tcp); - but it's nop on sysexit */
-	} else {
-		if (tcp->sys_func_rval & RVAL_DECODED)
-			tcp->sys_res = tcp->sys_func_rval;
-		else {
-			tcp->sys_res = tcp->s_ent->sys_func(tcp);
-		}
-	}
-	s_syscall_print_exiting(tcp);
-
-	s_syscall_print_after(tcp);
-	if (Tflag) {
-		tv_sub(&tv, &tv, &tcp->etime);
-		s_syscall_print_tv(tcp, &tv);
-	}
-	tprints("\n");
-	dumpio(tcp);
-	line_ended();
-
-#ifdef USE_LIBUNWIND
-	if (stack_trace_enabled)
-		unwind_print_stacktrace(tcp);
-#endif
-
-	res = 0;
+	res = decode_syscall_exiting(tcp, &tv, res);
 
  ret:
 	tcp->flags &= ~TCB_INSYSCALL;
@@ -962,6 +1041,40 @@ trace_syscall(struct tcb *tcp)
 		trace_syscall_exiting(tcp) : trace_syscall_entering(tcp);
 }
 
+/*
+ * -L: print the syscall recorded by -j binary,raw, its number, arguments
+ * and result are already in TCP, the tracee memory is the recorded one.
+ * QUAL_FLG are the qualifiers of the syscall used while recording.
+ */
+void
+replay_syscall_entering(struct tcb *tcp, int qual_flg)
+{
+	/* The exit of the previous syscall may be missing from the record */
+	if (tcp->flags & TCB_INSYSCALL) {
+		tcp->flags &= ~TCB_INSYSCALL;
+		free_tcb_priv_data(tcp);
+	}
+
+	set_sysent(tcp);
+	tcp->qual_flg = qual_flg;
+	tcp->sys_func_rval = decode_syscall_entering(tcp);
+	tcp->flags |= TCB_INSYSCALL;
+}
+
+/* DURATION is used by -T, if it was given while recording. */
+void
+replay_syscall_exiting(struct tcb *tcp, const struct timeval *duration)
+{
+	struct timeval tv = *duration;
+
+	memset(&tcp->etime, 0, sizeof(tcp->etime));
+	decode_syscall_exiting(tcp, &tv, 1);
+
+	tcp->flags &= ~TCB_INSYSCALL;
+	tcp->sys_func_rval = 0;
+	free_tcb_priv_data(tcp);
+}
+
 bool
 is_erestart(struct tcb *tcp)
 {
@@ -1041,6 +1154,7 @@ print_pc(struct tcb *tcp)
 #else
 # error Neither ARCH_PC_REG nor ARCH_PC_PEEK_ADDR is defined
 #endif
+	get_regs(tcp->pid);
 	if (get_regs_error || ARCH_GET_PC)
 		tprints(current_wordsize == 4 ? "[????????] "
 					      : "[????????????????] ");
@@ -1049,6 +1163,30 @@ print_pc(struct tcb *tcp)
 			(unsigned long) ARCH_PC_REG);
 }
 
+/*
+ * Fetches the registers the stack is walked from by -U fp: the program
+ * counter, the stack pointer and the frame pointer.  Returns false
+ * if they are not available on this architecture.
+ */
+bool
+get_frame_regs(struct tcb *tcp, unsigned long *pc, unsigned long *sp,
+	       unsigned long *fp)
+{
+#if defined ARCH_PC_REG && defined ARCH_SP_REG && defined ARCH_FP_REG
+	get_regs(tcp->pid);
+	if (get_regs_error)
+		return false;
+
+	*pc = ARCH_PC_REG;
+	*sp = ARCH_SP_REG;
+	*fp = ARCH_FP_REG;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 #if defined ARCH_REGS_FOR_GETREGSET
 static long
 get_regset(pid_t pid)
@@ -1070,9 +1208,19 @@ get_regset(pid_t pid)
 }
 #endif /* ARCH_REGS_FOR_GETREGSET */
 
+/*
+ * Fetch registers of the stopped tracee unless they have already been
+ * fetched at this stop.  Registers are fetched lazily: on kernels that
+ * support PTRACE_GET_SYSCALL_INFO, syscall stops do not need them unless
+ * a decoder or -i asks for them.
+ */
 void
 get_regs(pid_t pid)
 {
+	if (regs_fetched)
+		return;
+	regs_fetched = true;
+
 #undef USE_GET_SYSCALL_RESULT_REGS
 #ifdef ARCH_REGS_FOR_GETREGSET
 # ifdef X86_64
@@ -1137,6 +1285,98 @@ free_sysent_buf(void *ptr)
 	free(ptr);
 }
 
+#ifdef HAVE_SYSCALL_INFO_ARCH
+# ifndef __X32_SYSCALL_BIT
+#  define __X32_SYSCALL_BIT	0x40000000
+# endif
+
+/*
+ * Fetch syscall info of the stopped tracee with PTRACE_GET_SYSCALL_INFO
+ * unless it has already been fetched at this stop.
+ * Returns false if the info is not available.
+ */
+static bool
+fetch_syscall_info(struct tcb *tcp)
+{
+	if (syscall_info_fetched)
+		return syscall_info.op != PTRACE_SYSCALL_INFO_NONE;
+	if (syscall_info_support < 0)
+		return false;
+
+	if (ptrace(PTRACE_GET_SYSCALL_INFO, tcp->pid,
+		   (void *) sizeof(syscall_info), &syscall_info) <= 0) {
+		if (!syscall_info_support && errno == EIO) {
+			syscall_info_support = -1;
+			if (debug_flag)
+				error_msg("PTRACE_GET_SYSCALL_INFO is not supported");
+		}
+		return false;
+	}
+	syscall_info_support = 1;
+	syscall_info_fetched = true;
+
+	return syscall_info.op != PTRACE_SYSCALL_INFO_NONE;
+}
+
+/* Returns true if the syscall info describes an i386 syscall. */
+static bool
+syscall_info_is_i386(void)
+{
+	return syscall_info.arch == AUDIT_ARCH_I386;
+}
+
+/* Same semantics as arch_get_scno(), but uses syscall_info. */
+static int
+syscall_info_get_scno(struct tcb *tcp)
+{
+	uint64_t nr = syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP
+		      ? syscall_info.u.seccomp.nr : syscall_info.u.entry.nr;
+	unsigned int currpers;
+
+	switch (syscall_info.arch) {
+# if defined X86_64 || defined X32
+	case AUDIT_ARCH_X86_64:
+		/* See the comment about -1 in linux/x86_64/get_scno.c */
+		if ((nr & __X32_SYSCALL_BIT) && nr != (uint64_t) -1) {
+			nr -= __X32_SYSCALL_BIT;
+#  ifdef X86_64
+			currpers = 2;
+#  else
+			currpers = 0;
+#  endif
+			break;
+		}
+#  ifdef X86_64
+		currpers = 0;
+		break;
+#  else
+		/* Let arch_get_scno() complain about 64-bit mode. */
+		get_regs(tcp->pid);
+		if (get_regs_error)
+			return -1;
+		return arch_get_scno(tcp);
+#  endif
+	case AUDIT_ARCH_I386:
+		currpers = 1;
+		break;
+# else /* I386 */
+	case AUDIT_ARCH_I386:
+		currpers = 0;
+		break;
+# endif
+	default:
+		get_regs(tcp->pid);
+		if (get_regs_error)
+			return -1;
+		return arch_get_scno(tcp);
+	}
+
+	update_personality(tcp, currpers);
+	tcp->scno = nr;
+	return 1;
+}
+#endif /* HAVE_SYSCALL_INFO_ARCH */
+
 /*
  * Returns:
  * 0: "ignore this ptrace stop", bail out of trace_syscall_entering() silently.
@@ -1147,13 +1387,32 @@ free_sysent_buf(void *ptr)
 int
 get_scno(struct tcb *tcp)
 {
-	if (get_regs_error)
-		return -1;
+	int rc;
 
-	int rc = arch_get_scno(tcp);
+#ifdef HAVE_SYSCALL_INFO_ARCH
+	if (fetch_syscall_info(tcp)
+	    && (syscall_info.op == PTRACE_SYSCALL_INFO_ENTRY
+		|| syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP))
+		rc = syscall_info_get_scno(tcp);
+	else
+#endif
+	{
+		get_regs(tcp->pid);
+		if (get_regs_error)
+			return -1;
+		rc = arch_get_scno(tcp);
+	}
 	if (rc != 1)
 		return rc;
 
+	set_sysent(tcp);
+	return 1;
+}
+
+/* Set ->s_ent and ->qual_flg of TCP according to ->scno. */
+static void
+set_sysent(struct tcb *tcp)
+{
 	if (SCNO_IS_VALID(tcp->scno)) {
 		tcp->s_ent = &sysent[tcp->scno];
 		tcp->qual_flg = qual_flags[tcp->scno];
@@ -1175,13 +1434,79 @@ get_scno(struct tcb *tcp)
 		if (debug_flag)
 			error_msg("pid %d invalid syscall %ld", tcp->pid, tcp->scno);
 	}
-	return 1;
 }
 
 #ifdef USE_GET_SYSCALL_RESULT_REGS
 static int get_syscall_result_regs(struct tcb *);
 #endif
 
+/* Same semantics as get_syscall_args(), but tries syscall info first. */
+static int
+fetch_syscall_args(struct tcb *tcp)
+{
+#ifdef HAVE_SYSCALL_INFO_ARCH
+	/* Unless get_scno() had to fall back to registers. */
+	if (syscall_info_fetched && !regs_fetched
+	    && (syscall_info.op == PTRACE_SYSCALL_INFO_ENTRY
+		|| syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP)) {
+		const uint64_t *args =
+			syscall_info.op == PTRACE_SYSCALL_INFO_SECCOMP
+			? syscall_info.u.seccomp.args
+			: syscall_info.u.entry.args;
+		unsigned int i;
+
+		for (i = 0; i < MAX_ARGS; ++i) {
+			if (syscall_info_is_i386()) {
+				/* Zero-extend from 32 bits */
+				tcp->u_arg[i] = (uint32_t) args[i];
+			} else {
+				tcp->u_arg[i] = args[i];
+# ifdef X32
+				tcp->ext_arg[i] = args[i];
+# endif
+			}
+		}
+		return 1;
+	}
+#endif
+	return get_syscall_args(tcp);
+}
+
+/* Same semantics as get_syscall_result(), but tries syscall info first. */
+static int
+fetch_syscall_result(struct tcb *tcp)
+{
+#ifdef HAVE_SYSCALL_INFO_ARCH
+	if (fetch_syscall_info(tcp)
+	    && syscall_info.op == PTRACE_SYSCALL_INFO_EXIT) {
+		long long rval = syscall_info.u.exit.rval;
+
+		if (syscall_info_is_i386()) {
+			/* Sign extend from 32 bits */
+			rval = (int32_t) rval;
+		}
+
+		tcp->u_error = 0;
+		if (!(tcp->s_ent->sys_flags & SYSCALL_NEVER_FAILS)
+		    && syscall_info.u.exit.is_error) {
+			tcp->u_rval = -1;
+			tcp->u_error = -rval;
+		} else {
+			tcp->u_rval = rval;
+# ifdef X32
+			/* tcp->u_rval contains a truncated value */
+			tcp->u_lrval = rval;
+# endif
+		}
+		return 1;
+	}
+#endif
+	get_regs(tcp->pid);
+	if (get_regs_error)
+		return -1;
+	return get_syscall_result(tcp);
+}
+
 /* Returns:
  * 1: ok, continue in trace_syscall_exiting().
  * -1: error, trace_syscall_exiting() should print error indicator
@@ -0,0 +1,127 @@
+/*
+ * Check that -y prints the current paths of descriptors
+ * that have been reused, replaced or closed by execve.
+ *
+ * Copyright (c) 2017 The strace developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tests.h"
+#include <asm/unistd.h>
+
+#ifdef __NR_fchmod
+
+# include <fcntl.h>
+# include <limits.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+
+/* Above the descriptors the loader of the new image is going to open. */
+# define CLOEXEC_FD 10
+
+static char cwd[PATH_MAX];
+
+static int
+open_file(const char *name, int flags)
+{
+	int fd = open(name, O_CREAT | O_RDONLY | flags, 0600);
+
+	if (fd < 0)
+		perror_msg_and_fail("open: %s", name);
+	return fd;
+}
+
+static void
+check_path(int fd, const char *name)
+{
+	if (syscall(__NR_fchmod, fd, 0600))
+		perror_msg_and_fail("fchmod: %d", fd);
+	printf("fchmod(%d<%s/%s>, 0600) = 0\n", fd, cwd, name);
+}
+
+int
+main(int ac, char **av)
+{
+	static const char name1[] = "fdtable-y.1";
+	static const char name2[] = "fdtable-y.2";
+	static const char name3[] = "fdtable-y.3";
+	int fd1, fd2, fd3, i;
+
+	if (ac > 1) {
+		fd3 = atoi(av[1]);
+		if (syscall(__NR_fchmod, fd3, 0600) != -1)
+			error_msg_and_fail("fchmod: %d is open", fd3);
+		printf("fchmod(%d, 0600) = -1 EBADF (%m)\n", fd3);
+		puts("+++ exited with 0 +++");
+		return 0;
+	}
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		perror_msg_and_fail("getcwd");
+
+	/* close() followed by open() that reuses the descriptor */
+	fd1 = open_file(name1, 0);
+	check_path(fd1, name1);
+	if (close(fd1))
+		perror_msg_and_fail("close");
+	fd2 = open_file(name2, 0);
+	if (fd2 != fd1)
+		error_msg_and_fail("open: %d != %d", fd2, fd1);
+	check_path(fd2, name2);
+
+	/* dup2() over a cached descriptor */
+	fd1 = open_file(name1, 0);
+	check_path(fd1, name1);
+	if (dup2(fd2, fd1) != fd1)
+		perror_msg_and_fail("dup2");
+	check_path(fd1, name2);
+
+	/* execve() after the descriptor was opened with O_CLOEXEC */
+	for (i = fd1 + 1; i < CLOEXEC_FD; ++i)
+		if (dup2(fd1, i) != i)
+			perror_msg_and_fail("dup2");
+	fd3 = open_file(name3, O_CLOEXEC);
+	check_path(fd3, name3);
+	close(fd2);
+	for (i = fd1; i < CLOEXEC_FD; ++i)
+		close(i);
+
+	if (unlink(name1) || unlink(name2) || unlink(name3))
+		perror_msg_and_fail("unlink");
+
+	char fd_str[sizeof(int) * 3];
+	snprintf(fd_str, sizeof(fd_str), "%d", fd3);
+	char *const args[] = { av[0], fd_str, NULL };
+	fflush(stdout);
+	execv(args[0], args);
+	perror_msg_and_fail("execv: %s", args[0]);
+}
+
+#else
+
+SKIP_MAIN_UNDEFINED("__NR_fchmod")
+
+#endif
@@ -87,7 +87,7 @@ run_strace_merge()
 {
 	rm -f -- "$LOG".[0-9]*
 	run_strace -ff -tt "$@"
-	"$srcdir"/../strace-log-merge "$LOG" > "$LOG" ||
+	../strace-log-merge "$LOG" > "$LOG" ||
 		dump_log_and_fail_with 'strace-log-merge failed with code $?'
 	rm -f -- "$LOG".[0-9]*
 }
@@ -0,0 +1,110 @@
+/*
+ * Check decoding of sendmmsg and recvmmsg vectors of several elements,
+ * the personality of the tracee being converted for each of them.
+ *
+ * Copyright (c) 2017 The strace developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msghdr.h"
+
+#define N_MMH 4
+#define BUF_SIZE 8
+
+static void
+print_mmh(const struct mmsghdr *const mmh, const char *const data,
+	  const unsigned int len)
+{
+	printf("{msg_hdr={msg_name=NULL, msg_namelen=0"
+	       ", msg_iov=[{iov_base=\"%.*s\", iov_len=%u}], msg_iovlen=1"
+	       ", msg_controllen=0, msg_flags=0}, msg_len=%u}",
+	       (int) len, data, (unsigned int) mmh->msg_hdr.msg_iov[0].iov_len,
+	       len);
+}
+
+int
+main(void)
+{
+	static const char *const data[N_MMH] = { "0", "12", "345", "6789" };
+	struct mmsghdr *const w_mmh = tail_alloc(sizeof(*w_mmh) * N_MMH);
+	struct iovec *const w_iov = tail_alloc(sizeof(*w_iov) * N_MMH);
+	struct mmsghdr *const r_mmh = tail_alloc(sizeof(*r_mmh) * N_MMH);
+	struct iovec *const r_iov = tail_alloc(sizeof(*r_iov) * N_MMH);
+	char *const r_buf = tail_alloc(BUF_SIZE * N_MMH);
+	unsigned int i;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds))
+		perror_msg_and_skip("socketpair");
+
+	memset(w_mmh, 0, sizeof(*w_mmh) * N_MMH);
+	memset(r_mmh, 0, sizeof(*r_mmh) * N_MMH);
+	for (i = 0; i < N_MMH; i++) {
+		w_iov[i].iov_base = (void *) data[i];
+		w_iov[i].iov_len = i + 1;
+		w_mmh[i].msg_hdr.msg_iov = &w_iov[i];
+		w_mmh[i].msg_hdr.msg_iovlen = 1;
+
+		r_iov[i].iov_base = r_buf + i * BUF_SIZE;
+		r_iov[i].iov_len = BUF_SIZE;
+		r_mmh[i].msg_hdr.msg_iov = &r_iov[i];
+		r_mmh[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int rc = send_mmsg(fds[1], w_mmh, N_MMH, MSG_DONTWAIT);
+	if (rc < 0)
+		perror_msg_and_skip("sendmmsg");
+	assert(rc == N_MMH);
+
+	printf("sendmmsg(%d, [", fds[1]);
+	for (i = 0; i < N_MMH; i++) {
+		if (i)
+			printf(", ");
+		print_mmh(&w_mmh[i], data[i], i + 1);
+	}
+	printf("], %u, MSG_DONTWAIT) = %d\n", N_MMH, rc);
+
+	rc = recv_mmsg(fds[0], r_mmh, N_MMH, MSG_DONTWAIT, NULL);
+	if (rc < 0)
+		perror_msg_and_skip("recvmmsg");
+	assert(rc == N_MMH);
+
+	printf("recvmmsg(%d, [", fds[0]);
+	for (i = 0; i < N_MMH; i++) {
+		if (i)
+			printf(", ");
+		print_mmh(&r_mmh[i], data[i], i + 1);
+	}
+	printf("], %u, MSG_DONTWAIT, NULL) = %d\n", N_MMH, rc);
+
+	puts("+++ exited with 0 +++");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Check that -yy prints the current addresses of a UDP socket
+ * that is connected again after its details have been cached.
+ *
+ * Copyright (c) 2017 The strace developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define NSOCKS 3
+
+int
+main(void)
+{
+	const struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	struct sockaddr * const sa = tail_alloc(sizeof(addr));
+	socklen_t * const len = tail_alloc(sizeof(socklen_t));
+	int fd[NSOCKS];
+	unsigned int port[NSOCKS];
+	unsigned int i;
+
+	for (i = 0; i < NSOCKS; ++i) {
+		fd[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd[i] < 0)
+			perror_msg_and_skip("socket");
+		const unsigned long inode = inode_of_sockfd(fd[i]);
+		printf("socket(AF_INET, SOCK_DGRAM, IPPROTO_IP) = %d<UDP:[%lu]>\n",
+		       fd[i], inode);
+
+		memcpy(sa, &addr, sizeof(addr));
+		*len = sizeof(addr);
+		if (bind(fd[i], sa, *len))
+			perror_msg_and_skip("bind");
+		printf("bind(%d<UDP:[%lu]>, {sa_family=AF_INET, sin_port=htons(0)"
+		       ", sin_addr=inet_addr(\"127.0.0.1\")}, %u) = 0\n",
+		       fd[i], inode, (unsigned) *len);
+
+		if (getsockname(fd[i], sa, len))
+			perror_msg_and_fail("getsockname");
+		port[i] = ntohs(((struct sockaddr_in *) sa) -> sin_port);
+		printf("getsockname(%d<UDP:[127.0.0.1:%u]>, {sa_family=AF_INET"
+		       ", sin_port=htons(%u), sin_addr=inet_addr(\"127.0.0.1\")}"
+		       ", [%u]) = 0\n",
+		       fd[i], port[i], port[i], (unsigned) *len);
+	}
+
+	/*
+	 * The details of the first socket are cached by now,
+	 * they change every time it is connected.
+	 */
+	for (i = 1; i < NSOCKS; ++i) {
+		memcpy(sa, &addr, sizeof(addr));
+		((struct sockaddr_in *) sa) -> sin_port = htons(port[i]);
+		*len = sizeof(addr);
+		if (connect(fd[0], sa, *len))
+			perror_msg_and_fail("connect");
+		printf("connect(%d<UDP:[127.0.0.1:%u", fd[0], port[0]);
+		if (i > 1)
+			printf("->127.0.0.1:%u", port[i - 1]);
+		printf("]>, {sa_family=AF_INET, sin_port=htons(%u)"
+		       ", sin_addr=inet_addr(\"127.0.0.1\")}, %u) = 0\n",
+		       port[i], (unsigned) *len);
+
+		if (getpeername(fd[0], sa, len))
+			perror_msg_and_fail("getpeername");
+		printf("getpeername(%d<UDP:[127.0.0.1:%u->127.0.0.1:%u]>"
+		       ", {sa_family=AF_INET, sin_port=htons(%u)"
+		       ", sin_addr=inet_addr(\"127.0.0.1\")}, [%u]) = 0\n",
+		       fd[0], port[0], port[i], port[i], (unsigned) *len);
+	}
+
+	assert(close(fd[0]) == 0);
+	printf("close(%d<UDP:[127.0.0.1:%u->127.0.0.1:%u]>) = 0\n",
+	       fd[0], port[0], port[NSOCKS - 1]);
+	for (i = 1; i < NSOCKS; ++i) {
+		assert(close(fd[i]) == 0);
+		printf("close(%d<UDP:[127.0.0.1:%u]>) = 0\n", fd[i], port[i]);
+	}
+
+	puts("+++ exited with 0 +++");
+	return 0;
+}
@@ -199,7 +199,7 @@ SYS_FUNC(adjtimex)
 const char *
 sprintclockname(int clockid)
 {
-	static char buf[sizeof("MAKE_PROCESS_CPUCLOCK(1234567890,"
+	static __thread char buf[sizeof("MAKE_PROCESS_CPUCLOCK(1234567890,"
 		"1234567890 /* CPUCLOCK_??? */)")];
 	ssize_t pos = 0;
 
@@ -26,7 +26,9 @@
 
 #include "defs.h"
 #include <limits.h>
+#include <sys/mman.h>
 #include <libunwind-ptrace.h>
+#include "syscall.h"
 
 #ifdef _LARGEFILE64_SOURCE
 # ifdef HAVE_FOPEN64
@@ -57,39 +59,147 @@ struct mmap_cache_t {
 	unsigned long start_addr;
 	unsigned long end_addr;
 	unsigned long mmap_offset;
-	char *binary_filename;
+	const char *binary_filename;
 };
 
 /*
- * Type used in stacktrace walker
+ * Frames of a stack trace, walked when the trace is printed
+ * or captured on entering a syscall (STACKTRACE_CAPTURE_ON_ENTER).
  */
-typedef void (*call_action_fn)(void *data,
-			       const char *binary_filename,
-			       const char *symbol_name,
-			       unw_word_t function_offset,
-			       unsigned long true_offset);
-typedef void (*error_action_fn)(void *data,
-				const char *error,
-				unsigned long true_offset);
+struct stack_trace {
+	struct stack_frame *frames;
+	unsigned int nframes;
+	unsigned int allocated;
+};
+
+/* Ids of the stack table entries printed to an output (-K) */
+struct stack_ids_printed {
+	unsigned char *bits;
+	unsigned long size;
+};
+
+struct unwind_queue {
+	struct stack_trace stack;
+	/* The stack holds the frames captured on entering the syscall */
+	bool captured;
+	/* With -ff every process has its own output */
+	struct stack_ids_printed printed;
+};
+
+/*
+ * The executable mappings of a thread group, shared by its threads.
+ * The cache is read from /proc/ID/maps once and then kept up to date
+ * from the results of the syscalls that change memory mappings;
+ * it is re-read only after the changes that cannot be followed,
+ * e.g. execve.
+ */
+struct mmap_cache {
+	struct mmap_cache *next;
+	int tgid;
+	unsigned int refcount;
+	/* The entries have to be re-read from /proc/ID/maps */
+	bool stale;
+	/* The entries have been changed since they were read */
+	bool updated;
+	/* The name of the process for -c, read again after execve */
+	const char *comm;
+	struct mmap_cache_t *entries;
+	unsigned int size;
+	unsigned int allocated;
+};
+
+/* Names of the mapped files and processes, kept until strace exits */
+struct filename_entry {
+	struct filename_entry *hash_next;
+	char name[];
+};
+
+#define FILENAME_TABLE_SIZE 1024U
+#define FILENAME_TABLE_MASK (FILENAME_TABLE_SIZE - 1)
+
+/*
+ * Symbols of stack frames are cached by the mapped file and the offset
+ * in it, so that the lookups are shared by all processes mapping the file.
+ */
+struct symbol_cache_entry {
+	struct symbol_cache_entry *hash_next;
+	const char *binary_filename;
+	unsigned long true_offset;
+	unw_word_t function_offset;
+	char *symbol_name;
+};
+
+#define SYMBOL_CACHE_SIZE 16384U
+#define SYMBOL_CACHE_MASK (SYMBOL_CACHE_SIZE - 1)
+
+/*
+ * Distinct stack traces printed with -K or counted with -c, numbered
+ * from 1.  A trace is identified by the files and offsets of its frames,
+ * so that the same code path has the same id in all processes.
+ */
+struct stack_table_entry {
+	struct stack_table_entry *hash_next;
+	unsigned long id;
+	uint32_t hash;
+	unsigned int nframes;
+	struct stack_frame frames[];
+};
+
+#define STACK_TABLE_SIZE 16384U
+#define STACK_TABLE_MASK (STACK_TABLE_SIZE - 1)
+
+/* Stack traces are cut after this many frames */
+#define STACK_DEPTH_MAX 256
 
 /*
- * Type used in stacktrace capturing
+ * A frame record of -U fp: the frame pointer of the caller,
+ * followed by the return address to it.
  */
-struct call_t {
-       struct call_t* next;
-       char *output_line;
+#define FP_RECORD_SIZE (2 * sizeof(unsigned long))
+
+struct fp_walk {
+	/* The stack, read in chunks */
+	struct umove_array stack;
+	char *symbol_name;
+	size_t symbol_name_size;
 };
 
-struct queue_t {
-       struct call_t *tail;
-       struct call_t *head;
+/*
+ * Wall clock time of the syscalls counted by -c, summed by process,
+ * stack trace and syscall: the time the process was blocked in them.
+ */
+struct offcpu_entry {
+	struct offcpu_entry *hash_next;
+	const char *comm;
+	int pid;
+	const struct stack_table_entry *stack;
+	const char *sys_name;
+	unsigned long long usec;
 };
 
-static void queue_print(struct queue_t *queue);
-static void delete_mmap_cache(struct tcb *tcp, const char *caller);
+#define OFFCPU_TABLE_SIZE 4096U
+#define OFFCPU_TABLE_MASK (OFFCPU_TABLE_SIZE - 1)
+
+static void print_stack_trace(struct tcb *tcp, const struct stack_trace *stack);
+static void mmap_cache_release(struct tcb *tcp);
 
 static unw_addr_space_t libunwind_as;
-static unsigned int mmap_cache_generation;
+static struct mmap_cache *mmap_caches;
+static struct filename_entry *filename_table[FILENAME_TABLE_SIZE];
+static struct symbol_cache_entry *symbol_cache[SYMBOL_CACHE_SIZE];
+static struct stack_table_entry *stack_table[STACK_TABLE_SIZE];
+static unsigned long stack_table_ids;
+static struct offcpu_entry *offcpu_table[OFFCPU_TABLE_SIZE];
+static unsigned int offcpu_entries;
+/* Without -ff all processes share the output */
+static struct stack_ids_printed stack_ids_printed;
+
+unsigned long unwind_cache_updates;
+unsigned long unwind_cache_rebuilds;
+unsigned long unwind_symbol_hits;
+unsigned long unwind_symbol_misses;
+unsigned long unwind_fp_walks;
+unsigned long unwind_fp_fallbacks;
 
 void
 unwind_init(void)
@@ -107,41 +217,183 @@ unwind_tcb_init(struct tcb *tcp)
 	if (!tcp->libunwind_ui)
 		die_out_of_memory();
 
-	tcp->queue = xmalloc(sizeof(*tcp->queue));
-	tcp->queue->head = NULL;
-	tcp->queue->tail = NULL;
+	tcp->queue = xcalloc(1, sizeof(*tcp->queue));
 }
 
 void
 unwind_tcb_fin(struct tcb *tcp)
 {
-	queue_print(tcp->queue);
+	/* The formatters with print_stack have finished the record */
+	if (tcp->queue->captured && !s_printer_cur->print_stack)
+		print_stack_trace(tcp, &tcp->queue->stack);
+	free(tcp->queue->stack.frames);
+	free(tcp->queue->printed.bits);
 	free(tcp->queue);
 	tcp->queue = NULL;
 
-	delete_mmap_cache(tcp, __FUNCTION__);
+	mmap_cache_release(tcp);
 
 	_UPT_destroy(tcp->libunwind_ui);
 	tcp->libunwind_ui = NULL;
 }
 
+static uint32_t
+str_hash(const char *str)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261U;
+
+	for (p = (const unsigned char *) str; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	return h;
+}
+
+static uint32_t
+ptr_hash(const void *ptr, unsigned long offset)
+{
+	return ((uintptr_t) ptr ^ offset) * 0x9e3779b97f4a7c15ULL >> 32;
+}
+
+static const char *
+intern_name(const char *name)
+{
+	struct filename_entry **p;
+	struct filename_entry *e;
+	size_t len;
+
+	for (p = &filename_table[str_hash(name) & FILENAME_TABLE_MASK];
+	     (e = *p); p = &e->hash_next) {
+		if (!strcmp(e->name, name))
+			return e->name;
+	}
+
+	len = strlen(name) + 1;
+	e = xmalloc(sizeof(*e) + len);
+	memcpy(e->name, name, len);
+	e->hash_next = NULL;
+	*p = e;
+
+	return e->name;
+}
+
+static struct mmap_cache *
+mmap_cache_get(struct tcb *tcp)
+{
+	struct mmap_cache *c;
+	unsigned int threads;
+	int tgid;
+
+	if (tcp->mmap_cache)
+		return tcp->mmap_cache;
+
+	read_proc_status(tcp->pid, &tgid, &threads);
+
+	for (c = mmap_caches; c; c = c->next)
+		if (c->tgid == tgid)
+			break;
+
+	if (!c) {
+		c = xcalloc(1, sizeof(*c));
+		c->tgid = tgid;
+		c->stale = true;
+		c->next = mmap_caches;
+		mmap_caches = c;
+	}
+
+	c->refcount++;
+	tcp->mmap_cache = c;
+
+	return c;
+}
+
+static void
+mmap_cache_release(struct tcb *tcp)
+{
+	struct mmap_cache *c = tcp->mmap_cache;
+	struct mmap_cache **p;
+
+	if (!c)
+		return;
+	tcp->mmap_cache = NULL;
+
+	if (--c->refcount)
+		return;
+
+	DPRINTF("tgid=%d, cache=%p, size=%u", "cache-delete",
+		c->tgid, c, c->size);
+
+	for (p = &mmap_caches; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+
+	free(c->entries);
+	free(c);
+}
+
+/* Inserts an uninitialized entry at POS. */
+static struct mmap_cache_t *
+mmap_cache_insert(struct mmap_cache *c, unsigned int pos)
+{
+	if (c->size >= c->allocated) {
+		/* start with a small array and then expand it */
+		c->allocated = c->allocated ? c->allocated * 2 : 16;
+		c->entries = xreallocarray(c->entries, c->allocated,
+					   sizeof(*c->entries));
+	}
+	memmove(&c->entries[pos + 1], &c->entries[pos],
+		(c->size - pos) * sizeof(*c->entries));
+	c->size++;
+
+	return &c->entries[pos];
+}
+
+/* Returns the index of the first entry that ends above ADDR. */
+static unsigned int
+mmap_cache_search(const struct mmap_cache *c, unsigned long addr)
+{
+	unsigned int lower = 0;
+	unsigned int upper = c->size;
+
+	while (lower < upper) {
+		unsigned int mid = (lower + upper) / 2;
+
+		if (c->entries[mid].end_addr <= addr)
+			lower = mid + 1;
+		else
+			upper = mid;
+	}
+
+	return lower;
+}
+
+static struct mmap_cache_t *
+mmap_cache_find(const struct mmap_cache *c, unsigned long addr)
+{
+	unsigned int i = mmap_cache_search(c, addr);
+
+	if (i < c->size && c->entries[i].start_addr <= addr)
+		return &c->entries[i];
+	return NULL;
+}
+
 /*
- * caching of /proc/ID/maps for each process to speed up stack tracing
- *
- * The cache must be refreshed after syscalls that affect memory mappings,
- * e.g. mmap, mprotect, munmap, execve.
+ * caching of /proc/ID/maps for each thread group to speed up stack tracing
  */
 static void
-build_mmap_cache(struct tcb* tcp)
+build_mmap_cache(struct tcb *tcp, struct mmap_cache *c, bool flush)
 {
 	FILE *fp;
-	struct mmap_cache_t *cache_head;
-	/* start with a small dynamically-allocated array and then expand it */
-	size_t cur_array_size = 10;
 	char filename[sizeof("/proc/4294967296/maps")];
 	char buffer[PATH_MAX + 80];
 
-	unw_flush_cache(libunwind_as, 0, 0);
+	if (flush)
+		unw_flush_cache(libunwind_as, 0, 0);
+
+	c->size = 0;
+	c->stale = false;
+	c->updated = false;
+	unwind_cache_rebuilds++;
 
 	sprintf(filename, "/proc/%u/maps", tcp->pid);
 	fp = fopen_for_input(filename, "r");
@@ -150,8 +402,6 @@ build_mmap_cache(struct tcb* tcp)
 		return;
 	}
 
-	cache_head = xcalloc(cur_array_size, sizeof(*cache_head));
-
 	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
 		struct mmap_cache_t *entry;
 		unsigned long start_addr, end_addr, mmap_offset;
@@ -176,8 +426,8 @@ build_mmap_cache(struct tcb* tcp)
 		 * sanity check to make sure that we're storing
 		 * non-overlapping regions in ascending order
 		 */
-		if (tcp->mmap_cache_size > 0) {
-			entry = &cache_head[tcp->mmap_cache_size - 1];
+		if (c->size > 0) {
+			entry = &c->entries[c->size - 1];
 			if (entry->start_addr == start_addr &&
 			    entry->end_addr == end_addr) {
 				/* duplicate entry, e.g. [vsyscall] */
@@ -191,90 +441,229 @@ build_mmap_cache(struct tcb* tcp)
 			}
 		}
 
-		if (tcp->mmap_cache_size >= cur_array_size) {
-			cur_array_size *= 2;
-			cache_head = xreallocarray(cache_head, cur_array_size,
-						   sizeof(*cache_head));
-		}
-
-		entry = &cache_head[tcp->mmap_cache_size];
+		entry = mmap_cache_insert(c, c->size);
 		entry->start_addr = start_addr;
 		entry->end_addr = end_addr;
 		entry->mmap_offset = mmap_offset;
-		entry->binary_filename = xstrdup(binary_path);
-		tcp->mmap_cache_size++;
+		entry->binary_filename = intern_name(binary_path);
 	}
 	fclose(fp);
-	tcp->mmap_cache = cache_head;
-	tcp->mmap_cache_generation = mmap_cache_generation;
 
-	DPRINTF("tgen=%u, ggen=%u, tcp=%p, cache=%p",
-		"cache-build",
-		tcp->mmap_cache_generation,
-		mmap_cache_generation,
-		tcp, tcp->mmap_cache);
+	DPRINTF("tgid=%d, tcp=%p, cache=%p, size=%u", "cache-build",
+		c->tgid, tcp, c, c->size);
 }
 
-/* deleting the cache */
+static bool
+rebuild_cache_if_invalid(struct tcb *tcp)
+{
+	struct mmap_cache *c = mmap_cache_get(tcp);
+
+	if (c->stale) {
+		c->comm = NULL;
+		build_mmap_cache(tcp, c, true);
+	}
+
+	return c->size > 0;
+}
+
+/* Removes the range [LO, HI) from the cache, splitting entries as needed. */
 static void
-delete_mmap_cache(struct tcb *tcp, const char *caller)
+mmap_cache_punch(struct mmap_cache *c, unsigned long lo, unsigned long hi)
 {
-	unsigned int i;
+	unsigned int i = mmap_cache_search(c, lo);
+	unsigned int j;
+	struct mmap_cache_t *entry;
 
-	DPRINTF("tgen=%u, ggen=%u, tcp=%p, cache=%p, caller=%s",
-		"cache-delete",
-		tcp->mmap_cache_generation,
-		mmap_cache_generation,
-		tcp, tcp->mmap_cache, caller);
+	if (i >= c->size || c->entries[i].start_addr >= hi)
+		return;
+
+	unw_flush_cache(libunwind_as, lo, hi);
+
+	entry = &c->entries[i];
+	if (entry->start_addr < lo) {
+		if (entry->end_addr > hi) {
+			struct mmap_cache_t *tail = mmap_cache_insert(c, i + 1);
 
-	for (i = 0; i < tcp->mmap_cache_size; i++) {
-		free(tcp->mmap_cache[i].binary_filename);
-		tcp->mmap_cache[i].binary_filename = NULL;
+			entry = &c->entries[i];
+			*tail = *entry;
+			tail->mmap_offset += hi - entry->start_addr;
+			tail->start_addr = hi;
+			entry->end_addr = lo;
+			return;
+		}
+		entry->end_addr = lo;
+		i++;
 	}
-	free(tcp->mmap_cache);
-	tcp->mmap_cache = NULL;
-	tcp->mmap_cache_size = 0;
+
+	j = i;
+	while (j < c->size && c->entries[j].end_addr <= hi)
+		j++;
+
+	if (j < c->size && c->entries[j].start_addr < hi) {
+		entry = &c->entries[j];
+		entry->mmap_offset += hi - entry->start_addr;
+		entry->start_addr = hi;
+	}
+
+	memmove(&c->entries[i], &c->entries[j],
+		(c->size - j) * sizeof(*c->entries));
+	c->size -= j - i;
 }
 
+/* Returns true if every page in [LO, HI) is cached. */
 static bool
-rebuild_cache_if_invalid(struct tcb *tcp, const char *caller)
+mmap_cache_covers(const struct mmap_cache *c, unsigned long lo, unsigned long hi)
 {
-	if ((tcp->mmap_cache_generation != mmap_cache_generation)
-	    && tcp->mmap_cache)
-		delete_mmap_cache(tcp, caller);
+	unsigned int i;
 
-	if (!tcp->mmap_cache)
-		build_mmap_cache(tcp);
+	for (i = mmap_cache_search(c, lo); i < c->size && lo < hi; i++) {
+		if (c->entries[i].start_addr > lo)
+			return false;
+		lo = c->entries[i].end_addr;
+	}
 
-	if (!tcp->mmap_cache || !tcp->mmap_cache_size)
-		return false;
-	else
-		return true;
+	return lo >= hi;
 }
 
+static void
+mmap_cache_add(struct tcb *tcp, struct mmap_cache *c, unsigned long addr,
+	       unsigned long len, int fd, unsigned long long offset)
+{
+	char path[PATH_MAX];
+	struct mmap_cache_t *entry;
+
+	mmap_cache_punch(c, addr, addr + len);
+
+	if (getfdpath(tcp, fd, path, sizeof(path)) < 0) {
+		c->stale = true;
+		return;
+	}
+
+	entry = mmap_cache_insert(c, mmap_cache_search(c, addr));
+	entry->start_addr = addr;
+	entry->end_addr = addr + len;
+	entry->mmap_offset = offset;
+	entry->binary_filename = intern_name(path);
+}
+
+static unsigned long
+page_align(unsigned long len)
+{
+	unsigned long page_size = get_pagesize();
+
+	return (len + page_size - 1) & -page_size;
+}
+
+/*
+ * Applies the result of a syscall that affects memory mappings,
+ * e.g. mmap, mprotect, munmap, execve, to the cache.
+ */
 void
-unwind_cache_invalidate(struct tcb* tcp)
+unwind_cache_update(struct tcb *tcp)
 {
+	struct mmap_cache *c;
+	unsigned long addr, len, old_len;
+	unsigned long long offset;
+	unsigned int i;
+
 #if SUPPORTED_PERSONALITIES > 1
 	if (tcp->currpers != DEFAULT_PERSONALITY) {
 		/* disable strack trace */
 		return;
 	}
 #endif
-	mmap_cache_generation++;
-	DPRINTF("tgen=%u, ggen=%u, tcp=%p, cache=%p", "increment",
-		tcp->mmap_cache_generation,
-		mmap_cache_generation,
-		tcp,
-		tcp->mmap_cache);
+	if (syserror(tcp))
+		return;
+
+	c = mmap_cache_get(tcp);
+	if (c->stale)
+		return;
+
+	switch (tcp->s_ent->sen) {
+	case SEN_mmap:
+#if HAVE_STRUCT_TCB_EXT_ARG
+		offset = tcp->ext_arg[5];
+#else
+		offset = (unsigned long) tcp->u_arg[5];
+#endif
+		goto mmap;
+	case SEN_mmap_pgoff:
+		offset = (unsigned long) tcp->u_arg[5];
+		offset *= get_pagesize();
+		goto mmap;
+	case SEN_mmap_4koff:
+		offset = (unsigned long) tcp->u_arg[5];
+		offset <<= 12;
+	mmap:
+		addr = tcp->u_rval;
+		len = page_align(tcp->u_arg[1]);
+		if ((tcp->u_arg[2] & PROT_EXEC) &&
+		    !(tcp->u_arg[3] & MAP_ANONYMOUS))
+			mmap_cache_add(tcp, c, addr, len, tcp->u_arg[4],
+				       offset);
+		else
+			mmap_cache_punch(c, addr, addr + len);
+		break;
+	case SEN_munmap:
+		addr = tcp->u_arg[0];
+		len = page_align(tcp->u_arg[1]);
+		mmap_cache_punch(c, addr, addr + len);
+		break;
+	case SEN_mprotect:
+		addr = tcp->u_arg[0];
+		len = page_align(tcp->u_arg[1]);
+		if (!(tcp->u_arg[2] & PROT_EXEC))
+			mmap_cache_punch(c, addr, addr + len);
+		else if (!mmap_cache_covers(c, addr, addr + len))
+			c->stale = true;
+		break;
+	case SEN_mremap:
+		addr = tcp->u_arg[0];
+		old_len = page_align(tcp->u_arg[1]);
+		len = page_align(tcp->u_arg[2]);
+		if ((unsigned long) tcp->u_rval == addr && len <= old_len) {
+			mmap_cache_punch(c, addr + len, addr + old_len);
+			break;
+		}
+		/* moving or growing a cached mapping is not followed */
+		i = mmap_cache_search(c, addr);
+		if (i < c->size && c->entries[i].start_addr < addr + old_len) {
+			c->stale = true;
+			break;
+		}
+		addr = tcp->u_rval;
+		mmap_cache_punch(c, addr, addr + len);
+		break;
+	case SEN_brk:
+		break;
+	default:
+		c->stale = true;
+		break;
+	}
+
+	if (c->stale) {
+		DPRINTF("tgid=%d, tcp=%p, cache=%p, syscall=%s",
+			"cache-invalidate", c->tgid, tcp, c,
+			tcp->s_ent->sys_name);
+	} else {
+		c->updated = true;
+		unwind_cache_updates++;
+	}
 }
 
+/*
+ * Looks up the symbol at CURSOR, or at IP of TCP if there is no cursor,
+ * as the stack of -U fp is not walked by libunwind.
+ */
 static void
-get_symbol_name(unw_cursor_t *cursor, char **name,
-		size_t *size, unw_word_t *offset)
+get_symbol_name(struct tcb *tcp, unw_cursor_t *cursor, unsigned long ip,
+		char **name, size_t *size, unw_word_t *offset)
 {
 	for (;;) {
-		int rc = unw_get_proc_name(cursor, *name, *size, offset);
+		int rc = cursor
+			? unw_get_proc_name(cursor, *name, *size, offset)
+			: _UPT_get_proc_name(libunwind_as, ip, *name, *size,
+					     offset, tcp->libunwind_ui);
 		if (rc == 0)
 			break;
 		if (rc != -UNW_ENOMEM) {
@@ -287,50 +676,146 @@ get_symbol_name(unw_cursor_t *cursor, char **name,
 	}
 }
 
+/*
+ * Returns the link of the symbol cache chain that points to the entry
+ * of the offset in the file, or to NULL if it is not cached.
+ */
+static struct symbol_cache_entry **
+symbol_cache_find(const char *binary_filename, unsigned long true_offset)
+{
+	struct symbol_cache_entry **p;
+	struct symbol_cache_entry *e;
+	uint32_t h = ptr_hash(binary_filename, true_offset);
+
+	for (p = &symbol_cache[h & SYMBOL_CACHE_MASK]; (e = *p);
+	     p = &e->hash_next) {
+		if (e->true_offset == true_offset &&
+		    e->binary_filename == binary_filename)
+			break;
+	}
+
+	return p;
+}
+
+/* Looks up the symbol at CURSOR or IP and adds it to the cache at P. */
+static struct symbol_cache_entry *
+symbol_cache_add(struct symbol_cache_entry **p, struct tcb *tcp,
+		 unw_cursor_t *cursor, unsigned long ip,
+		 const char *binary_filename, unsigned long true_offset,
+		 char **symbol_name, size_t *symbol_name_size)
+{
+	struct symbol_cache_entry *e;
+
+	unwind_symbol_misses++;
+	e = xmalloc(sizeof(*e));
+	get_symbol_name(tcp, cursor, ip, symbol_name, symbol_name_size,
+			&e->function_offset);
+	e->binary_filename = binary_filename;
+	e->true_offset = true_offset;
+	e->symbol_name = xstrdup(*symbol_name);
+	e->hash_next = NULL;
+	*p = e;
+
+	return e;
+}
+
+static const struct symbol_cache_entry *
+symbol_cache_get(struct tcb *tcp, unw_cursor_t *cursor,
+		 const char *binary_filename, unsigned long true_offset,
+		 char **symbol_name, size_t *symbol_name_size)
+{
+	struct symbol_cache_entry **p =
+		symbol_cache_find(binary_filename, true_offset);
+
+	if (*p) {
+		unwind_symbol_hits++;
+		return *p;
+	}
+
+	return symbol_cache_add(p, tcp, cursor, 0, binary_filename,
+				true_offset, symbol_name, symbol_name_size);
+}
+
+static struct stack_frame *
+stack_trace_push(struct stack_trace *stack)
+{
+	struct stack_frame *frame;
+
+	if (stack->nframes >= stack->allocated) {
+		stack->allocated = stack->allocated ? stack->allocated * 2 : 32;
+		stack->frames = xreallocarray(stack->frames, stack->allocated,
+					      sizeof(*stack->frames));
+	}
+
+	frame = &stack->frames[stack->nframes++];
+	memset(frame, 0, sizeof(*frame));
+
+	return frame;
+}
+
+/*
+ * Adds the frame of IP to STACK, without the symbol.
+ * Returns NULL if IP is not in an executable mapping.
+ */
+static struct stack_frame *
+stack_trace_push_ip(struct tcb *tcp, struct stack_trace *stack,
+		    unsigned long ip)
+{
+	struct mmap_cache *c = tcp->mmap_cache;
+	struct mmap_cache_t *cur_mmap_cache;
+	struct stack_frame *frame;
+
+	cur_mmap_cache = mmap_cache_find(c, ip);
+	/*
+	 * The mapping may have been changed in a way the updates
+	 * do not follow, re-read the cache before giving up.
+	 */
+	if (!cur_mmap_cache && ip && c->updated) {
+		build_mmap_cache(tcp, c, false);
+		cur_mmap_cache = mmap_cache_find(c, ip);
+	}
+
+	if (!cur_mmap_cache)
+		return NULL;
+
+	frame = stack_trace_push(stack);
+	frame->binary_filename = cur_mmap_cache->binary_filename;
+	frame->true_offset = ip - cur_mmap_cache->start_addr +
+		cur_mmap_cache->mmap_offset;
+
+	return frame;
+}
+
 static int
-print_stack_frame(struct tcb *tcp,
-		  call_action_fn call_action,
-		  error_action_fn error_action,
-		  void *data,
-		  unw_cursor_t *cursor,
-		  char **symbol_name,
-		  size_t *symbol_name_size)
+walk_stack_frame(struct tcb *tcp,
+		 struct stack_trace *stack,
+		 unw_cursor_t *cursor,
+		 char **symbol_name,
+		 size_t *symbol_name_size)
 {
+	struct stack_frame *frame;
 	unw_word_t ip;
-	int lower = 0;
-	int upper = (int) tcp->mmap_cache_size - 1;
 
 	if (unw_get_reg(cursor, UNW_REG_IP, &ip) < 0) {
 		perror_msg("Can't walk the stack of process %d", tcp->pid);
 		return -1;
 	}
 
-	while (lower <= upper) {
-		struct mmap_cache_t *cur_mmap_cache;
-		int mid = (upper + lower) / 2;
-
-		cur_mmap_cache = &tcp->mmap_cache[mid];
-
-		if (ip >= cur_mmap_cache->start_addr &&
-		    ip < cur_mmap_cache->end_addr) {
-			unsigned long true_offset;
-			unw_word_t function_offset;
+	frame = stack_trace_push_ip(tcp, stack, ip);
+	if (frame) {
+		/* -kk leaves the symbols to be looked up by strace-symbolize */
+		if (stack_trace_enabled == 1) {
+			const struct symbol_cache_entry *symbol =
+				symbol_cache_get(tcp, cursor,
+						 frame->binary_filename,
+						 frame->true_offset,
+						 symbol_name,
+						 symbol_name_size);
 
-			get_symbol_name(cursor, symbol_name, symbol_name_size,
-					&function_offset);
-			true_offset = ip - cur_mmap_cache->start_addr +
-				cur_mmap_cache->mmap_offset;
-			call_action(data,
-				    cur_mmap_cache->binary_filename,
-				    *symbol_name,
-				    function_offset,
-				    true_offset);
-			return 0;
+			frame->symbol_name = symbol->symbol_name;
+			frame->function_offset = symbol->function_offset;
 		}
-		else if (ip < cur_mmap_cache->start_addr)
-			upper = mid - 1;
-		else
-			lower = mid + 1;
+		return 0;
 	}
 
 	/*
@@ -338,19 +823,189 @@ print_stack_frame(struct tcb *tcp,
 	 * after a set_tid_address syscall
 	 * unw_get_reg returns IP == 0
 	 */
-	if(ip)
-		error_action(data, "unexpected_backtracing_error", ip);
+	if (ip) {
+		frame = stack_trace_push(stack);
+		frame->error = "unexpected_backtracing_error";
+		frame->true_offset = ip;
+	}
 	return -1;
 }
 
+/*
+ * Adds the frame of IP to STACK for -U fp, with its symbol.
+ * The symbols of CALLER frames are looked up by the address before
+ * the return address, as libunwind does it.  Returns false if IP
+ * is not in an executable mapping.
+ */
+static bool
+fp_walk_push(struct tcb *tcp, struct fp_walk *w, struct stack_trace *stack,
+	     unsigned long ip, bool caller)
+{
+	struct stack_frame *frame = stack_trace_push_ip(tcp, stack, ip);
+	struct symbol_cache_entry **p;
+	struct symbol_cache_entry *e;
+
+	if (!frame)
+		return false;
+	if (stack_trace_enabled != 1)
+		return true;
+
+	p = symbol_cache_find(frame->binary_filename, frame->true_offset);
+	if (*p) {
+		unwind_symbol_hits++;
+		e = *p;
+	} else {
+		e = symbol_cache_add(p, tcp, NULL, ip - caller,
+				     frame->binary_filename, frame->true_offset,
+				     &w->symbol_name, &w->symbol_name_size);
+		if (caller && e->symbol_name[0] != '\0')
+			e->function_offset++;
+	}
+
+	frame->symbol_name = e->symbol_name;
+	frame->function_offset = e->function_offset;
+
+	return true;
+}
+
+/* A syscall stop of a wrapper without a frame is this close to its start */
+#define FP_LEAF_SIZE 64
+
+/*
+ * Returns true if TOP, the word on the top of the stack at a syscall stop
+ * at PC, is the return address of a call to a syscall wrapper that has
+ * pushed nothing on the stack: the call before TOP, directly, through
+ * the GOT or through a PLT entry, is to a function that starts at most
+ * FP_LEAF_SIZE bytes before PC, and PC follows the syscall instruction.
+ */
+static bool
+fp_leaf_return(struct tcb *tcp, unsigned long pc, unsigned long top)
+{
+#ifdef X86_64
+	static const unsigned char endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+	const struct mmap_cache_t *m;
+	unsigned char code[11];
+	unsigned long target;
+	unsigned int i = 0;
+	int32_t disp;
+
+	if (current_personality != 0)
+		return false;
+
+	/* syscall */
+	if (umoven(tcp, pc - 2, 2, code) || code[0] != 0x0f || code[1] != 0x05)
+		return false;
+
+	m = mmap_cache_find(tcp->mmap_cache, top);
+	if (!m || top - 6 < m->start_addr || umoven(tcp, top - 6, 6, code))
+		return false;
+
+	if (code[1] == 0xe8) {
+		/* call rel32 */
+		memcpy(&disp, code + 2, sizeof(disp));
+		target = top + disp;
+	} else if (code[0] == 0xff && code[1] == 0x15) {
+		/* call *disp32(%rip) */
+		memcpy(&disp, code + 2, sizeof(disp));
+		if (umoven(tcp, top + disp, sizeof(target), &target))
+			return false;
+	} else {
+		return false;
+	}
+
+	/* A PLT entry: [endbr64] [bnd] jmp *disp32(%rip) */
+	if (!umoven(tcp, target, sizeof(code), code)) {
+		if (!memcmp(code, endbr64, sizeof(endbr64)))
+			i += sizeof(endbr64);
+		if (code[i] == 0xf2)
+			i++;
+		if (code[i] == 0xff && code[i + 1] == 0x25) {
+			memcpy(&disp, code + i + 2, sizeof(disp));
+			if (umoven(tcp, target + i + 6 + disp,
+				   sizeof(target), &target))
+				return false;
+		}
+	}
+
+	return target <= pc - 2 && pc - target <= FP_LEAF_SIZE;
+#else
+	return false;
+#endif
+}
+
+/*
+ * -U fp: walks the chain of frame pointers, reading the stack
+ * with process_vm_readv in large chunks instead of a ptrace request
+ * per word.  The chain ends where the frame pointer does not point
+ * up the stack: the outermost frame, e.g. _start, clears it, and code
+ * built without frame pointers, e.g. the startup code of the C library,
+ * leaves anything in it.  Returns false if the syscall has not been
+ * made by a wrapper without a frame of its own, or the chain looks
+ * broken: there is no frame record at all, or a return address is not
+ * in an executable mapping.
+ */
+static bool
+stacktrace_walk_fp(struct tcb *tcp, struct stack_trace *stack)
+{
+	struct fp_walk w = { .symbol_name_size = 40 };
+	unsigned long pc, sp, fp;
+	const unsigned long *words;
+	unsigned int depth;
+	bool walked = false;
+
+	stack->nframes = 0;
+	if (!get_frame_regs(tcp, &pc, &sp, &fp))
+		return false;
+
+	w.symbol_name = xmalloc(w.symbol_name_size);
+
+	if (!fp_walk_push(tcp, &w, stack, pc, false))
+		goto out;
+
+	/*
+	 * Syscall wrappers seldom set up a frame of their own: the frame
+	 * pointer is still that of their caller, and the return address
+	 * to the caller is on the top of the stack.  Anything else,
+	 * or a word there that cannot be verified to be that address,
+	 * is left to libunwind.
+	 */
+	words = umove_array_elem(tcp, &w.stack, sp, -1UL, FP_RECORD_SIZE);
+	if (!words || !fp_leaf_return(tcp, pc, words[0]) ||
+	    !fp_walk_push(tcp, &w, stack, words[0], true))
+		goto out;
+
+	for (depth = 2; depth < STACK_DEPTH_MAX; depth++) {
+		words = fp < sp || fp % sizeof(long) ? NULL
+			: umove_array_elem(tcp, &w.stack, fp, -1UL,
+					   FP_RECORD_SIZE);
+		if (!words) {
+			walked = depth > 2;
+			break;
+		}
+
+		if (!fp_walk_push(tcp, &w, stack, words[1], true))
+			break;
+
+		sp = fp + FP_RECORD_SIZE;
+		fp = words[0];
+	}
+	if (depth >= STACK_DEPTH_MAX) {
+		stack_trace_push(stack)->error = "too many stack frames";
+		walked = true;
+	}
+
+ out:
+	umove_array_free(&w.stack);
+	free(w.symbol_name);
+
+	return walked;
+}
+
 /*
  * walking the stack
  */
 static void
-stacktrace_walk(struct tcb *tcp,
-		call_action_fn call_action,
-		error_action_fn error_action,
-		void *data)
+stacktrace_walk(struct tcb *tcp, struct stack_trace *stack)
 {
 	char *symbol_name;
 	size_t symbol_name_size = 40;
@@ -359,27 +1014,112 @@ stacktrace_walk(struct tcb *tcp,
 
 	if (!tcp->mmap_cache)
 		error_msg_and_die("bug: mmap_cache is NULL");
-	if (tcp->mmap_cache_size == 0)
+	if (tcp->mmap_cache->size == 0)
 		error_msg_and_die("bug: mmap_cache is empty");
 
+	if (stack_trace_fp) {
+		if (stacktrace_walk_fp(tcp, stack)) {
+			unwind_fp_walks++;
+			return;
+		}
+		unwind_fp_fallbacks++;
+		DPRINTF("tcp=%p, frames=%u", "fp-fallback",
+			tcp, stack->nframes);
+	}
+
+	stack->nframes = 0;
 	symbol_name = xmalloc(symbol_name_size);
 
 	if (unw_init_remote(&cursor, libunwind_as, tcp->libunwind_ui) < 0)
 		perror_msg_and_die("Can't initiate libunwind");
 
-	for (stack_depth = 0; stack_depth < 256; ++stack_depth) {
-		if (print_stack_frame(tcp, call_action, error_action, data,
-				&cursor, &symbol_name, &symbol_name_size) < 0)
+	for (stack_depth = 0; stack_depth < STACK_DEPTH_MAX; ++stack_depth) {
+		if (walk_stack_frame(tcp, stack, &cursor,
+				     &symbol_name, &symbol_name_size) < 0)
 			break;
 		if (unw_step(&cursor) <= 0)
 			break;
 	}
-	if (stack_depth >= 256)
-		error_action(data, "too many stack frames", 0);
+	if (stack_depth >= STACK_DEPTH_MAX)
+		stack_trace_push(stack)->error = "too many stack frames";
 
 	free(symbol_name);
 }
 
+/* Returns the stack table entry of STACK, adding it if needed. */
+static const struct stack_table_entry *
+stack_table_get(const struct stack_trace *stack)
+{
+	struct stack_table_entry **p;
+	struct stack_table_entry *e;
+	uint32_t h = stack->nframes;
+	unsigned int i;
+
+	for (i = 0; i < stack->nframes; i++) {
+		const struct stack_frame *frame = &stack->frames[i];
+
+		h = h * 31 + ptr_hash(frame->error ? frame->error
+					: frame->binary_filename,
+				      frame->true_offset);
+	}
+
+	for (p = &stack_table[h & STACK_TABLE_MASK]; (e = *p);
+	     p = &e->hash_next) {
+		if (e->hash != h || e->nframes != stack->nframes)
+			continue;
+		for (i = 0; i < e->nframes; i++) {
+			if (e->frames[i].binary_filename !=
+			    stack->frames[i].binary_filename ||
+			    e->frames[i].true_offset !=
+			    stack->frames[i].true_offset ||
+			    e->frames[i].error != stack->frames[i].error)
+				break;
+		}
+		if (i == e->nframes)
+			return e;
+	}
+
+	e = xmalloc(sizeof(*e) + stack->nframes * sizeof(e->frames[0]));
+	e->id = ++stack_table_ids;
+	e->hash = h;
+	e->nframes = stack->nframes;
+	memcpy(e->frames, stack->frames, stack->nframes * sizeof(e->frames[0]));
+	e->hash_next = NULL;
+	*p = e;
+
+	DPRINTF("id=%lu, frames=%u", "stack-add", e->id, e->nframes);
+
+	return e;
+}
+
+/*
+ * Returns true if the stack table entry ID has been printed
+ * to the output of TCP already, marks it printed otherwise.
+ */
+static bool
+stack_id_printed(struct tcb *tcp, unsigned long id)
+{
+	struct stack_ids_printed *p = followfork >= 2 ?
+		&tcp->queue->printed : &stack_ids_printed;
+	unsigned char bit = 1 << (id % 8);
+
+	if (id / 8 >= p->size) {
+		unsigned long size = p->size ? p->size : 64;
+
+		while (id / 8 >= size)
+			size *= 2;
+		p->bits = xreallocarray(p->bits, size, 1);
+		memset(p->bits + p->size, 0, size - p->size);
+		p->size = size;
+	}
+
+	if (p->bits[id / 8] & bit)
+		return true;
+	p->bits[id / 8] |= bit;
+
+	return false;
+}
+
 /*
  * printing an entry in stack to stream or buffer
  */
@@ -392,151 +1132,56 @@ stacktrace_walk(struct tcb *tcp,
  * /lib64/libc.so.6(__libc_start_main+0xed) [0x7fa2f8a5976d]
  * ./a.out() [0x400569]
  */
-#define STACK_ENTRY_SYMBOL_FMT			\
-	" > %s(%s+0x%lx) [0x%lx]\n",		\
-	binary_filename,			\
-	symbol_name,				\
-	(unsigned long) function_offset,	\
-	true_offset
-#define STACK_ENTRY_NOSYMBOL_FMT		\
-	" > %s() [0x%lx]\n",			\
-	binary_filename, true_offset
-#define STACK_ENTRY_BUG_FMT			\
-	" > BUG IN %s\n"
-#define STACK_ENTRY_ERROR_WITH_OFFSET_FMT	\
-	" > %s [0x%lx]\n", error, true_offset
-#define STACK_ENTRY_ERROR_FMT			\
-	" > %s\n", error
-
-static void
-print_call_cb(void *dummy,
-	      const char *binary_filename,
-	      const char *symbol_name,
-	      unw_word_t function_offset,
-	      unsigned long true_offset)
-{
-	if (symbol_name && (symbol_name[0] != '\0'))
-		tprintf(STACK_ENTRY_SYMBOL_FMT);
-	else if (binary_filename)
-		tprintf(STACK_ENTRY_NOSYMBOL_FMT);
-	else
-		tprintf(STACK_ENTRY_BUG_FMT, __FUNCTION__);
-
-	line_ended();
-}
-
 static void
-print_error_cb(void *dummy,
-	       const char *error,
-	       unsigned long true_offset)
+print_stack_frame(const struct stack_frame *frame)
 {
-	if (true_offset)
-		tprintf(STACK_ENTRY_ERROR_WITH_OFFSET_FMT);
-	else
-		tprintf(STACK_ENTRY_ERROR_FMT);
+	if (frame->error) {
+		if (frame->true_offset)
+			tprintf(" > %s [0x%lx]\n",
+				frame->error, frame->true_offset);
+		else
+			tprintf(" > %s\n", frame->error);
+	} else if (frame->symbol_name && frame->symbol_name[0] != '\0') {
+		tprintf(" > %s(%s+0x%lx) [0x%lx]\n",
+			frame->binary_filename, frame->symbol_name,
+			frame->function_offset, frame->true_offset);
+	} else {
+		tprintf(" > %s() [0x%lx]\n",
+			frame->binary_filename, frame->true_offset);
+	}
 
 	line_ended();
 }
 
-static char *
-sprint_call_or_error(const char *binary_filename,
-		     const char *symbol_name,
-		     unw_word_t function_offset,
-		     unsigned long true_offset,
-		     const char *error)
-{
-       char *output_line = NULL;
-       int n;
-
-       if (symbol_name)
-               n = asprintf(&output_line, STACK_ENTRY_SYMBOL_FMT);
-       else if (binary_filename)
-               n = asprintf(&output_line, STACK_ENTRY_NOSYMBOL_FMT);
-       else if (error)
-               n = true_offset
-                       ? asprintf(&output_line, STACK_ENTRY_ERROR_WITH_OFFSET_FMT)
-                       : asprintf(&output_line, STACK_ENTRY_ERROR_FMT);
-       else
-               n = asprintf(&output_line, STACK_ENTRY_BUG_FMT, __FUNCTION__);
-
-       if (n < 0)
-               error_msg_and_die("error in asprintf");
-
-       return output_line;
-}
-
 /*
- * queue manipulators
+ * With -K a stack trace is printed once to every output, preceded by
+ * its id in the stack table, and only the id is printed later on.
  */
 static void
-queue_put(struct queue_t *queue,
-	  const char *binary_filename,
-	  const char *symbol_name,
-	  unw_word_t function_offset,
-	  unsigned long true_offset,
-	  const char *error)
+print_stack_trace(struct tcb *tcp, const struct stack_trace *stack)
 {
-	struct call_t *call;
+	unsigned long id = 0;
+	bool printed = false;
+	unsigned int i;
 
-	call = xmalloc(sizeof(*call));
-	call->output_line = sprint_call_or_error(binary_filename,
-						 symbol_name,
-						 function_offset,
-						 true_offset,
-						 error);
-	call->next = NULL;
-
-	if (!queue->head) {
-		queue->head = call;
-		queue->tail = call;
-	} else {
-		queue->tail->next = call;
-		queue->tail = call;
+	if (stack_trace_ids) {
+		id = stack_table_get(stack)->id;
+		printed = stack_id_printed(tcp, id);
 	}
-}
 
-static void
-queue_put_call(void *queue,
-	       const char *binary_filename,
-	       const char *symbol_name,
-	       unw_word_t function_offset,
-	       unsigned long true_offset)
-{
-	queue_put(queue,
-		  binary_filename,
-		  symbol_name,
-		  function_offset,
-		  true_offset,
-		  NULL);
-}
-
-static void
-queue_put_error(void *queue,
-		const char *error,
-		unsigned long ip)
-{
-	queue_put(queue, NULL, NULL, 0, ip, error);
-}
-
-static void
-queue_print(struct queue_t *queue)
-{
-	struct call_t *call, *tmp;
-
-	queue->tail = NULL;
-	call = queue->head;
-	queue->head = NULL;
-	while (call) {
-		tmp = call;
-		call = call->next;
+	if (s_printer_cur->print_stack) {
+		s_syscall_print_stack(tcp, id, printed ? NULL : stack->frames,
+				      printed ? 0 : stack->nframes);
+		return;
+	}
 
-		tprints(tmp->output_line);
+	if (id) {
+		tprintf(" > stack %lu%s\n", id, printed ? "" : ":");
 		line_ended();
-
-		free(tmp->output_line);
-		tmp->output_line = NULL;
-		tmp->next = NULL;
-		free(tmp);
+	}
+	if (!printed) {
+		for (i = 0; i < stack->nframes; i++)
+			print_stack_frame(&stack->frames[i]);
 	}
 }
 
@@ -546,20 +1191,24 @@ queue_print(struct queue_t *queue)
 void
 unwind_print_stacktrace(struct tcb* tcp)
 {
+	static struct stack_trace walked;
+
 #if SUPPORTED_PERSONALITIES > 1
 	if (tcp->currpers != DEFAULT_PERSONALITY) {
 		/* disable strack trace */
 		return;
 	}
 #endif
-       if (tcp->queue->head) {
-	       DPRINTF("tcp=%p, queue=%p", "queueprint", tcp, tcp->queue->head);
-	       queue_print(tcp->queue);
-       }
-       else if (rebuild_cache_if_invalid(tcp, __FUNCTION__)) {
-               DPRINTF("tcp=%p, queue=%p", "stackprint", tcp, tcp->queue->head);
-               stacktrace_walk(tcp, print_call_cb, print_error_cb, NULL);
-       }
+	if (tcp->queue->captured) {
+		DPRINTF("tcp=%p, frames=%u", "queueprint",
+			tcp, tcp->queue->stack.nframes);
+		tcp->queue->captured = false;
+		print_stack_trace(tcp, &tcp->queue->stack);
+	} else if (rebuild_cache_if_invalid(tcp)) {
+		DPRINTF("tcp=%p", "stackprint", tcp);
+		stacktrace_walk(tcp, &walked);
+		print_stack_trace(tcp, &walked);
+	}
 }
 
 /*
@@ -574,12 +1223,159 @@ unwind_capture_stacktrace(struct tcb *tcp)
 		return;
 	}
 #endif
-	if (tcp->queue->head)
+	if (tcp->queue->captured)
 		error_msg_and_die("bug: unprinted entries in queue");
 
-	if (rebuild_cache_if_invalid(tcp, __FUNCTION__)) {
-		stacktrace_walk(tcp, queue_put_call, queue_put_error,
-				tcp->queue);
-		DPRINTF("tcp=%p, queue=%p", "captured", tcp, tcp->queue->head);
+	if (rebuild_cache_if_invalid(tcp)) {
+		stacktrace_walk(tcp, &tcp->queue->stack);
+		tcp->queue->captured = true;
+		DPRINTF("tcp=%p, frames=%u", "captured",
+			tcp, tcp->queue->stack.nframes);
+	}
+}
+
+/* Returns the name of the process of TCP, as it is in /proc/ID/comm. */
+static const char *
+process_comm(struct tcb *tcp)
+{
+	struct mmap_cache *c = mmap_cache_get(tcp);
+	char filename[sizeof("/proc/%d/comm") + sizeof(int) * 3];
+	char buf[64];
+	FILE *fp;
+
+	if (c->comm)
+		return c->comm;
+
+	sprintf(filename, "/proc/%d/comm", c->tgid);
+	fp = fopen_for_input(filename, "r");
+	if (fp && fgets(buf, sizeof(buf), fp))
+		buf[strcspn(buf, "\n")] = '\0';
+	else
+		sprintf(buf, "%d", c->tgid);
+	if (fp)
+		fclose(fp);
+
+	c->comm = intern_name(buf);
+
+	return c->comm;
+}
+
+/*
+ * -c -k: adds the time TV of the syscall to the off-CPU profile,
+ * of the process PID if -g is given.
+ */
+void
+unwind_count_syscall(struct tcb *tcp, int pid, const struct timeval *tv)
+{
+	static struct stack_trace walked;
+	const struct stack_table_entry *stack;
+	const char *comm;
+	struct offcpu_entry **p;
+	struct offcpu_entry *e;
+	uint32_t h;
+
+	walked.nframes = 0;
+	if (
+#if SUPPORTED_PERSONALITIES > 1
+	    tcp->currpers == DEFAULT_PERSONALITY &&
+#endif
+	    rebuild_cache_if_invalid(tcp))
+		stacktrace_walk(tcp, &walked);
+	stack = stack_table_get(&walked);
+	comm = process_comm(tcp);
+
+	h = ptr_hash(stack, pid) ^
+	    ptr_hash(comm, (uintptr_t) tcp->s_ent->sys_name);
+	for (p = &offcpu_table[h & OFFCPU_TABLE_MASK]; (e = *p);
+	     p = &e->hash_next) {
+		if (e->stack == stack && e->pid == pid && e->comm == comm &&
+		    e->sys_name == tcp->s_ent->sys_name)
+			break;
+	}
+
+	if (!e) {
+		e = xcalloc(1, sizeof(*e));
+		e->comm = comm;
+		e->pid = pid;
+		e->stack = stack;
+		e->sys_name = tcp->s_ent->sys_name;
+		*p = e;
+		offcpu_entries++;
 	}
+
+	e->usec += tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+/* Semicolons separate the frames of folded stacks. */
+static void
+print_folded_name(FILE *outf, const char *name)
+{
+	for (; *name; name++)
+		fputc(*name == ';' ? ':' : *name, outf);
+}
+
+static void
+print_folded_frame(FILE *outf, const struct stack_frame *frame)
+{
+	const char *base;
+
+	if (frame->error) {
+		fputs("[unknown]", outf);
+	} else if (frame->symbol_name && frame->symbol_name[0] != '\0') {
+		print_folded_name(outf, frame->symbol_name);
+	} else {
+		base = strrchr(frame->binary_filename, '/');
+		print_folded_name(outf, base ? base + 1
+					     : frame->binary_filename);
+		fprintf(outf, "+0x%lx", frame->true_offset);
+	}
+}
+
+static int
+offcpu_entry_cmp(const void *a, const void *b)
+{
+	const struct offcpu_entry *ea = *(const struct offcpu_entry **) a;
+	const struct offcpu_entry *eb = *(const struct offcpu_entry **) b;
+
+	return ea->usec < eb->usec ? 1 : ea->usec > eb->usec ? -1 : 0;
+}
+
+/*
+ * Prints the off-CPU profile in the folded stack format of flame graph
+ * tools: the process name, the frames of the stack trace from the
+ * outermost one and the syscall, separated by semicolons, followed
+ * by the time in microseconds.
+ */
+void
+unwind_print_folded(FILE *outf)
+{
+	struct offcpu_entry **sorted;
+	struct offcpu_entry *e;
+	unsigned int i, n = 0;
+
+	if (!offcpu_entries)
+		return;
+
+	sorted = xcalloc(offcpu_entries, sizeof(*sorted));
+	for (i = 0; i < OFFCPU_TABLE_SIZE; i++)
+		for (e = offcpu_table[i]; e; e = e->hash_next)
+			sorted[n++] = e;
+	qsort(sorted, n, sizeof(*sorted), offcpu_entry_cmp);
+
+	for (i = 0; i < n; i++) {
+		const struct stack_table_entry *stack = sorted[i]->stack;
+		unsigned int j;
+
+		print_folded_name(outf, sorted[i]->comm);
+		if (sorted[i]->pid)
+			fprintf(outf, "-%d", sorted[i]->pid);
+		for (j = stack->nframes; j > 0; j--) {
+			fputc(';', outf);
+			print_folded_frame(outf, &stack->frames[j - 1]);
+		}
+		fprintf(outf, ";%s %llu\n", sorted[i]->sys_name,
+			sorted[i]->usec);
+	}
+
+	free(sorted);
 }
@@ -205,6 +205,32 @@ next_set_bit(const void *bit_array, unsigned cur_bit, unsigned size_bits)
 	}
 }
 
+/* Reads the thread group id and the number of threads of PID from /proc */
+void
+read_proc_status(int pid, int *tgid, unsigned int *threads)
+{
+	char path[sizeof("/proc/%u/status") + sizeof(int)*3];
+	char buf[256];
+	FILE *fp;
+
+	*tgid = pid;
+	*threads = 1;
+
+	sprintf(path, "/proc/%u/status", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "Tgid: %d", tgid) == 1)
+			continue;
+		if (sscanf(buf, "Threads: %u", threads) == 1)
+			break;
+	}
+
+	fclose(fp);
+}
+
 unsigned int
 popcount32(const uint32_t *a, unsigned int size)
 {
@@ -499,7 +525,7 @@ const char *
 sprinttime(time_t t)
 {
 	struct tm *tmp;
-	static char buf[sizeof(int) * 3 * 6];
+	static __thread char buf[sizeof(int) * 3 * 6];
 
 	if (t == 0) {
 		strcpy(buf, "0");
@@ -524,14 +550,18 @@ getfdproto(struct tcb *tcp, int fd)
 	char buf[bufsize];
 	ssize_t r;
 	char path[sizeof("/proc/%u/fd/%u") + 2 * sizeof(int)*3];
+	enum sock_proto proto;
 
 	if (fd < 0)
 		return SOCK_PROTO_UNKNOWN;
 
+	if (fdtable_get_proto(tcp, fd, &proto))
+		return proto;
+
 	sprintf(path, "/proc/%u/fd/%u", tcp->pid, fd);
 	r = getxattr(path, "system.sockprotoname", buf, bufsize - 1);
 	if (r <= 0)
-		return SOCK_PROTO_UNKNOWN;
+		proto = SOCK_PROTO_UNKNOWN;
 	else {
 		/*
 		 * This is a protection for the case when the kernel
@@ -539,8 +569,11 @@ getfdproto(struct tcb *tcp, int fd)
 		 */
 		buf[r] = '\0';
 
-		return get_proto_by_name(buf);
+		proto = get_proto_by_name(buf);
 	}
+
+	fdtable_set_proto(tcp, fd, proto);
+	return proto;
 #else
 	return SOCK_PROTO_UNKNOWN;
 #endif
@@ -969,6 +1002,7 @@ dumpiov_upto(struct tcb *tcp, int len, long addr, unsigned long data_size)
 		return;
 	}
 	if (umoven(tcp, addr, size, iov) >= 0) {
+		umove_prefetch_iov(tcp, len, addr, data_size, -1UL);
 		for (i = 0; i < len; i++) {
 			unsigned long iov_len = iov_iov_len(i);
 			if (iov_len > data_size)
@@ -1116,11 +1150,258 @@ vm_read_mem(pid_t pid, void *laddr, long raddr, size_t len)
 }
 
 /*
- * move `len' bytes of data from process `pid'
- * at address `addr' to our space at `our_addr'
+ * Cache of tracee memory read during the current stop.  Decoders tend to
+ * fetch many small adjacent objects, so the first read fetches the whole
+ * aligned window around the object, and subsequent reads are served from
+ * the cache until any tracee is resumed.  Windows never cross pages, and
+ * reads that fail are repeated uncached, so that errors are reported
+ * as before.
  */
-int
-umoven(struct tcb *tcp, long addr, unsigned int len, void *our_addr)
+#define UMOVE_CACHE_LINES	8
+#define UMOVE_CACHE_LINE_SIZE	1024
+
+struct umove_cache_line {
+	struct tcb *tcp;
+	unsigned long generation;
+	unsigned long addr;
+	char data[UMOVE_CACHE_LINE_SIZE];
+};
+
+static struct umove_cache_line *umove_cache;
+static unsigned int umove_cache_next;
+/* Starts from 1, so that zeroed lines are never valid */
+static unsigned long umove_cache_generation = 1;
+
+unsigned long umove_cache_hits;
+unsigned long umove_cache_misses;
+
+void
+umove_cache_invalidate(void)
+{
+	umove_cache_generation++;
+}
+
+static const char *
+umove_cache_get(struct tcb *tcp, unsigned long addr)
+{
+	struct umove_cache_line *line;
+	unsigned int i;
+
+	if (!umove_cache)
+		umove_cache = xcalloc(UMOVE_CACHE_LINES, sizeof(*umove_cache));
+
+	addr &= -UMOVE_CACHE_LINE_SIZE;
+
+	for (i = 0; i < UMOVE_CACHE_LINES; i++) {
+		line = &umove_cache[i];
+		if (line->generation == umove_cache_generation &&
+		    line->tcp == tcp && line->addr == addr) {
+			umove_cache_hits++;
+			return line->data;
+		}
+	}
+
+	umove_cache_misses++;
+
+	line = &umove_cache[umove_cache_next];
+	line->generation = 0;
+	if (vm_read_mem(tcp->pid, line->data, addr, UMOVE_CACHE_LINE_SIZE) !=
+	    UMOVE_CACHE_LINE_SIZE)
+		return NULL;
+
+	line->tcp = tcp;
+	line->addr = addr;
+	line->generation = umove_cache_generation;
+	umove_cache_next = (umove_cache_next + 1) % UMOVE_CACHE_LINES;
+
+	return line->data;
+}
+
+/*
+ * Copy LEN bytes at ADDR to LADDR through the cache.
+ * Returns the number of bytes copied, which is less than LEN
+ * if the memory could not be read.
+ */
+static unsigned int
+umove_cached(struct tcb *tcp, unsigned long addr, unsigned int len,
+	     char *laddr)
+{
+	unsigned int nread = 0;
+
+	while (nread < len) {
+		const char *data = umove_cache_get(tcp, addr);
+		unsigned int offs = addr & (UMOVE_CACHE_LINE_SIZE - 1);
+		unsigned int m;
+
+		if (!data)
+			break;
+
+		m = MIN(UMOVE_CACHE_LINE_SIZE - offs, len - nread);
+		memcpy(laddr, data + offs, m);
+		addr += m;
+		laddr += m;
+		nread += m;
+	}
+
+	return nread;
+}
+
+/*
+ * Buffers referenced by an iovec array, gathered from the tracee with
+ * a few process_vm_readv calls by umove_prefetch_iov, and served by
+ * umoven until any tracee is resumed.
+ */
+struct umove_prefetch_seg {
+	unsigned long addr;
+	unsigned long len;
+	size_t offs;
+};
+
+static struct {
+	struct tcb *tcp;
+	unsigned long generation;
+	struct umove_prefetch_seg *segs;
+	unsigned int nsegs;
+	unsigned int segs_size;
+	/* Index of the last segment found */
+	unsigned int hint;
+	char *buf;
+	size_t buf_size;
+} umove_prefetch;
+
+unsigned long umove_gather_reads;
+unsigned long umove_gather_bufs;
+
+static bool
+umove_prefetched(struct tcb *tcp, unsigned long addr, unsigned int len,
+		 void *laddr)
+{
+	const struct umove_prefetch_seg *seg;
+	unsigned int i, n;
+
+	if (!umove_prefetch.nsegs || umove_prefetch.tcp != tcp ||
+	    umove_prefetch.generation != umove_cache_generation)
+		return false;
+
+	for (n = 0, i = umove_prefetch.hint; n < umove_prefetch.nsegs;
+	     n++, i = (i + 1) % umove_prefetch.nsegs) {
+		seg = &umove_prefetch.segs[i];
+		if (addr >= seg->addr && addr - seg->addr <= seg->len &&
+		    len <= seg->len - (addr - seg->addr)) {
+			memcpy(laddr, umove_prefetch.buf + seg->offs +
+				      (addr - seg->addr), len);
+			umove_prefetch.hint = i;
+			umove_cache_hits++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Read the array of LEN iovecs at ADDR and gather up to DATA_SIZE bytes
+ * of the buffers it references, at most BUF_LIMIT bytes of each buffer.
+ */
+void
+umove_prefetch_iov(struct tcb *tcp, unsigned long len, unsigned long addr,
+		   unsigned long data_size, unsigned long buf_limit)
+{
+	const unsigned int sizeof_iov = current_wordsize * 2;
+	struct iovec remote[IOV_MAX];
+	struct iovec local;
+	union {
+		uint32_t iov32[IOV_MAX * 2];
+		uint64_t iov64[IOV_MAX * 2];
+	} iovu;
+	unsigned long base, iov_len;
+	size_t total = 0;
+	unsigned int i, n, cnt = 0;
+	ssize_t r;
+
+	umove_prefetch.nsegs = 0;
+
+	/* -j binary,raw and -L need every read to go through umoven */
+	if (process_vm_readv_not_supported || record_raw || replay_raw ||
+	    !addr || !len || !data_size || !buf_limit)
+		return;
+	if (len > IOV_MAX)
+		len = IOV_MAX;
+	if (umoven(tcp, addr, len * sizeof_iov, &iovu) < 0)
+		return;
+
+	if (umove_prefetch.segs_size < len) {
+		umove_prefetch.segs_size = len;
+		umove_prefetch.segs =
+			xreallocarray(umove_prefetch.segs, len,
+				      sizeof(*umove_prefetch.segs));
+	}
+
+	for (i = 0; i < len && data_size; i++) {
+		if (sizeof_iov == 8) {
+			base = iovu.iov32[i * 2];
+			iov_len = iovu.iov32[i * 2 + 1];
+		} else {
+			base = iovu.iov64[i * 2];
+			iov_len = iovu.iov64[i * 2 + 1];
+		}
+		iov_len = MIN(iov_len, data_size);
+		data_size -= iov_len;
+		iov_len = MIN(iov_len, buf_limit);
+		if (!base || !iov_len)
+			continue;
+
+		remote[cnt].iov_base = (void *) base;
+		remote[cnt].iov_len = iov_len;
+		umove_prefetch.segs[cnt].addr = base;
+		umove_prefetch.segs[cnt].len = iov_len;
+		umove_prefetch.segs[cnt].offs = total;
+		total += iov_len;
+		cnt++;
+	}
+
+	if (!cnt)
+		return;
+
+	if (umove_prefetch.buf_size < total) {
+		free(umove_prefetch.buf);
+		umove_prefetch.buf = xmalloc(total);
+		umove_prefetch.buf_size = total;
+	}
+
+	/*
+	 * Buffers up to the first one that cannot be read are gathered
+	 * at once, the rest is retried starting from the next buffer.
+	 */
+	for (i = 0; i < cnt; ) {
+		local.iov_base = umove_prefetch.buf + umove_prefetch.segs[i].offs;
+		local.iov_len = total - umove_prefetch.segs[i].offs;
+
+		r = process_vm_readv(tcp->pid, &local, 1, &remote[i],
+				     cnt - i, 0);
+		umove_gather_reads++;
+		if (r < 0)
+			r = 0;
+
+		for (n = i; n < cnt; n++) {
+			if ((size_t) r < umove_prefetch.segs[n].len)
+				break;
+			r -= umove_prefetch.segs[n].len;
+			umove_prefetch.segs[umove_prefetch.nsegs++] =
+				umove_prefetch.segs[n];
+			umove_gather_bufs++;
+		}
+
+		i = n + 1;
+	}
+
+	umove_prefetch.tcp = tcp;
+	umove_prefetch.generation = umove_cache_generation;
+	umove_prefetch.hint = 0;
+}
+
+static int
+umoven_tracee(struct tcb *tcp, long addr, unsigned int len, void *our_addr)
 {
 	char *laddr = our_addr;
 	int pid = tcp->pid;
@@ -1136,7 +1417,16 @@ umoven(struct tcb *tcp, long addr, unsigned int len, void *our_addr)
 #endif
 
 	if (!process_vm_readv_not_supported) {
-		int r = vm_read_mem(pid, laddr, addr, len);
+		int r;
+
+		if (umove_prefetched(tcp, addr, len, laddr))
+			return 0;
+
+		if (len <= UMOVE_CACHE_LINE_SIZE &&
+		    umove_cached(tcp, addr, len, laddr) == len)
+			return 0;
+
+		r = vm_read_mem(pid, laddr, addr, len);
 		if ((unsigned int) r == len)
 			return 0;
 		if (r >= 0) {
@@ -1226,6 +1516,25 @@ umoven(struct tcb *tcp, long addr, unsigned int len, void *our_addr)
 	return 0;
 }
 
+/*
+ * move `len' bytes of data from process `pid'
+ * at address `addr' to our space at `our_addr'
+ */
+int
+umoven(struct tcb *tcp, long addr, unsigned int len, void *our_addr)
+{
+	int rc;
+
+	if (replay_raw)
+		return replay_mem(tcp, addr, len, our_addr, false);
+
+	rc = umoven_tracee(tcp, addr, len, our_addr);
+	if (record_raw)
+		record_mem(tcp, addr, len, our_addr, rc, false);
+
+	return rc;
+}
+
 int
 umoven_or_printaddr(struct tcb *tcp, const long addr, const unsigned int len,
 		    void *our_addr)
@@ -1250,8 +1559,8 @@ umoven_or_printaddr(struct tcb *tcp, const long addr, const unsigned int len,
  * in laddr[] _after_ terminating NUL (but, of course,
  * we never write past laddr[len-1]).
  */
-int
-umovestr(struct tcb *tcp, long addr, unsigned int len, char *laddr)
+static int
+umovestr_tracee(struct tcb *tcp, long addr, unsigned int len, char *laddr)
 {
 #if SIZEOF_LONG == 4
 	const unsigned long x01010101 = 0x01010101ul;
@@ -1294,7 +1603,19 @@ umovestr(struct tcb *tcp, long addr, unsigned int len, char *laddr)
 			if (chunk_len > end_in_page) /* crosses to the next page */
 				chunk_len -= end_in_page;
 
-			int r = vm_read_mem(pid, laddr, addr, chunk_len);
+			/*
+			 * Most strings are short, read the first chunk
+			 * through the cache, the rest is read directly.
+			 */
+			int r = 0;
+			if (!nread) {
+				unsigned int line_end = UMOVE_CACHE_LINE_SIZE -
+					(addr & (UMOVE_CACHE_LINE_SIZE - 1));
+				r = umove_cached(tcp, addr,
+						 MIN(chunk_len, line_end), laddr);
+			}
+			if (!r)
+				r = vm_read_mem(pid, laddr, addr, chunk_len);
 			if (r > 0) {
 				if (memchr(laddr, '\0', r))
 					return 1;
@@ -1400,6 +1721,82 @@ umovestr(struct tcb *tcp, long addr, unsigned int len, char *laddr)
 	return 0;
 }
 
+/* See umovestr_tracee, -j binary,raw and -L are handled as in umoven */
+int
+umovestr(struct tcb *tcp, long addr, unsigned int len, char *laddr)
+{
+	int rc;
+
+	if (replay_raw)
+		return replay_mem(tcp, addr, len, laddr, true);
+
+	rc = umovestr_tracee(tcp, addr, len, laddr);
+	if (record_raw)
+		record_mem(tcp, addr, len, laddr, rc, true);
+
+	return rc;
+}
+
+#define UMOVE_ARRAY_CHUNK_SIZE	(64 * 1024)
+
+/*
+ * Return a pointer to the array element at ADDR fetched along with the
+ * following elements up to END_ADDR, at most UMOVE_ARRAY_CHUNK_SIZE bytes
+ * at a time, instead of reading elements one by one.
+ *
+ * Returns NULL if the element cannot be fetched this way, the caller
+ * is expected to fetch it by other means then, so that errors are
+ * reported the usual way.  ARR should be zeroed before the first call
+ * and released with umove_array_free afterwards.
+ */
+const void *
+umove_array_elem(struct tcb *tcp, struct umove_array *arr,
+		 unsigned long addr, unsigned long end_addr, size_t elem_size)
+{
+	size_t size;
+	ssize_t r;
+
+	if (addr >= arr->start && addr + elem_size <= arr->end)
+		return arr->buf + (addr - arr->start);
+
+	if (arr->failed || process_vm_readv_not_supported ||
+	    record_raw || replay_raw || end_addr <= addr)
+		return NULL;
+
+#if SUPPORTED_PERSONALITIES > 1 && SIZEOF_LONG > 4
+	if (current_wordsize < sizeof(addr) &&
+	    end_addr > (1ul << 8 * current_wordsize))
+		return NULL;
+#endif
+
+	size = MIN(end_addr - addr, UMOVE_ARRAY_CHUNK_SIZE);
+	size = MAX(size / elem_size, 1) * elem_size;
+
+	if (arr->size < size) {
+		free(arr->buf);
+		arr->buf = xmalloc(size);
+		arr->size = size;
+	}
+
+	r = vm_read_mem(tcp->pid, arr->buf, addr, size);
+	if (r < (ssize_t) elem_size) {
+		arr->failed = true;
+		return NULL;
+	}
+
+	arr->start = addr;
+	arr->end = addr + r / elem_size * elem_size;
+
+	return arr->buf;
+}
+
+void
+umove_array_free(struct umove_array *arr)
+{
+	free(arr->buf);
+	memset(arr, 0, sizeof(*arr));
+}
+
 /*
  * Iteratively fetch and print up to nmemb elements of elem_size size
  * from the array that starts at tracee's address start_addr.
@@ -1407,7 +1804,10 @@ umovestr(struct tcb *tcp, long addr, unsigned int len, char *laddr)
  * Array elements are being fetched to the address specified by elem_buf.
  *
  * The fetcher callback function specified by umoven_func should follow
- * the same semantics as umoven_or_printaddr function.
+ * the same semantics as umoven_or_printaddr function.  If it is
+ * umoven_or_printaddr itself, the elements after the first one are fetched
+ * at once; other fetchers, which may convert the elements fetched (e.g. from
+ * another personality), are called for every element.
  *
  * The printer callback function specified by print_func is expected
  * to print something; if it returns false, no more iterations will be made.
@@ -1471,14 +1871,30 @@ print_array(struct tcb *tcp,
 	const unsigned long abbrev_end =
 		(abbrev(tcp) && max_strlen < nmemb) ?
 			start_addr + elem_size * max_strlen : end_addr;
+	/* The element at abbrev_end is fetched before "..." is printed. */
+	const unsigned long fetch_end =
+		abbrev_end < end_addr ? abbrev_end + elem_size : end_addr;
+	/* Elements fetched at once are copied as is */
+	const bool bulk = umoven_func == umoven_or_printaddr;
+	struct umove_array arr = {};
+	const void *elem;
 	unsigned long cur;
 
 	for (cur = start_addr; cur < end_addr; cur += elem_size) {
 		if (cur != start_addr)
 			tprints(", ");
 
-		if (umoven_func(tcp, cur, elem_size, elem_buf))
+		/*
+		 * The first element is fetched by umoven_func, the rest
+		 * are fetched at once, unless that fails.
+		 */
+		if (bulk && cur != start_addr &&
+		    (elem = umove_array_elem(tcp, &arr, cur, fetch_end,
+					     elem_size))) {
+			memcpy(elem_buf, elem, elem_size);
+		} else if (umoven_func(tcp, cur, elem_size, elem_buf)) {
 			break;
+		}
 
 		if (cur == start_addr)
 			tprints("[");
@@ -1497,6 +1913,8 @@ print_array(struct tcb *tcp,
 	if (cur != start_addr)
 		tprints("]");
 
+	umove_array_free(&arr);
+
 	return cur >= end_addr;
 }
 